@@ -0,0 +1,39 @@
+#!/bin/sh
+# Lines up two build/microbench (or two build/replay) runs and shows what moved:
+#
+#   bench/compare.sh before.tsv after.tsv
+#
+# One line per benchmark found in both: the two medians (ns per operation, or CPU ms
+# per replay) and the change. A change only gets a `*` when it's bigger than the
+# noise, that is more than twice the larger of the two runs' relative standard
+# deviations, and more than 2%.
+set -e
+if [ $# -ne 2 ]; then
+    echo "usage: $0 before.tsv after.tsv" >&2
+    exit 2
+fi
+
+awk -F '\t' '
+    function noise(median, stddev) { return median > 0 ? stddev / median : 0 }
+    /^#/ { next }
+    FNR == NR {
+        key = $1 FS $2
+        before[key] = $3
+        spread[key] = noise($3, $5)
+        next
+    }
+    {
+        key = $1 FS $2
+        if (!(key in before)) { next }
+        if (!header++) {
+            printf "%-32s %-8s %10s %10s %8s\n", "benchmark", "engine", "before", "after", "change"
+        }
+        change = before[key] > 0 ? ($3 - before[key]) / before[key] : 0
+        limit = noise($3, $5)
+        if (spread[key] > limit) { limit = spread[key] }
+        limit *= 2
+        if (limit < 0.02) { limit = 0.02 }
+        mark = (change > limit || change < -limit) ? " *" : ""
+        printf "%-32s %-8s %10.3f %10.3f %+7.1f%%%s\n", $1, $2, before[key], $3, change * 100, mark
+    }
+' "$1" "$2"
@@ -0,0 +1,388 @@
+// Microbenchmarks
+// Whole-program timings (bench/train.sh) say "2048 got slower"; these say "LDI got
+// slower". Each benchmark does a fixed amount of work a number of times over and
+// reports nanoseconds per operation, one line per benchmark, tab-separated:
+//   name  engine  median  mean  stddev  min  samples
+// bench/compare.sh lines two of these files up and shows what moved.
+//
+//   build/microbench [-n samples] [filter]
+//
+// Only benchmarks whose name contains `filter` run. Build it with `./build.sh bench`.
+//
+// Instructions are timed by running a page of copies of the same instruction through
+// vmtoy_run_for(), with a branch back to the top at the end of the page (so 1 in 256
+// is a BR), or, for jumps, a single instruction that jumps to itself. Either way every
+// instruction the budget pays for is the one being measured.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+#define CODE 0x3000
+#define DATA 0x4000
+#define TEXT 0x5000
+
+// The ways the library can run guest code. Each one gets every instruction benchmark.
+static const struct engine {
+    const char* name;
+    unsigned flags;
+} engines[] = {
+    { "switch", 0 },
+    { "predecode", VMTOY_F_PREDECODE },
+};
+
+static int samples = 15;
+static const char* filter;
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int by_value(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Calls fn(arg, ops) once to warm up, then `samples` more times against the clock.
+static void measure(const char* name, const char* engine, uint64_t ops,
+                    void (*fn)(void* arg, uint64_t ops), void* arg)
+{
+    if (filter && !strstr(name, filter)) { return; }
+
+    double t[samples];
+    fn(arg, ops);
+    for (int i = 0; i < samples; ++i) {
+        double start = now_ns();
+        fn(arg, ops);
+        t[i] = (now_ns() - start) / (double)ops;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < samples; ++i) { sum += t[i]; }
+    double mean = sum / samples;
+    double var = 0;
+    for (int i = 0; i < samples; ++i) { var += (t[i] - mean) * (t[i] - mean); }
+    double stddev = samples > 1 ? sqrt(var / (samples - 1)) : 0;
+    qsort(t, (size_t)samples, sizeof(t[0]), by_value);
+    double median = samples % 2 ? t[samples / 2] : (t[samples / 2 - 1] + t[samples / 2]) / 2;
+
+    printf("%s\t%s\t%.3f\t%.3f\t%.3f\t%.3f\t%d\n", name, engine, median, mean, stddev, t[0], samples);
+    fflush(stdout);
+}
+
+// Keeps the compiler from working out the answer ahead of time or doing eight at once.
+#define OPAQUE(x) __asm__ volatile("" : "+r"(x))
+
+// A keyboard that always has an 'a' ready and a console that throws everything away.
+static int null_read(void* ctx) { return 'a'; }
+static int null_poll(void* ctx) { return 1; }
+static int null_write(void* ctx, int ch) { return 0; }
+
+static const vmtoy_io null_io = { null_read, null_poll, null_write, NULL, NULL };
+
+// Instructions
+
+struct insn_bench {
+    const char* name;
+    uint16_t instr;
+    int self_loop;   // It jumps to itself; no page of copies.
+};
+
+// Registers: R1 points at data, R3 at the code (for the jumps), R4 at a device register,
+// R0 at a 16 character string for PUTS and PUTSP.
+static const struct insn_bench insns[] = {
+    { "ADD reg", 0x1002, 0 },         // ADD R0, R0, R2
+    { "ADD imm", 0x1021, 0 },         // ADD R0, R0, #1
+    { "AND reg", 0x5002, 0 },         // AND R0, R0, R2
+    { "AND imm", 0x503F, 0 },         // AND R0, R0, #-1
+    { "NOT", 0x903F, 0 },             // NOT R0, R0
+    { "BR not taken", 0x0800, 0 },    // BRn #0, with Z set
+    { "BR taken", 0x0FFF, 1 },        // BRnzp #-1
+    { "JMP", 0xC0C0, 1 },             // JMP R3
+    { "JSR", 0x4FFF, 1 },             // JSR #-1
+    { "JSRR", 0x40C0, 1 },            // JSRR R3
+    { "LD", 0x20FF, 0 },              // LD R0, #255
+    { "LDI", 0xA0FF, 0 },             // LDI R0, #255
+    { "LDR", 0x6040, 0 },             // LDR R0, R1, #0
+    { "LDR device", 0x6100, 0 },      // LDR R0, R4, #0 (HARTID)
+    { "LEA", 0xE0FF, 0 },             // LEA R0, #255
+    { "ST", 0x30FF, 0 },              // ST R0, #255
+    { "STI", 0xB0FF, 0 },             // STI R0, #255
+    { "STR", 0x7040, 0 },             // STR R0, R1, #0
+    { "RTI (unused)", 0x8000, 0 },
+    { "RES (unused)", 0xD000, 0 },
+    { "TRAP GETC", 0xF020, 0 },
+    { "TRAP OUT", 0xF021, 0 },
+    { "TRAP PUTS", 0xF022, 0 },
+    { "TRAP IN", 0xF023, 0 },
+    { "TRAP PUTSP", 0xF024, 0 },
+    { "TRAP unknown", 0xF026, 0 },
+};
+
+static vmtoy* insn_vm(const struct engine* e, const struct insn_bench* b)
+{
+    vmtoy* vm = vmtoy_create(e->flags);
+    if (!vm) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    vmtoy_set_io(vm, &null_io);
+    if (b->self_loop) {
+        vmtoy_write_mem(vm, CODE, b->instr);
+    } else {
+        for (unsigned i = 0; i < 255; ++i) {
+            vmtoy_write_mem(vm, (uint16_t)(CODE + i), b->instr);
+        }
+        vmtoy_write_mem(vm, CODE + 255, 0x0F00); // BRnzp #-256
+    }
+    // What LD/LDI/ST/STI see 255 words on: pointers to DATA.
+    for (unsigned i = 0; i < 256; ++i) {
+        vmtoy_write_mem(vm, (uint16_t)(CODE + 256 + i), DATA);
+    }
+    // 16 characters, then as packed bytes.
+    for (unsigned i = 0; i < 16; ++i) {
+        vmtoy_write_mem(vm, (uint16_t)(TEXT + i), 'a' + i);
+        vmtoy_write_mem(vm, (uint16_t)(TEXT + 32 + i / 2), (uint16_t)('b' << 8 | 'a'));
+    }
+    vmtoy_set_reg(vm, VMTOY_R0, b->instr == 0xF024 ? TEXT + 32 : TEXT);
+    vmtoy_set_reg(vm, VMTOY_R1, DATA);
+    vmtoy_set_reg(vm, VMTOY_R2, 3);
+    vmtoy_set_reg(vm, VMTOY_R3, CODE);
+    vmtoy_set_reg(vm, VMTOY_R4, MR_HARTID);
+    vmtoy_set_reg(vm, VMTOY_PC, CODE);
+    return vm;
+}
+
+static void run_insns(void* arg, uint64_t ops)
+{
+    vmtoy* vm = arg;
+    // GETC and IN change R0 and the flags as they go; put them back so each sample
+    // runs the same code.
+    uint16_t r0 = vmtoy_reg(vm, VMTOY_R0);
+    vmtoy_set_reg(vm, VMTOY_COND, 1 << 1);
+    int reason = vmtoy_run_for(vm, ops);
+    vmtoy_set_reg(vm, VMTOY_R0, r0);
+    if (reason != VMTOY_EXIT_BUDGET) {
+        fprintf(stderr, "benchmark VM stopped: %s\n", vmtoy_exit_string(reason));
+        exit(1);
+    }
+}
+
+// HALT ends the run, so each one is a vmtoy_run_for() of its own.
+static void run_halts(void* arg, uint64_t ops)
+{
+    vmtoy* vm = arg;
+    for (uint64_t i = 0; i < ops; ++i) {
+        vmtoy_set_reg(vm, VMTOY_PC, CODE);
+        vmtoy_run_for(vm, 1);
+    }
+}
+
+static void bench_insns(void)
+{
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+        const struct engine* eng = &engines[e];
+        for (size_t i = 0; i < sizeof(insns) / sizeof(insns[0]); ++i) {
+            const struct insn_bench* b = &insns[i];
+            vmtoy* vm = insn_vm(eng, b);
+            // Traps do a lot more per instruction; don't make them take all day.
+            uint64_t ops = isa_opcode(b->instr) == OP_TRAP ? 200000 : 2000000;
+            char name[64];
+            snprintf(name, sizeof(name), "insn/%s", b->name);
+            measure(name, eng->name, ops, run_insns, vm);
+            vmtoy_destroy(vm);
+        }
+
+        static const struct insn_bench halt = { "TRAP HALT", 0xF025, 0 };
+        vmtoy* vm = insn_vm(eng, &halt);
+        measure("insn/TRAP HALT (a run each)", eng->name, 200000, run_halts, vm);
+        vmtoy_destroy(vm);
+    }
+}
+
+// The inline helpers on their own
+
+struct mem_arg {
+    vmtoy* vm;
+    uint16_t base;
+    uint16_t mask;
+};
+
+static void run_mem_read(void* arg, uint64_t ops)
+{
+    struct mem_arg* m = arg;
+    uint16_t sum = 0;
+    for (uint64_t i = 0; i < ops; ++i) {
+        sum += mem_read(m->vm, (uint16_t)(m->base + ((i + sum) & m->mask)));
+        OPAQUE(sum);
+    }
+}
+
+static void run_mem_write(void* arg, uint64_t ops)
+{
+    struct mem_arg* m = arg;
+    for (uint64_t i = 0; i < ops; ++i) {
+        uint16_t v = (uint16_t)i;
+        OPAQUE(v);
+        mem_write(m->vm, (uint16_t)(m->base + (i & m->mask)), v);
+    }
+}
+
+static void run_field(void* arg, uint64_t ops)
+{
+    uint16_t x = 0;
+    for (uint64_t i = 0; i < ops; ++i) {
+        x = isa_pcoffset9((uint16_t)(x + i));
+        OPAQUE(x);
+    }
+}
+
+static void run_update_flags(void* arg, uint64_t ops)
+{
+    vmtoy* vm = arg;
+    for (uint64_t i = 0; i < ops; ++i) {
+        vm->regs[R_R0] = (uint16_t)(i * 0x9E37);
+        update_flags(vm, R_R0);
+        OPAQUE(vm->regs[R_COND]);
+    }
+}
+
+static void bench_helpers(void)
+{
+    vmtoy* flat = vmtoy_create(0);
+    vmtoy* sparse = vmtoy_create(VMTOY_F_SPARSE_MEMORY);
+    if (!flat || !sparse) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (unsigned a = DATA; a < DATA + 0x1000; ++a) {
+        vmtoy_write_mem(sparse, (uint16_t)a, (uint16_t)a);
+    }
+
+    struct mem_arg flat_ram = { flat, DATA, 0xFFF };
+    struct mem_arg sparse_ram = { sparse, DATA, 0xFFF };
+    struct mem_arg device = { flat, MR_HARTID, 0 };
+    measure("mem_read/ram", "flat", 20000000, run_mem_read, &flat_ram);
+    measure("mem_read/ram", "sparse", 20000000, run_mem_read, &sparse_ram);
+    measure("mem_read/device", "flat", 20000000, run_mem_read, &device);
+    measure("mem_write/ram", "flat", 20000000, run_mem_write, &flat_ram);
+    measure("mem_write/ram", "sparse", 20000000, run_mem_write, &sparse_ram);
+    measure("isa/pcoffset9", "-", 50000000, run_field, NULL);
+    measure("update_flags", "-", 50000000, run_update_flags, flat);
+
+    vmtoy_destroy(flat);
+    vmtoy_destroy(sparse);
+}
+
+// Loading images
+
+struct load_arg {
+    vmtoy* vm;
+    uint8_t* image;
+    size_t words;
+};
+
+static void run_load(void* arg, uint64_t ops)
+{
+    struct load_arg* l = arg;
+    for (uint64_t done = 0; done < ops; done += l->words) {
+        if (!vmtoy_load_image(l->vm, l->image, 2 + 2 * l->words)) {
+            fprintf(stderr, "image didn't load\n");
+            exit(1);
+        }
+    }
+}
+
+static void bench_load(void)
+{
+    // 32K words at x4000; the time is per word loaded.
+    struct load_arg l = { NULL, NULL, 0x8000 };
+    l.image = malloc(2 + 2 * l.words);
+    if (!l.image) { exit(1); }
+    l.image[0] = 0x40;
+    l.image[1] = 0x00;
+    for (size_t i = 0; i < l.words; ++i) {
+        l.image[2 + 2 * i] = (uint8_t)(i >> 8);
+        l.image[3 + 2 * i] = (uint8_t)i;
+    }
+
+    static const struct { const char* name; unsigned flags; } kinds[] = {
+        { "flat", 0 },
+        { "sparse", VMTOY_F_SPARSE_MEMORY },
+    };
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+        l.vm = vmtoy_create(kinds[k].flags);
+        if (!l.vm) { exit(1); }
+        measure("load_image/word", kinds[k].name, 50 * l.words, run_load, &l);
+        vmtoy_destroy(l.vm);
+    }
+    free(l.image);
+}
+
+// The instruction set tables
+
+static void run_form_of(void* arg, uint64_t ops)
+{
+    for (uint64_t i = 0; i < ops; ++i) {
+        enum isa_form f = isa_form_of((uint16_t)(i * 0x9E37));
+        OPAQUE(f);
+    }
+}
+
+static void run_disassemble(void* arg, uint64_t ops)
+{
+    char text[32];
+    for (uint64_t i = 0; i < ops; ++i) {
+        vmtoy_disassemble((uint16_t)(i * 0x9E37), text, sizeof(text));
+    }
+}
+
+static void run_assemble(void* arg, uint64_t ops)
+{
+    uint16_t word;
+    for (uint64_t i = 0; i < ops; ++i) {
+        vmtoy_assemble(isa_forms[i % ISA_FORM_COUNT].text, &word);
+        OPAQUE(word);
+    }
+}
+
+static void bench_isa(void)
+{
+    measure("isa/form_of", "-", 20000000, run_form_of, NULL);
+    measure("isa/disassemble", "-", 2000000, run_disassemble, NULL);
+    measure("isa/assemble", "-", 2000000, run_assemble, NULL);
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && !filter) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-n samples] [filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (samples < 1 || samples > 1000) {
+        fprintf(stderr, "samples: 1 to 1000\n");
+        return 2;
+    }
+
+    printf("# name\tengine\tmedian_ns\tmean_ns\tstddev_ns\tmin_ns\tsamples\n");
+    bench_insns();
+    bench_helpers();
+    bench_load();
+    bench_isa();
+    return 0;
+}
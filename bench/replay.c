@@ -0,0 +1,373 @@
+// Replay benchmarks
+// The bundled games played end to end, as the gating benchmark for the dispatch loop
+// and the I/O layer: each game replayed at full speed from a key script in bench/keys
+// (NAME.keys plays apps/NAME_vm.obj), under every engine and every way of wiring up
+// the keyboard and console:
+//   memory  keys from a buffer, output counted and dropped: no system calls at all
+//   stdio   the library's own stdio callbacks, stdin from the key script and stdout
+//           to a file, like `lc3-vm game.obj < keys > out`
+//   shm     the shared-memory rings (shmio.c), fed and drained from the same thread
+//
+// Every replay runs in a child process of its own, so the CPU time wait4() reports is
+// its own and nothing else's. One more replay under ptrace counts its system calls.
+// The output is TSV like build/microbench's, with host CPU milliseconds per replay as
+// the measurement, so bench/compare.sh can diff two runs:
+//   name  engine  median_ms  mean_ms  stddev_ms  min_ms  samples  guest_mips  output_bytes  syscalls
+//
+//   build/replay [-n samples] [-S] [filter]
+//
+// -S skips counting system calls, which is slow for the stdio runs.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+
+#define KEYS_DIR "bench/keys"
+#define QUANTUM (1 << 20)
+
+static const struct engine {
+    const char* name;
+    unsigned flags;
+} engines[] = {
+    { "switch", 0 },
+    { "predecode", VMTOY_F_PREDECODE },
+};
+
+struct session {
+    char name[64];
+    char keys_path[512];
+    char image_path[512];
+    uint8_t* keys;
+    size_t size;
+};
+
+// What a child sends home.
+struct result {
+    int ok;
+    int exit;
+    uint64_t icount;
+    uint64_t output_bytes;
+};
+
+static int samples = 5;
+static int count_syscalls = 1;
+static const char* filter;
+
+// The memory configuration
+struct mem_io {
+    const uint8_t* in;
+    size_t size;
+    size_t pos;
+    uint64_t out;
+};
+
+static int mem_read(void* ctx)
+{
+    struct mem_io* m = ctx;
+    return m->pos < m->size ? m->in[m->pos++] : VMTOY_IO_EOF;
+}
+
+static int mem_poll(void* ctx)
+{
+    return 1;
+}
+
+static int mem_write(void* ctx, int ch)
+{
+    struct mem_io* m = ctx;
+    m->out++;
+    return 0;
+}
+
+static int run_memory(vmtoy* vm, const struct session* s, struct result* r)
+{
+    struct mem_io m = { s->keys, s->size, 0, 0 };
+    vmtoy_io io = { mem_read, mem_poll, mem_write, NULL, &m };
+    vmtoy_set_io(vm, &io);
+    while ((r->exit = vmtoy_run_for(vm, QUANTUM)) == VMTOY_EXIT_BUDGET) {
+    }
+    r->output_bytes = m.out;
+    return 1;
+}
+
+// The stdio configuration: the library's default callbacks, on real file descriptors.
+static int run_stdio(vmtoy* vm, const struct session* s, struct result* r)
+{
+    char out_path[] = "/tmp/vmtoy-replay-XXXXXX";
+    int in = open(s->keys_path, O_RDONLY);
+    int out = mkstemp(out_path);
+    if (in < 0 || out < 0) { return 0; }
+    unlink(out_path);
+    if (dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0) { return 0; }
+
+    while ((r->exit = vmtoy_run_for(vm, QUANTUM)) == VMTOY_EXIT_BUDGET) {
+    }
+    fflush(stdout);
+    struct stat st;
+    if (fstat(out, &st) != 0) { return 0; }
+    r->output_bytes = (uint64_t)st.st_size;
+    return 1;
+}
+
+// The shm configuration. The games seed their random numbers with how long they wait
+// for a key, so the keys have to be waiting from the start, like in the other two, for
+// it to be the same game: the input ring is big enough for all of them, they go in
+// before the VM starts, and closing that handle is end of input. Output comes out of
+// another handle whenever the VM stops.
+static int run_shm(vmtoy* vm, const struct session* s, struct result* r)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/vmtoy-replay-%ld", (long)getpid());
+    vmtoy_shm_io* vm_side = vmtoy_shm_io_create(name, (uint32_t)s->size + 1);
+    vmtoy_shm_io* keys = vm_side ? vmtoy_shm_io_open(name) : NULL;
+    vmtoy_shm_io* console = keys ? vmtoy_shm_io_open(name) : NULL;
+    if (!console) {
+        vmtoy_shm_io_close(keys);
+        vmtoy_shm_io_close(vm_side);
+        return 0;
+    }
+    int ok = vmtoy_shm_io_send(keys, s->keys, s->size) == s->size;
+    vmtoy_shm_io_close(keys);
+    vmtoy_shm_io_attach(vm_side, vm);
+
+    uint8_t buf[4096];
+    do {
+        r->exit = vmtoy_run_for(vm, QUANTUM);
+        size_t n;
+        while ((n = vmtoy_shm_io_recv(console, buf, sizeof(buf))) > 0) {
+            r->output_bytes += n;
+        }
+    } while (ok && (r->exit == VMTOY_EXIT_BUDGET || r->exit == VMTOY_EXIT_BLOCKED));
+    vmtoy_shm_io_close(console);
+    vmtoy_shm_io_close(vm_side);
+    return ok;
+}
+
+static const struct io_config {
+    const char* name;
+    int (*run)(vmtoy* vm, const struct session* s, struct result* r);
+} io_configs[] = {
+    { "memory", run_memory },
+    { "stdio", run_stdio },
+    { "shm", run_shm },
+};
+
+// In the child.
+static void replay(const struct session* s, const struct engine* e, const struct io_config* io,
+                   int report)
+{
+    struct result r;
+    memset(&r, 0, sizeof(r));
+    vmtoy* vm = vmtoy_create(e->flags);
+    if (vm && vmtoy_load_image_file(vm, s->image_path)) {
+        r.ok = io->run(vm, s, &r);
+        r.icount = vmtoy_icount(vm);
+    }
+    vmtoy_destroy(vm);
+    ssize_t unused = write(report, &r, sizeof(r));
+    (void)unused;
+    _exit(0);
+}
+
+// One replay, timed. Returns host CPU seconds, or -1.
+static double timed_replay(const struct session* s, const struct engine* e,
+                           const struct io_config* io, struct result* r)
+{
+    int fds[2];
+    if (pipe(fds) != 0) { return -1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        replay(s, e, io, fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || n != (ssize_t)sizeof(*r) || !r->ok) { return -1; }
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// One more replay, stopping at every system call to count them. -1 if ptrace won't.
+static long counted_replay(const struct session* s, const struct engine* e, const struct io_config* io)
+{
+    int fds[2];
+    if (pipe(fds) != 0) { return -1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        // Everything from here to exit counts, setup included; it's the same few calls
+        // for every run.
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) { _exit(1); }
+        raise(SIGSTOP);
+        replay(s, e, io, fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+
+    int status;
+    long stops = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)) {
+        close(fds[0]);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    for (;;) {
+        if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0) { break; }
+        if (waitpid(pid, &status, 0) != pid || WIFEXITED(status) || WIFSIGNALED(status)) { break; }
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80)) { stops++; }
+    }
+    // The pipe only ever gets one small write, so it never fills up and stalls the child.
+    struct result r;
+    ssize_t unused = read(fds[0], &r, sizeof(r));
+    (void)unused;
+    close(fds[0]);
+    // A stop going in and one coming out, except for the exit_group() that never returns.
+    return (stops + 1) / 2;
+}
+
+static int by_value(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench(const struct session* s, const struct engine* e, const struct io_config* io)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "%.63s/%.32s", s->name, io->name);
+    if (filter && !strstr(name, filter)) { return; }
+
+    double t[samples];
+    struct result first = { 0 };
+    for (int i = 0; i < samples; ++i) {
+        struct result r;
+        t[i] = timed_replay(s, e, io, &r);
+        if (t[i] < 0) {
+            fprintf(stderr, "%s (%s): replay failed\n", name, e->name);
+            return;
+        }
+        if (i == 0) {
+            first = r;
+        } else if (r.icount != first.icount || r.output_bytes != first.output_bytes) {
+            fprintf(stderr, "%s (%s): replays disagree\n", name, e->name);
+        }
+        t[i] *= 1000;
+    }
+    long syscalls = count_syscalls ? counted_replay(s, e, io) : -1;
+
+    double sum = 0;
+    for (int i = 0; i < samples; ++i) { sum += t[i]; }
+    double mean = sum / samples;
+    double var = 0;
+    for (int i = 0; i < samples; ++i) { var += (t[i] - mean) * (t[i] - mean); }
+    double stddev = samples > 1 ? sqrt(var / (samples - 1)) : 0;
+    qsort(t, (size_t)samples, sizeof(t[0]), by_value);
+    double median = samples % 2 ? t[samples / 2] : (t[samples / 2 - 1] + t[samples / 2]) / 2;
+    double mips = median > 0 ? first.icount / (median * 1000) : 0;
+
+    printf("%s\t%s\t%.2f\t%.2f\t%.2f\t%.2f\t%d\t%.1f\t%llu\t%ld\n", name, e->name, median, mean,
+           stddev, t[0], samples, mips, (unsigned long long)first.output_bytes, syscalls);
+    fflush(stdout);
+}
+
+static int load_session(struct session* s, const char* file)
+{
+    size_t n = strlen(file) - strlen(".keys");
+    if (n == 0 || n >= sizeof(s->name)) { return 0; }
+    memcpy(s->name, file, n);
+    s->name[n] = '\0';
+    // NAME-anything.keys is another script for NAME.
+    char game[sizeof(s->name)];
+    snprintf(game, sizeof(game), "%.*s", (int)strcspn(s->name, "-"), s->name);
+    snprintf(s->keys_path, sizeof(s->keys_path), KEYS_DIR "/%s", file);
+    snprintf(s->image_path, sizeof(s->image_path), "apps/%s_vm.obj", game);
+
+    FILE* f = fopen(s->keys_path, "rb");
+    if (!f) { return 0; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    s->keys = size > 0 ? malloc((size_t)size) : NULL;
+    s->size = s->keys ? fread(s->keys, 1, (size_t)size, f) : 0;
+    fclose(f);
+    return s->keys != NULL;
+}
+
+static int by_name(const void* a, const void* b)
+{
+    return strcmp(((const struct session*)a)->name, ((const struct session*)b)->name);
+}
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0) {
+            count_syscalls = 0;
+        } else if (argv[i][0] != '-' && !filter) {
+            filter = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-n samples] [-S] [filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (samples < 1 || samples > 1000) {
+        fprintf(stderr, "samples: 1 to 1000\n");
+        return 2;
+    }
+
+    // Key scripts and games are found relative to the top of the tree.
+    DIR* d = opendir(KEYS_DIR);
+    if (!d) {
+        fprintf(stderr, "no %s here; run this from the top of the tree\n", KEYS_DIR);
+        return 1;
+    }
+    struct session sessions[64];
+    size_t count = 0;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL && count < sizeof(sessions) / sizeof(sessions[0])) {
+        size_t n = strlen(de->d_name);
+        if (n > 5 && strcmp(de->d_name + n - 5, ".keys") == 0 && load_session(&sessions[count], de->d_name)) {
+            count++;
+        }
+    }
+    closedir(d);
+    qsort(sessions, count, sizeof(sessions[0]), by_name);
+
+    printf("# name\tengine\tmedian_ms\tmean_ms\tstddev_ms\tmin_ms\tsamples\tguest_mips\toutput_bytes\tsyscalls\n");
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+            for (size_t c = 0; c < sizeof(io_configs) / sizeof(io_configs[0]); ++c) {
+                bench(&sessions[i], &engines[e], &io_configs[c]);
+            }
+        }
+        free(sessions[i].keys);
+    }
+    return 0;
+}
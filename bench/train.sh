@@ -0,0 +1,36 @@
+#!/bin/sh
+# The workload `./build.sh pgo` profiles, and what it times the result with: the
+# bundled games replayed headless (--input) from the key scripts in bench/keys.
+# A script called NAME.keys (or NAME-anything.keys) plays apps/NAME_vm.obj.
+#
+#   bench/train.sh [--repeat N] [--time] [lc3-vm]
+#
+# --time prints how long the whole lot took, in milliseconds.
+set -e
+cd "$(dirname "$0")/.."
+
+repeat=1
+show_time=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --repeat) repeat=$2; shift 2 ;;
+        --time) show_time=1; shift ;;
+        *) break ;;
+    esac
+done
+vm=${1:-./lc3-vm}
+
+start=$(date +%s%N)
+i=0
+while [ "$i" -lt "$repeat" ]; do
+    for keys in bench/keys/*.keys; do
+        game=$(basename "$keys" .keys)
+        "$vm" --input "$keys" "apps/${game%%-*}_vm.obj" > /dev/null
+    done
+    i=$((i + 1))
+done
+end=$(date +%s%N)
+
+if [ "$show_time" = 1 ]; then
+    echo $(( (end - start) / 1000000 ))
+fi
@@ -1 +1,191 @@
-gcc index.c -o lc3-vm
+#!/bin/sh
+# Builds libvmtoy (static and shared), its pkg-config file and the lc3-vm command.
+#
+#   ./build.sh           everything, with whatever $CFLAGS says (nothing, by default)
+#   ./build.sh release   everything, optimised
+#   ./build.sh lto       release, plus link-time optimisation
+#   ./build.sh pgo       lto, plus profile-guided optimisation (GCC only): builds an
+#                        instrumented lc3-vm, runs bench/train.sh on it, then builds
+#                        again laid out by the profile, and reports what it gained
+#   ./build.sh bench     release, plus build/microbench (see bench/microbench.c)
+#   ./build.sh test      everything, then runs the tests in tests/
+#   ./build.sh install   copies the header, libraries and vmtoy.pc under $PREFIX
+#   ./build.sh clean
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-gcc}
+AR=${AR:-ar}
+CFLAGS=${CFLAGS:-}
+PREFIX=${PREFIX:-/usr/local}
+BUILD=build
+
+VERSION=0.1.0
+SOVERSION=0
+
+# What release builds start from. $CFLAGS goes after it, so it can still override.
+# Nobody interposes on the library's own calls to itself, so they can be inlined.
+RELEASE_CFLAGS="-O2 -fno-semantic-interposition"
+LTO_CFLAGS="-flto=auto"
+RELINK=1
+RELINK_FLAGS=""
+
+SRCS="src/vmtoy.c src/memory.c src/arena.c src/dedup.c src/pack.c src/hibernate.c src/snapshot.c src/uffd.c src/checkpoint.c src/migrate.c src/clone.c src/explore.c src/job.c src/cache.c src/shmio.c src/monitor.c src/trap.c src/io.c src/call.c src/smp.c src/sched.c src/mbox.c src/pipe.c src/template.c src/isa.c src/trace.c src/predecode.c"
+LIBS="-pthread"
+
+build_lib() {
+    mkdir -p "$BUILD/obj"
+    objs=""
+    for src in $SRCS; do
+        obj="$BUILD/obj/$(basename "$src" .c).o"
+        $CC $CFLAGS -pthread -fPIC -fvisibility=hidden -DVMTOY_BUILD -Iinclude -c "$src" -o "$obj"
+        objs="$objs $obj"
+    done
+
+    # The static library is one relocatable object with everything but the API made
+    # local, so internals like read_all() or vm_new() can't clash with an embedder's
+    # own. (The shared library gets the same from -fvisibility=hidden.) Under LTO that
+    # link is where the library gets optimised as a whole, since objcopy can't see
+    # into LTO objects.
+    rm -f "$BUILD/libvmtoy.a"
+    if [ -n "$RELINK" ]; then
+        $CC $CFLAGS -r -nostdlib $RELINK_FLAGS -o "$BUILD/obj/vmtoy-all.o" $objs
+        objcopy --localize-hidden "$BUILD/obj/vmtoy-all.o"
+        $AR rcs "$BUILD/libvmtoy.a" "$BUILD/obj/vmtoy-all.o"
+    else
+        $AR rcs "$BUILD/libvmtoy.a" $objs
+    fi
+    $CC $CFLAGS -shared -Wl,-soname,libvmtoy.so.$SOVERSION -o "$BUILD/libvmtoy.so.$VERSION" $objs $LIBS
+    ln -sf "libvmtoy.so.$VERSION" "$BUILD/libvmtoy.so.$SOVERSION"
+    ln -sf "libvmtoy.so.$SOVERSION" "$BUILD/libvmtoy.so"
+
+    sed -e "s|@PREFIX@|$PREFIX|" -e "s|@VERSION@|$VERSION|" vmtoy.pc.in > "$BUILD/vmtoy.pc"
+}
+
+build_cli() {
+    # The command links the static library so it runs straight out of the checkout.
+    $CC $CFLAGS -Iinclude index.c "$BUILD/libvmtoy.a" $LIBS -o lc3-vm
+}
+
+build_bench() {
+    # The microbenchmarks get at the library's insides, which the archive keeps to
+    # itself, so they link the objects.
+    $CC $CFLAGS -Iinclude -Isrc bench/microbench.c $objs $LIBS -lm -o "$BUILD/microbench"
+    $CC $CFLAGS -Iinclude bench/replay.c "$BUILD/libvmtoy.a" $LIBS -lm -o "$BUILD/replay"
+}
+
+# Each tests/*.c is a program that exits nonzero when something is wrong. Like the
+# microbenchmarks they may look at the library's insides, so they link the objects.
+# tests/*.sh get the freshly built command.
+run_tests() {
+    mkdir -p "$BUILD/tests"
+    failed=0
+    for src in tests/*.c; do
+        [ -e "$src" ] || continue
+        t="$BUILD/tests/$(basename "$src" .c)"
+        $CC $CFLAGS -Iinclude -Isrc "$src" $objs $LIBS -o "$t"
+        if "$t"; then echo "PASS $src"; else echo "FAIL $src"; failed=1; fi
+    done
+    for t in tests/*.sh; do
+        [ -e "$t" ] || continue
+        if sh "$t" ./lc3-vm; then echo "PASS $t"; else echo "FAIL $t"; failed=1; fi
+    done
+    return $failed
+}
+
+# LTO objects need the plugin-aware ar to make an archive the linker can use.
+use_lto() {
+    CFLAGS="$RELEASE_CFLAGS $LTO_CFLAGS $1"
+    RELINK_FLAGS="-flinker-output=nolto-rel"
+    if [ "$AR" = ar ] && command -v "$CC-ar" > /dev/null; then AR="$CC-ar"; fi
+}
+
+build_pgo() {
+    user_cflags=$CFLAGS
+    profile="$PWD/$BUILD/pgo"
+
+    # The plain LTO build first, to have something to compare with.
+    use_lto "$user_cflags"
+    build_lib
+    build_cli
+    cp lc3-vm "$BUILD/lc3-vm.lto"
+
+    # Stage 1: count what the training runs actually do. Harts run on threads, so the
+    # counters have to be updated atomically. This build only has to run the training,
+    # and relinking it would pull a copy of libgcov into the library, so its archive
+    # is left as it comes.
+    rm -rf "$profile"
+    use_lto "-fprofile-generate=$profile -fprofile-update=atomic $user_cflags"
+    RELINK=
+    build_lib
+    build_cli
+    RELINK=1
+    echo "training..."
+    bench/train.sh ./lc3-vm
+
+    # Stage 2: build again with the counts. Code the training never ran is optimised
+    # normally rather than for size.
+    use_lto "-fprofile-use=$profile -Wno-missing-profile $user_cflags"
+    build_lib
+    build_cli
+
+    # Taking turns, and keeping each one's best pass, so a busy machine doesn't pick
+    # the winner.
+    before=
+    after=
+    for i in 1 2 3 4 5; do
+        t=$(bench/train.sh --time "$BUILD/lc3-vm.lto")
+        if [ -z "$before" ] || [ "$t" -lt "$before" ]; then before=$t; fi
+        t=$(bench/train.sh --time ./lc3-vm)
+        if [ -z "$after" ] || [ "$t" -lt "$after" ]; then after=$t; fi
+    done
+    echo "training workload: ${before} ms with LTO, ${after} ms with LTO+PGO" \
+         "($(( (before - after) * 100 / before ))% faster)"
+}
+
+case "${1:-all}" in
+    all)
+        build_lib
+        build_cli
+        ;;
+    release)
+        CFLAGS="$RELEASE_CFLAGS $CFLAGS"
+        build_lib
+        build_cli
+        ;;
+    lto)
+        use_lto "$CFLAGS"
+        build_lib
+        build_cli
+        ;;
+    pgo)
+        build_pgo
+        ;;
+    bench)
+        CFLAGS="$RELEASE_CFLAGS $CFLAGS"
+        build_lib
+        build_cli
+        build_bench
+        ;;
+    test)
+        build_lib
+        build_cli
+        run_tests
+        ;;
+    install)
+        build_lib
+        mkdir -p "$PREFIX/include" "$PREFIX/lib/pkgconfig"
+        cp include/vmtoy.h "$PREFIX/include/"
+        cp "$BUILD/libvmtoy.a" "$BUILD/libvmtoy.so.$VERSION" "$PREFIX/lib/"
+        ln -sf "libvmtoy.so.$VERSION" "$PREFIX/lib/libvmtoy.so.$SOVERSION"
+        ln -sf "libvmtoy.so.$SOVERSION" "$PREFIX/lib/libvmtoy.so"
+        cp "$BUILD/vmtoy.pc" "$PREFIX/lib/pkgconfig/"
+        ;;
+    clean)
+        rm -rf "$BUILD" lc3-vm
+        ;;
+    *)
+        echo "usage: $0 [all|release|lto|pgo|bench|test|install|clean]" >&2
+        exit 2
+        ;;
+esac
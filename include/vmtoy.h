@@ -0,0 +1,615 @@
+#ifndef VMTOY_H
+#define VMTOY_H
+
+// libvmtoy: the LC-3 virtual machine as a library.
+//
+// Everything the lc3-vm command does goes through this header, so anything it can do
+// your program can do too, without spawning a process or talking through pipes.
+//
+// The API is plain C and the VM itself is an opaque handle. Fields get added
+// to it over time without breaking programs built against an older header.
+// Functions that can fail return 1 on success and 0 on failure, same as the
+// rest of this code base.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VMTOY_VERSION_MAJOR 0
+#define VMTOY_VERSION_MINOR 1
+#define VMTOY_VERSION_PATCH 0
+
+#if defined(VMTOY_BUILD) && defined(__GNUC__)
+#define VMTOY_API __attribute__((visibility("default")))
+#else
+#define VMTOY_API
+#endif
+
+// 65536 words of guest memory, same as the real thing.
+#define VMTOY_MEMORY_WORDS (1 << 16)
+
+// LC-3 programs usually start at address 0x3000. It's just a rule.
+#define VMTOY_PC_START 0x3000
+
+typedef struct vmtoy vmtoy;
+
+// Register numbers for vmtoy_reg() / vmtoy_set_reg().
+enum {
+    VMTOY_R0 = 0,
+    VMTOY_R1,
+    VMTOY_R2,
+    VMTOY_R3,
+    VMTOY_R4,
+    VMTOY_R5,
+    VMTOY_R6,
+    VMTOY_R7,
+    VMTOY_PC,
+    VMTOY_COND,
+    VMTOY_REG_COUNT,
+};
+
+// Flags for vmtoy_create().
+enum {
+    VMTOY_F_STRICT_TRAPS = 1 << 0,  // Unknown TRAP vectors stop the VM instead of being ignored.
+    VMTOY_F_SPARSE_MEMORY = 1 << 1, // Allocate memory a page at a time, as the program writes it.
+    VMTOY_F_ARENA = 1 << 2,         // Allocate the VM from the shared huge-page arena.
+    VMTOY_F_STATE_HASH = 1 << 3,    // Keep vmtoy_state_hash() up to date on every write.
+    VMTOY_F_PREDECODE = 1 << 4,     // Decode the program ahead of time instead of as it runs.
+};
+
+// Why vmtoy_run_for() came back.
+enum vmtoy_exit {
+    VMTOY_EXIT_BUDGET = 0, // Ran the whole instruction budget. Call again to keep going.
+    VMTOY_EXIT_HALT,       // The program executed TRAP x25.
+    VMTOY_EXIT_BAD_TRAP,   // Unknown TRAP vector with VMTOY_F_STRICT_TRAPS set.
+    VMTOY_EXIT_INPUT_EOF,  // The input callback ran out of input.
+    VMTOY_EXIT_BLOCKED,    // An I/O callback said "not now". The instruction will be retried.
+    VMTOY_EXIT_STOPPED,    // Somebody called vmtoy_stop().
+    VMTOY_EXIT_RETURN,     // vmtoy_call(): the subroutine returned.
+    VMTOY_EXIT_TOO_DEEP,   // vmtoy_call(): too many calls nested inside each other.
+    VMTOY_EXIT_NO_MEMORY,  // The host couldn't find memory for a page the program wrote to.
+};
+
+// Input/output callbacks
+// The VM never touches stdin/stdout directly: keyboard reads, KBSR polls and console
+// output all go through these. vmtoy_create() starts you off with stdio versions.
+enum {
+    VMTOY_IO_EOF = -1,   // read(): there's no more input, ever.
+    VMTOY_IO_AGAIN = -2, // read()/write(): can't do it right now, ask again later.
+};
+
+typedef struct vmtoy_io {
+    // Next input byte, VMTOY_IO_EOF or VMTOY_IO_AGAIN. Allowed to block.
+    int (*read)(void* ctx);
+    // Nonzero when read() would return a byte or VMTOY_IO_EOF straight away. Drives KBSR.
+    int (*poll)(void* ctx);
+    // Write one output byte. Return 0, or VMTOY_IO_AGAIN to make the VM wait.
+    int (*write)(void* ctx, int ch);
+    // Called once a TRAP is done writing. May be NULL.
+    void (*flush)(void* ctx);
+    void* ctx;
+} vmtoy_io;
+
+// Trap handlers
+// A handler returns 0 to let the program carry on, or a vmtoy_exit reason to stop
+// the run loop. Returning VMTOY_EXIT_BLOCKED rewinds the PC so the TRAP runs again
+// on the next vmtoy_run_for().
+typedef int (*vmtoy_trap_fn)(vmtoy* vm, uint8_t vector, void* ctx);
+
+// Creating and destroying
+VMTOY_API vmtoy* vmtoy_create(unsigned flags);
+VMTOY_API void vmtoy_destroy(vmtoy* vm);
+
+// Image templates
+// Load a program once (and run it for a bit if you like, say up to its first key
+// press), then turn that VM into a template. VMs created from the template start
+// exactly where it left off: same memory, same registers, same flags. Their memory
+// is a copy-on-write mapping of the template's, so it is shared until a VM writes to
+// it, and creating one costs a single mmap(). Trap handlers and I/O callbacks are not
+// part of a template; set them up on each new VM. A template can be destroyed while
+// VMs made from it are still running.
+typedef struct vmtoy_template vmtoy_template;
+
+// NULL if the memory couldn't be copied out and sealed.
+VMTOY_API vmtoy_template* vmtoy_template_create(const vmtoy* vm);
+VMTOY_API void vmtoy_template_destroy(vmtoy_template* t);
+VMTOY_API vmtoy* vmtoy_create_from_template(const vmtoy_template* t);
+
+// Loading programs
+// Images are the usual .obj format: a big-endian origin word followed by big-endian code.
+// You can load several; they just go into different places in memory.
+VMTOY_API int vmtoy_load_image(vmtoy* vm, const void* image, size_t size);
+VMTOY_API int vmtoy_load_image_file(vmtoy* vm, const char* path);
+
+// Disassembling and assembling
+// One instruction at a time, in the usual LC-3 syntax: "ADD R0, R1, #-1", "BRnz #-5",
+// "TRAP x25". PC-relative operands are the offsets as encoded, from the instruction
+// after this one; there are no labels. A word no assembler would have written (a
+// reserved opcode, unused bits set) disassembles to ".FILL xD123", which assembles
+// back to the same word. vmtoy_disassemble() returns the length of the text, like
+// snprintf(); vmtoy_assemble() returns 0 if it can't make sense of the line.
+VMTOY_API int vmtoy_disassemble(uint16_t instr, char* buf, size_t size);
+VMTOY_API int vmtoy_assemble(const char* text, uint16_t* out);
+
+// Registers and memory
+// These are the host's view: reading KBSR here does not poll the keyboard.
+VMTOY_API uint16_t vmtoy_reg(const vmtoy* vm, int reg);
+VMTOY_API void vmtoy_set_reg(vmtoy* vm, int reg, uint16_t value);
+VMTOY_API uint16_t vmtoy_read_mem(const vmtoy* vm, uint16_t addr);
+VMTOY_API void vmtoy_write_mem(vmtoy* vm, uint16_t addr, uint16_t value);
+// Host buffer windows
+// Maps `words` words of host memory at `buf` into the guest at `addr`: guest loads and
+// stores go straight to the buffer, so nothing is copied in either direction. Both
+// `addr` and `words` have to be whole pages (multiples of VMTOY_WINDOW_ALIGN words)
+// and stay below the devices at 0xFE00; VMTOY_WINDOW_BASE.. is the range set aside for
+// it by convention, so programs know where to look. The words are in host byte order.
+// With VMTOY_WINDOW_READ_ONLY the guest's stores are ignored.
+// Whatever the pages held before is hidden until vmtoy_unmap_window(), which brings
+// back the old contents of flat memory and zeros in a sparse VM.
+// The buffer stays the host's: it has to outlive the mapping, the host may change it
+// whenever the VM isn't running, and a VM with a window won't hibernate. Snapshots,
+// checkpoints, clones and migration take a copy of what the guest can see. Returns 0
+// if the range is bad, already has a window in it, or `vm` is a hart.
+#define VMTOY_WINDOW_ALIGN 256
+#define VMTOY_WINDOW_BASE 0xE000
+#define VMTOY_WINDOW_WORDS 0x1E00
+enum { VMTOY_WINDOW_READ_ONLY = 1 << 0 };
+
+VMTOY_API int vmtoy_map_window(vmtoy* vm, uint16_t addr, uint16_t* buf, size_t words, unsigned flags);
+VMTOY_API void vmtoy_unmap_window(vmtoy* vm, uint16_t addr, size_t words);
+// Bytes of guest memory this VM has allocated for itself. With VMTOY_F_SPARSE_MEMORY
+// that's only the pages the program has written; flat memory always counts in full.
+VMTOY_API size_t vmtoy_memory_footprint(const vmtoy* vm);
+
+// Running
+// Runs at most `instructions` instructions and returns a vmtoy_exit reason.
+VMTOY_API int vmtoy_run_for(vmtoy* vm, uint64_t instructions);
+// Makes the current (or next) vmtoy_run_for() return VMTOY_EXIT_STOPPED.
+// Safe to call from a trap handler, a signal handler or another thread.
+VMTOY_API void vmtoy_stop(vmtoy* vm);
+// Instructions retired since the VM was created.
+VMTOY_API uint64_t vmtoy_icount(const vmtoy* vm);
+
+// Calling guest subroutines
+// Runs the subroutine at `addr` like a JSR would: R0..R(nargs-1) get the arguments,
+// R7 gets VMTOY_CALL_RETURN, and the call is over when the routine RETs to it.
+// `*result` gets R0. The caller's registers are saved before and restored after,
+// whatever happened. Trap handlers can call back into the guest too, up to
+// VMTOY_CALL_MAX_DEPTH deep. Returns VMTOY_EXIT_RETURN when the routine returned,
+// or the reason it didn't (out of budget, halted, blocked...).
+#define VMTOY_CALL_RETURN 0xFFFF
+#define VMTOY_CALL_MAX_DEPTH 64
+VMTOY_API int vmtoy_call(vmtoy* vm, uint16_t addr, const uint16_t* args, unsigned nargs,
+                         uint64_t budget, uint16_t* result);
+
+// Multiprocessor mode
+// N harts share one memory; each has its own registers, its own keyboard and console
+// (its own vmtoy_io) and runs on its own host thread. Each hart is a plain vmtoy, so
+// load images, set registers and install I/O through vmtoy_smp_hart(); loading an
+// image through any hart puts it in the shared memory. Harts belong to the group:
+// don't vmtoy_destroy() them yourself.
+//
+// Guest programs see these device registers:
+//   xFE10 HARTID  this hart's number (read only)
+//   xFE12 NHARTS  number of harts (read only)
+//   xFE14 AADDR   address the atomic operations work on
+//   xFE16 ASWAP   write: swap memory[AADDR] with the value; the old value goes to ARES
+//   xFE18 AADD    write: add the value to memory[AADDR]; the old value goes to ARES
+//   xFE1A ARES    result of the last ASWAP/AADD
+//   xFE1C FENCE   write anything: full memory fence
+// Plain loads and stores of a word are atomic (relaxed, in C11 terms) but unordered
+// between harts. ASWAP, AADD and FENCE are sequentially consistent, and plain
+// accesses never move across them.
+typedef struct vmtoy_smp vmtoy_smp;
+
+VMTOY_API vmtoy_smp* vmtoy_smp_create(unsigned nharts, unsigned flags);
+VMTOY_API void vmtoy_smp_destroy(vmtoy_smp* smp);
+VMTOY_API unsigned vmtoy_smp_nharts(const vmtoy_smp* smp);
+VMTOY_API vmtoy* vmtoy_smp_hart(vmtoy_smp* smp, unsigned hart);
+// Runs every hart on its own thread until they have all stopped for good (halt, end of
+// input, unknown trap, stop). Returns 0 if the threads could not be started.
+VMTOY_API int vmtoy_smp_run(vmtoy_smp* smp);
+// Why a hart stopped during the last vmtoy_smp_run().
+VMTOY_API int vmtoy_smp_exit(const vmtoy_smp* smp, unsigned hart);
+VMTOY_API void vmtoy_smp_stop(vmtoy_smp* smp);
+
+// Snapshots
+// Saves a VM (registers, devices, memory) to a file and brings it back later, in this
+// process or another one. Trap handlers and I/O callbacks are the host's business:
+// a restored VM starts with the standard ones, like a new VM.
+// VMTOY_RESTORE_LAZY starts the VM right away and reads each page of the snapshot the
+// first time the VM touches it (using userfaultfd); where that isn't available it
+// quietly does an eager restore instead. Returns NULL if the file isn't a snapshot.
+enum {
+    VMTOY_RESTORE_EAGER = 0,
+    VMTOY_RESTORE_LAZY,
+};
+
+// Replaces `path` in one go (through `path`.tmp), so saving over the snapshot a VM was
+// lazily restored from is fine.
+VMTOY_API int vmtoy_snapshot_save(const vmtoy* vm, const char* path);
+VMTOY_API int vmtoy_snapshot_write(const vmtoy* vm, int fd);
+VMTOY_API vmtoy* vmtoy_snapshot_restore(const char* path, unsigned how);
+
+// Incremental checkpoints
+// vmtoy_checkpoint_start() writes a base snapshot and starts an empty log next to it.
+// Each vmtoy_checkpoint_write() then appends just the pages written since the previous
+// one, plus the registers, so it costs what the program wrote rather than what it has.
+// vmtoy_checkpoint_restore() rebuilds the VM from the base and every whole record in
+// the log (a record torn by a crash is ignored). A vmtoy_checkpoint_write() that fails
+// leaves the log as it was, and its pages go in the next one instead.
+// vmtoy_checkpoint_compact() folds the log into the base; don't run it while something
+// else is appending to the same log.
+typedef struct vmtoy_checkpoint vmtoy_checkpoint;
+
+enum {
+    VMTOY_CHECKPOINT_SYNC = 1 << 0, // fdatasync() the log after every record.
+};
+
+VMTOY_API vmtoy_checkpoint* vmtoy_checkpoint_start(vmtoy* vm, const char* base_path,
+                                                   const char* log_path, unsigned options);
+VMTOY_API int vmtoy_checkpoint_write(vmtoy_checkpoint* c);
+VMTOY_API void vmtoy_checkpoint_close(vmtoy_checkpoint* c);
+VMTOY_API int vmtoy_checkpoint_compact(const char* base_path, const char* log_path);
+VMTOY_API vmtoy* vmtoy_checkpoint_restore(const char* base_path, const char* log_path,
+                                          unsigned how);
+
+// Live migration
+// Moves a running VM to another process over a pipe or socket (anything you can
+// write() to), pre-copy style. vmtoy_migrate_start() sends a header and queues every
+// page; keep running the VM and call vmtoy_migrate_step() between quanta to send what's
+// queued plus whatever the VM has written since the last step. Once
+// vmtoy_migrate_pending() is down to a handful of pages, vmtoy_migrate_finish() sends
+// the rest with the registers and devices: the VM must not run between that and the
+// other side's vmtoy_migrate_receive(), which returns it ready to carry on (NULL if the
+// stream was cut short). finish() and cancel() both free the migration; the VM stays
+// yours to destroy or, if it didn't work out, keep running. Harts can't be migrated,
+// and mailboxes, trap handlers and I/O callbacks stay behind, as with snapshots.
+typedef struct vmtoy_migration vmtoy_migration;
+
+typedef struct vmtoy_migrate_stats {
+    uint64_t pages_sent; // Pages sent so far, counting resends.
+    uint64_t bytes_sent;
+    unsigned pending;    // Pages the next step would send.
+} vmtoy_migrate_stats;
+
+VMTOY_API vmtoy_migration* vmtoy_migrate_start(vmtoy* vm, int fd);
+// Sends at most `max_pages` pages, or all that are waiting with 0.
+VMTOY_API int vmtoy_migrate_step(vmtoy_migration* m, unsigned max_pages);
+VMTOY_API unsigned vmtoy_migrate_pending(const vmtoy_migration* m);
+VMTOY_API int vmtoy_migrate_finish(vmtoy_migration* m);
+VMTOY_API void vmtoy_migrate_cancel(vmtoy_migration* m);
+VMTOY_API void vmtoy_migrate_get_stats(const vmtoy_migration* m, vmtoy_migrate_stats* stats);
+VMTOY_API vmtoy* vmtoy_migrate_receive(int fd);
+
+// Cloning and state-space exploration
+// vmtoy_clone() makes a copy of a VM that shares every page with it until one of them
+// writes there, so it's cheap enough to do for every move of a game search. That's for
+// sparse originals (clones included): a flat VM's memory can't be shared, so each clone
+// of one copies the pages that aren't all zeros. The clone is always sparse and gets
+// the original's I/O callbacks and trap handlers.
+//
+// vmtoy_state_hash() is a 64-bit hash of memory, registers and keyboard: equal states
+// hash the same no matter how they got there. Computing it from scratch reads all of
+// memory; with VMTOY_F_STATE_HASH the VM keeps the memory part up to date on every
+// write (all writes then take the slow path), and it costs next to nothing.
+//
+// vmtoy_explore_run() searches from `root`, which should be waiting for input (its last
+// vmtoy_run_for() came back blocked on a key). Every state is cloned once per entry in
+// `inputs`, fed that byte and run until it waits for the next one; states seen before
+// are dropped. BFS keeps every new state, BEAM only the `beam_width` best by `score`.
+// States are expanded on `threads` worker threads, so `score` and any trap handlers
+// the root has must be fine with being called from several threads at once. The
+// result is the last level reached (best first if there's a score), with the inputs
+// that lead to each state. Output the program writes during the search is dropped.
+VMTOY_API vmtoy* vmtoy_clone(vmtoy* vm);
+VMTOY_API uint64_t vmtoy_state_hash(const vmtoy* vm);
+
+enum {
+    VMTOY_EXPLORE_BFS = 0,
+    VMTOY_EXPLORE_BEAM,
+};
+
+typedef int64_t (*vmtoy_score_fn)(const vmtoy* vm, void* ctx);
+
+typedef struct vmtoy_explore_options {
+    int strategy;           // VMTOY_EXPLORE_BFS or VMTOY_EXPLORE_BEAM.
+    unsigned depth;         // How many inputs deep to go.
+    unsigned beam_width;    // BEAM: states kept per level.
+    unsigned threads;       // Worker threads, 0 = one per CPU.
+    uint64_t max_states;    // Stop after the level that finds this many states, 0 = no limit.
+    uint64_t step_budget;   // Instructions allowed per input, 0 = a million.
+    const uint8_t* inputs;  // The bytes to try at every state.
+    unsigned input_count;
+    vmtoy_score_fn score;   // Higher is better. May be NULL for BFS.
+    void* score_ctx;
+} vmtoy_explore_options;
+
+typedef struct vmtoy_explore_stats {
+    uint64_t states;     // Distinct states found, the root included.
+    uint64_t expanded;   // States that had every input tried on them.
+    uint64_t duplicates; // Inputs that led somewhere already seen.
+    uint64_t stuck;      // Inputs after which the program never asked for another.
+    uint64_t halted;     // Inputs after which the program stopped.
+    unsigned depth;      // Levels that found something new.
+} vmtoy_explore_stats;
+
+typedef struct vmtoy_explore vmtoy_explore;
+
+VMTOY_API vmtoy_explore* vmtoy_explore_run(vmtoy* root, const vmtoy_explore_options* options);
+VMTOY_API void vmtoy_explore_destroy(vmtoy_explore* e);
+VMTOY_API void vmtoy_explore_get_stats(const vmtoy_explore* e, vmtoy_explore_stats* stats);
+// The states of the last level, and how to get to each from the root. explore_path()
+// returns the number of inputs, and only fills `inputs` in if `max` is enough.
+VMTOY_API size_t vmtoy_explore_count(const vmtoy_explore* e);
+VMTOY_API const vmtoy* vmtoy_explore_state(const vmtoy_explore* e, size_t i);
+VMTOY_API int64_t vmtoy_explore_score(const vmtoy_explore* e, size_t i);
+VMTOY_API size_t vmtoy_explore_path(const vmtoy_explore* e, size_t i, uint8_t* inputs, size_t max);
+
+// Batch jobs and the result cache
+// A job is a whole headless run described up front: the images (.obj contents, loaded
+// in order), all of its input, and the options. vmtoy_job_run() runs it on a fresh VM
+// until it halts, runs out of input or uses up `max_instructions`, and hands back the
+// output, the exit reason and the instruction count. The same job always gives the
+// same result, so with a cache it's looked up first, by a hash of all of the above,
+// and only run if it isn't there. Free the result with vmtoy_job_result_free().
+//
+// The cache is a directory of result files kept under `max_bytes`, least recently used
+// out first. Several processes can share one directory.
+typedef struct vmtoy_cache vmtoy_cache;
+
+typedef struct vmtoy_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stored;
+    uint64_t evicted;
+    uint64_t bytes;   // Roughly what the directory holds.
+} vmtoy_cache_stats;
+
+typedef struct vmtoy_job {
+    const void* const* images;
+    const size_t* image_sizes;
+    unsigned image_count;
+    const void* input;
+    size_t input_size;
+    unsigned flags;            // VMTOY_F_*; only VMTOY_F_STRICT_TRAPS changes the result.
+    uint64_t max_instructions; // 0 = no limit.
+} vmtoy_job;
+
+typedef struct vmtoy_job_result {
+    int exit;             // Why it stopped, a vmtoy_exit reason.
+    uint64_t icount;
+    uint8_t* output;
+    size_t output_size;
+    int cached;           // Nonzero if this came out of the cache.
+} vmtoy_job_result;
+
+VMTOY_API vmtoy_cache* vmtoy_cache_open(const char* dir, uint64_t max_bytes);
+VMTOY_API void vmtoy_cache_close(vmtoy_cache* c);
+VMTOY_API void vmtoy_cache_get_stats(vmtoy_cache* c, vmtoy_cache_stats* stats);
+// `cache` may be NULL to just run it.
+VMTOY_API int vmtoy_job_run(const vmtoy_job* job, vmtoy_cache* cache, vmtoy_job_result* out);
+VMTOY_API void vmtoy_job_result_free(vmtoy_job_result* r);
+
+// Shared-memory I/O
+// A keyboard and console for programs driven by another process on the same host (a
+// bot, a test harness): two rings in a named POSIX shared memory segment, so sending a
+// key or reading output never takes a system call on either side.
+// The VM's side creates the segment (vmtoy_shm_io_create(), which fails if the name is
+// taken) and plugs it into a VM with vmtoy_shm_io_attach(); a VM with nothing to read
+// comes back VMTOY_EXIT_BLOCKED, like with any other I/O callbacks that say "not now".
+// The driver opens it by name and uses send/recv, which never block and return how
+// many bytes they managed. Closing the driver's side is end of input for the VM;
+// closing the VM's side removes the name, and vmtoy_shm_io_finished() tells the driver
+// once it has read the last of the output. `capacity` is per direction, 0 = 4 KB.
+typedef struct vmtoy_shm_io vmtoy_shm_io;
+
+VMTOY_API vmtoy_shm_io* vmtoy_shm_io_create(const char* name, uint32_t capacity);
+VMTOY_API vmtoy_shm_io* vmtoy_shm_io_open(const char* name);
+VMTOY_API void vmtoy_shm_io_close(vmtoy_shm_io* s);
+VMTOY_API void vmtoy_shm_io_attach(vmtoy_shm_io* s, vmtoy* vm);
+VMTOY_API size_t vmtoy_shm_io_send(vmtoy_shm_io* s, const void* buf, size_t size);
+VMTOY_API size_t vmtoy_shm_io_recv(vmtoy_shm_io* s, void* buf, size_t size);
+VMTOY_API int vmtoy_shm_io_finished(vmtoy_shm_io* s);
+
+// Live monitoring
+// vmtoy_monitor_publish() moves a VM's memory into a named POSIX shared memory segment
+// (it fails if the name is taken) and keeps a copy of its registers there, so another
+// process can watch it run without stopping it. The registers are copied at the end of
+// every vmtoy_run_for(); vmtoy_monitor_read() always gets one consistent set of them.
+// Memory is the running VM's own, read live, with no such promise. The segment goes
+// away with the VM. Published VMs don't hibernate; harts and VMs with windows can't be
+// published.
+typedef struct vmtoy_monitor vmtoy_monitor;
+
+typedef struct {
+    uint16_t regs[VMTOY_REG_COUNT];
+    uint16_t kbsr;
+    uint16_t kbdr;
+    int exit;          // Why the last vmtoy_run_for() came back.
+    int alive;         // 0 once the VM has been destroyed.
+    uint64_t icount;
+    uint64_t updates;  // How many times the registers have been published.
+} vmtoy_monitor_state;
+
+VMTOY_API int vmtoy_monitor_publish(vmtoy* vm, const char* name);
+VMTOY_API vmtoy_monitor* vmtoy_monitor_open(const char* name);
+VMTOY_API void vmtoy_monitor_close(vmtoy_monitor* m);
+// 0 if the registers couldn't be read whole (the VM died while publishing them).
+VMTOY_API int vmtoy_monitor_read(vmtoy_monitor* m, vmtoy_monitor_state* out);
+// All VMTOY_MEMORY_WORDS words of the VM's memory, in host byte order.
+VMTOY_API const uint16_t* vmtoy_monitor_memory(vmtoy_monitor* m);
+
+// Hibernation
+// Packs a VM's memory into a compact blob and frees the pages, for sessions that sit
+// idle a lot. Everything keeps working on a hibernating VM: reads peek into the blob,
+// and vmtoy_run_for() or any write wakes it up first. Returns 0 if it can't: harts
+// and VMTOY_F_ARENA VMs don't own memory they could give back.
+VMTOY_API int vmtoy_hibernate(vmtoy* vm);
+VMTOY_API int vmtoy_wake(vmtoy* vm);
+VMTOY_API int vmtoy_hibernating(const vmtoy* vm);
+
+// Page dedup
+// For VMTOY_F_SPARSE_MEMORY VMs: identical pages across VMs get merged
+// into one read-only copy, and a VM that writes to one gets its own copy back.
+// A page is only merged once it has looked the same for two scans in a row.
+// Don't scan VMs while they run; a scheduler can do it for you between quanta.
+typedef struct vmtoy_dedup vmtoy_dedup;
+
+typedef struct vmtoy_dedup_stats {
+    size_t shared_pages; // Distinct pages in use by at least one VM...
+    size_t sharing;      // ...and how many VM pages point at them.
+    size_t bytes_saved;  // What the sharing saves right now.
+    uint64_t merged;     // Pages swapped for a shared copy, ever.
+    uint64_t zeroed;     // Pages handed back because they were all zeros, ever.
+} vmtoy_dedup_stats;
+
+VMTOY_API vmtoy_dedup* vmtoy_dedup_create(void);
+// VMs keep the pages they share; they go away with the last VM using them.
+VMTOY_API void vmtoy_dedup_destroy(vmtoy_dedup* d);
+// Returns how many pages the VMs gave up this time (merged or zeroed).
+VMTOY_API unsigned vmtoy_dedup_scan(vmtoy_dedup* d, vmtoy* const* vms, unsigned count);
+VMTOY_API void vmtoy_dedup_get_stats(vmtoy_dedup* d, vmtoy_dedup_stats* stats);
+
+// Scheduler
+// Runs any number of VMs on the calling thread, round robin, a quantum at a time.
+// VMs that come back VMTOY_EXIT_BLOCKED are parked and only run again once what
+// they're waiting for is ready. vmtoy_sched_run() returns VMTOY_EXIT_HALT once every
+// VM has finished (see vmtoy_sched_exit() for why each one did), VMTOY_EXIT_BLOCKED
+// if the VMs left are all waiting on each other, or VMTOY_EXIT_STOPPED.
+typedef struct vmtoy_sched vmtoy_sched;
+
+VMTOY_API vmtoy_sched* vmtoy_sched_create(void);
+VMTOY_API void vmtoy_sched_destroy(vmtoy_sched* s);
+VMTOY_API int vmtoy_sched_add(vmtoy_sched* s, vmtoy* vm);
+VMTOY_API void vmtoy_sched_set_quantum(vmtoy_sched* s, uint64_t instructions);
+VMTOY_API int vmtoy_sched_run(vmtoy_sched* s);
+VMTOY_API int vmtoy_sched_exit(const vmtoy_sched* s, unsigned index);
+VMTOY_API void vmtoy_sched_stop(vmtoy_sched* s);
+// Hibernate VMs that have been waiting for input for idle_ms (0 turns it off).
+VMTOY_API void vmtoy_sched_set_hibernate(vmtoy_sched* s, unsigned idle_ms);
+// Scan one VM for page dedup after each round (NULL turns it off).
+VMTOY_API void vmtoy_sched_set_dedup(vmtoy_sched* s, vmtoy_dedup* d);
+
+// Mailboxes
+// A mailbox is a bounded lock-free queue of words going one way, from one producer
+// to one consumer. Connect one VM's send side and another's receive side to the same
+// mailbox to pass words between them. The guest sees:
+//   xFE20 MBSR  bit 15: there's something to receive; bit 14: there's room to send
+//   xFE22 MBRX  read: take the next word (waits if the mailbox is empty)
+//   xFE24 MBTX  write: send a word (waits if the mailbox is full)
+// The host can be either end too, with vmtoy_mbox_send()/vmtoy_mbox_receive().
+typedef struct vmtoy_mbox vmtoy_mbox;
+
+VMTOY_API vmtoy_mbox* vmtoy_mbox_create(unsigned capacity);
+VMTOY_API void vmtoy_mbox_destroy(vmtoy_mbox* mb);
+// Either side can be NULL.
+VMTOY_API void vmtoy_mbox_connect(vmtoy* vm, vmtoy_mbox* rx, vmtoy_mbox* tx);
+VMTOY_API int vmtoy_mbox_send(vmtoy_mbox* mb, uint16_t word);
+VMTOY_API int vmtoy_mbox_receive(vmtoy_mbox* mb, uint16_t* word);
+VMTOY_API unsigned vmtoy_mbox_count(const vmtoy_mbox* mb);
+
+// Console pipelines
+// Like `a | b | c` in the shell, but all in this process: each stage's console output
+// (OUT, PUTS, PUTSP, HALT's message) becomes the next stage's keyboard (GETC, IN, KBSR).
+// The first stage keeps its own input and the last keeps its own output. Stages pass
+// bytes through in-memory rings, so nothing in between makes a syscall. When a stage
+// finishes, the next one sees end of input once it has read everything; the ones
+// before it are stopped, like SIGPIPE would. vmtoy_pipeline_run() returns
+// VMTOY_EXIT_HALT when every stage has finished.
+typedef struct vmtoy_pipeline vmtoy_pipeline;
+
+VMTOY_API vmtoy_pipeline* vmtoy_pipeline_create(vmtoy* const* stages, unsigned count,
+                                                unsigned capacity);
+// Puts each stage's own I/O back.
+VMTOY_API void vmtoy_pipeline_destroy(vmtoy_pipeline* p);
+VMTOY_API int vmtoy_pipeline_run(vmtoy_pipeline* p);
+VMTOY_API int vmtoy_pipeline_exit(const vmtoy_pipeline* p, unsigned stage);
+
+// The arena VMTOY_F_ARENA VMs come from. Memory it gets from the OS stays with it,
+// and VMs destroyed are recycled for the next ones created.
+typedef struct vmtoy_arena_stats {
+    size_t chunks;      // 2 MiB chunks taken from the OS so far...
+    size_t huge_chunks; // ...and how many of them are explicit huge pages.
+    size_t in_use;      // Objects (VMs, sparse pages) handed out and not yet freed.
+} vmtoy_arena_stats;
+
+VMTOY_API void vmtoy_arena_get_stats(vmtoy_arena_stats* stats);
+
+// I/O. Passing NULL puts the stdio callbacks back.
+VMTOY_API void vmtoy_set_io(vmtoy* vm, const vmtoy_io* io);
+VMTOY_API int vmtoy_putc(vmtoy* vm, int ch);
+
+// Traps
+// Registering NULL makes the vector unknown again.
+VMTOY_API void vmtoy_trap_register(vmtoy* vm, uint8_t vector, const char* name,
+                                   vmtoy_trap_fn fn, void* ctx);
+VMTOY_API const char* vmtoy_trap_name(const vmtoy* vm, uint8_t vector);
+VMTOY_API uint64_t vmtoy_trap_count(const vmtoy* vm, uint8_t vector);
+
+// Trap tracing
+// Like strace, for TRAPs: which services the program calls, with what, and what it got
+// back. Once it's on, every TRAP that finishes (one that has to wait is recorded when
+// it's retried and gets through) adds an event to a ring of `capacity` events, rounded
+// up to a power of two; when the ring is full the oldest make room and are counted by
+// vmtoy_trace_dropped(). Recording is a clock read and a few stores, on TRAPs only:
+// the rest of the program runs at full speed, and an untraced VM pays nothing. Read
+// the events (oldest first) between runs and turn them into text whenever it suits:
+//   0.001234 #5012 x3003 PUTS(x3085 "Score: 0\n") = x3085
+// That's the time since tracing started, the instruction count, where the TRAP is, the
+// vector's name with R0 (and the string, for PUTS and PUTSP), and R0 afterwards, plus
+// why the VM stopped if the TRAP stopped it. Capacity 0 turns tracing off.
+#define VMTOY_TRACE_TRUNCATED 1   // The string was longer than `text`.
+
+typedef struct vmtoy_trap_event {
+    uint64_t icount;     // Instructions run before this TRAP.
+    uint64_t time_ns;    // Since tracing was turned on.
+    int32_t result;      // What the handler returned: 0, or a VMTOY_EXIT_* reason.
+    uint16_t pc;         // Where the TRAP is.
+    uint16_t r0;         // R0 going in...
+    uint16_t r0_out;     // ...and coming out (what GETC and IN read).
+    uint8_t vector;
+    uint8_t flags;
+    uint8_t text_len;    // PUTS and PUTSP: how much of the string is in text.
+    char text[32];
+} vmtoy_trap_event;
+
+VMTOY_API int vmtoy_trace_traps(vmtoy* vm, unsigned capacity);
+VMTOY_API size_t vmtoy_trace_read(vmtoy* vm, vmtoy_trap_event* events, size_t max);
+VMTOY_API uint64_t vmtoy_trace_dropped(const vmtoy* vm);
+VMTOY_API int vmtoy_trace_format(const vmtoy* vm, const vmtoy_trap_event* e, char* buf, size_t size);
+
+// Predecoding
+// A VMTOY_F_PREDECODE VM doesn't decode instructions as it goes: it follows the
+// program's control flow from the PC, the origin of every image it loaded and any
+// trap and interrupt vectors in low memory, decodes every page it finds code in (on
+// worker threads, if there are enough pages and CPUs to make that worth it), and only
+// then starts running. vmtoy_run_for() does all that the first time round;
+// vmtoy_predecode() does it now, so the time isn't counted against the first run.
+// Call it after loading the images and setting the PC. Anything the analysis missed
+// is decoded the first time it runs, and code the program (or the host) rewrites is
+// decoded again, so the results never differ from a VM without the flag. Returns 0
+// if the VM wasn't created with VMTOY_F_PREDECODE (harts sharing memory with
+// others never predecode) or we ran out of memory.
+typedef struct vmtoy_predecode_stats {
+    uint32_t blocks;      // Basic blocks the analysis found.
+    uint32_t eager_pages; // Pages decoded before the program started.
+    uint32_t lazy_pages;  // Pages the analysis missed, decoded when the program got there.
+    uint32_t threads;     // Threads the last eager pass decoded on (1: this one).
+    uint64_t rewrites;    // Stores to decoded pages, each one decoded again.
+    uint64_t analysis_ns; // Time spent in eager passes, analysis and decoding.
+} vmtoy_predecode_stats;
+
+VMTOY_API int vmtoy_predecode(vmtoy* vm);
+VMTOY_API void vmtoy_predecode_get_stats(const vmtoy* vm, vmtoy_predecode_stats* stats);
+
+VMTOY_API const char* vmtoy_exit_string(int reason);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
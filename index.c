@@ -5,93 +5,30 @@
 // Hey there! We need these standard headers to talk to the OS.
 // Think of them as the toolbox we need before we start building.
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/termios.h>
+#include <sched.h>
 #include <sys/mman.h>
+#include <sys/termios.h>
 
-#define MEMORY_MAX (1 << 16)
-
-// Memory
-// This is the VM's RAM. It's just a big array where we store data and code.
-// 65536 locations is plenty for what we're doing (hopefully!).
-uint16_t memory[MEMORY_MAX];
-/* 65536 memory locations in our VM  */
-
-// Registers
-// These are like the CPU's pockets. It keeps stuff here that it's working on right now.
-// Faster than reaching into memory (the backpack).
-enum {
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,     // Program Counter: points to the next instruction. Ideally, it doesn't get lost.
-    R_COND,   // Condition Flag: tells us if the last math operation was positive, zero, or negative.
-    R_COUNT,
-};
-
-uint16_t regs[R_COUNT];
-
-// Define OPCodes
-// These are the commands the CPU understands. It's a small vocabulary, but it gets the job done.
-enum {
-    OP_BR = 0, // Branch: Conditional jump. "If the last thing was zero, go here."
-    OP_ADD,    // Add: Math! 1 + 1 = 2 (usually).
-    OP_LD,     // Load: Go get data from memory.
-    OP_ST,     // Store: Put data into memory.
-    OP_JSR,    // Jump Register: Call a function.
-    OP_AND,    // Bitwise AND: Masking bits like a pro.
-    OP_LDR,    // Load Register: Pointer arithmetic stuff.
-    OP_STR,    // Store Register: Writing to where a pointer points.
-    OP_RTI,    // Return from Interrupt: We won't use this much, but it's here.
-    OP_NOT,    // Bitwise NOT: Flipping bits. 0 becomes 1, cats start barking.
-    OP_LDI,    // Load Indirect: Pointer to a pointer. Inception style.
-    OP_STI,    // Store Indirect: Writing to a pointer to a pointer.
-    OP_JMP,    // Jump: unconditional GOTO. Use responsibly.
-    OP_RES,    // Reserved (unused)
-    OP_LEA,    // Load Effective Address: "Where is this variable living?"
-    OP_TRAP,   // Trap: System call. "Hey OS, do something for me."
-};
-
-// Conditional flags
-// The CPU's mood ring. It tells us the result of the last calculation.
-enum {
-    FL_POS = 1 << 0, // Positive
-    FL_ZRO = 1 << 1, // Zero
-    FL_NEG = 1 << 2, // Negative
-};
-
-
-// Defining trap codes for performing I/O tasks
-// These are like system calls. "Hey computer, print this" or "Hey computer, gimme a key press".
-enum
-{
-    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
-    TRAP_OUT = 0x21,   /* output a character */
-    TRAP_PUTS = 0x22,  /* output a word string */
-    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
-    TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
-};
-
-// Defines memory mapped registers
-// Some registers are stored in memory instead of register table
-// It's like a secret trapdoor in memory that actually talks to hardware.
-enum
-{
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
-};
+// The VM itself lives in libvmtoy. This file is just the command line around it.
+#include "vmtoy.h"
+
+// How many instructions we run between checks on how the VM is doing.
+#define QUANTUM (1 << 20)
+
+// How many characters can sit between two pipeline stages.
+#define PIPE_CAPACITY 4096
+
+// What to tell the user about a VM once it's finished.
+enum { SHOW_TRAP_STATS = 1 << 0, SHOW_FOOTPRINT = 1 << 1 };
 
 struct termios original_tio;
 
+// The --shm-io and --publish segments, so Ctrl+C doesn't leave them lying around.
+const char* shm_name = NULL;
+const char* publish_name = NULL;
+
 // Turning off the "hit enter to send" feature of the terminal.
 // We want characters AS SOON AS you type them.
 void disable_input_buffering()
@@ -108,107 +45,249 @@ void restore_input_buffering()
     tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
 }
 
-// Checking if a key was pressed without blocking.
-// "Hey, anybody there? No? Okay moving on."
-uint16_t check_key()
-{
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+// Catching Ctrl+C so we can exit gracefully and fix the terminal.
+void handle_interrupt(int signal) {
+    restore_input_buffering();
+    if (shm_name) shm_unlink(shm_name);
+    if (publish_name) shm_unlink(publish_name);
+    printf("\n");
+    exit(-2);
 }
 
-
-// Reading from memory.
-// Usually simple, but if you touch the keyboard address, magic happens.
-uint16_t mem_read(uint16_t address)
-{
-    if (address == MR_KBSR)
-    {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
+// Harts other than the first don't get the keyboard. They can still print though.
+int no_keyboard_read(void* ctx) { return VMTOY_IO_EOF; }
+int no_keyboard_poll(void* ctx) { return 0; }
+int console_write(void* ctx, int ch) { putc(ch, stdout); return 0; }
+void console_flush(void* ctx) { fflush(stdout); }
+
+// Waiting for whoever is on the other end of --shm-io. Spinning keeps a round trip
+// under a microsecond; after a while of nothing we let other threads have the CPU, and
+// after a longer while we sleep, so an idle session doesn't keep a core busy. With only
+// one CPU, spinning just keeps the driver from running, so we go straight to yielding.
+void shm_idle(unsigned* idle) {
+    static long cpus;
+    if (!cpus) { cpus = sysconf(_SC_NPROCESSORS_ONLN); }
+    ++*idle;
+    if (cpus > 1 && *idle < (1u << 12)) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (*idle < (1u << 16)) {
+        sched_yield();
+    } else {
+        usleep(200);
     }
-    return memory[address];
 }
 
-
-// Sign extension: taking a small number and making it fit in a bigger container
-// while keeping its value (and sign) correct.
-uint16_t sign_extend(uint16_t x, int bit_count) {
-    if ((x >> (bit_count - 1) & 1)) {
-        x |= (0xFFFF << bit_count);
+// Who called what, and how often. Handy when you're wondering why a program is slow.
+void print_trap_stats(vmtoy* vm, FILE* out) {
+    for (int v = 0; v < 256; ++v) {
+        uint64_t count = vmtoy_trap_count(vm, (uint8_t)v);
+        if (count == 0) continue;
+        const char* name = vmtoy_trap_name(vm, (uint8_t)v);
+        fprintf(out, "trap x%02X %-6s %llu\n", v, name ? name : "?", (unsigned long long)count);
     }
-
-    return x;
 }
 
-// Updating the conditional flag (R_COND) based on the latest result.
-// Did we get a zero? A positive? A negative? The CPU needs to know.
-void update_flags(uint16_t r) {
-    if (regs[r] == 0) {
-        regs[R_COND] = FL_ZRO;
-    } else if(regs[r] >> 15) {
-        regs[R_COND] = FL_NEG;
-    } else {
-        regs[R_COND] = FL_POS;
+// Report anything worth reporting about how a VM finished.
+void report(vmtoy* vm, int reason, unsigned show, const char* who) {
+    if (reason == VMTOY_EXIT_BAD_TRAP) {
+        uint16_t pc = vmtoy_reg(vm, VMTOY_PC) - 1;
+        if (who) fprintf(stderr, "\n%s:", who);
+        fprintf(stderr, "\nunknown trap x%02X at x%04X\n", vmtoy_read_mem(vm, pc) & 0xFF, pc);
+    }
+    if (show && who) fprintf(stderr, "%s:\n", who);
+    if (show & SHOW_TRAP_STATS) {
+        print_trap_stats(vm, stderr);
+    }
+    if (show & SHOW_FOOTPRINT) {
+        fprintf(stderr, "memory %zu bytes\n", vmtoy_memory_footprint(vm));
     }
 }
 
-void mem_write(uint16_t addr, uint16_t val) {
-    memory[addr] = val;
+// `lc3-vm --monitor NAME`: one look at a VM somebody started with --publish NAME.
+int show_monitor(const char* name) {
+    vmtoy_monitor* m = vmtoy_monitor_open(name);
+    if (!m) {
+        printf("can't open monitor: %s\n", name);
+        return 1;
+    }
+    vmtoy_monitor_state st;
+    if (!vmtoy_monitor_read(m, &st)) {
+        printf("%s isn't answering\n", name);
+        vmtoy_monitor_close(m);
+        return 1;
+    }
+    printf("PC x%04X  COND x%04X ", st.regs[VMTOY_PC], st.regs[VMTOY_COND]);
+    for (int r = VMTOY_R0; r <= VMTOY_R7; ++r) {
+        printf(" R%d x%04X", r, st.regs[r]);
+    }
+    const uint16_t* mem = vmtoy_monitor_memory(m);
+    printf("\n[x%04X] x%04X  instructions %llu  last run: %s%s\n", st.regs[VMTOY_PC],
+           mem[st.regs[VMTOY_PC]], (unsigned long long)st.icount, vmtoy_exit_string(st.exit),
+           st.alive ? "" : " (gone)");
+    vmtoy_monitor_close(m);
+    return 0;
 }
 
-// LC-3 is big-endian, but most modern computers are little-endian.
-// We need to swap bytes so everyone understands each other.
-uint16_t swap_16(uint16_t x) {
-    return (x << 8) | (x >> 8);
-};
-
-
+// `lc3-vm a.obj --pipe b.obj` is `lc3-vm a.obj | lc3-vm b.obj`, minus the second process.
+// Each stage gets the images up to the next --pipe.
+int run_pipeline(int argc, const char* argv[], int first_image, unsigned flags, unsigned show) {
+    unsigned nstages = 1;
+    for (int j = first_image + 1; j < argc; ++j) {
+        if (strcmp(argv[j], "--pipe") == 0) ++nstages;
+    }
+    vmtoy** stages = calloc(nstages, sizeof(vmtoy*));
+    unsigned count = 0;
+    if (!stages) {
+        printf("out of memory\n");
+        exit(1);
+    }
 
-void read_image_file(FILE* file) {
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap_16(origin);
+    for (int j = first_image; j < argc; ++j) {
+        if (j == first_image || strcmp(argv[j], "--pipe") == 0) {
+            stages[count++] = vmtoy_create(flags);
+            if (!stages[count - 1]) {
+                printf("out of memory\n");
+                exit(1);
+            }
+            if (strcmp(argv[j], "--pipe") == 0) continue;
+        }
+        if (!vmtoy_load_image_file(stages[count - 1], argv[j])) {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
 
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+    vmtoy_pipeline* p = vmtoy_pipeline_create(stages, count, PIPE_CAPACITY);
+    if (!p) {
+        printf("out of memory\n");
+        exit(1);
+    }
+    vmtoy_pipeline_run(p);
 
-    while (read-- > 0) {
-        *p = swap_16(*p);
-        ++p;
+    restore_input_buffering();
+    int reason = vmtoy_pipeline_exit(p, count - 1);
+    for (unsigned i = 0; i < count; ++i) {
+        char who[32];
+        snprintf(who, sizeof(who), "stage %u", i);
+        report(stages[i], vmtoy_pipeline_exit(p, i), show, who);
     }
+    vmtoy_pipeline_destroy(p);
+    for (unsigned i = 0; i < count; ++i) {
+        vmtoy_destroy(stages[i]);
+    }
+    free(stages);
+    return reason == VMTOY_EXIT_HALT || reason == VMTOY_EXIT_INPUT_EOF ? 0 : 1;
 }
 
-// Loading the program (ROM image) into memory.
-int read_image(const char* image_path) {
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-
-    read_image_file(file);
+// Reads a whole file into memory. NULL if it can't.
+void* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    size_t cap = 4096, len = 0;
+    char* buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len, file)) > 0) {
+        len += n;
+        if (len == cap) {
+            char* bigger = realloc(buf, cap *= 2);
+            if (!bigger) free(buf);
+            buf = bigger;
+        }
+    }
     fclose(file);
-    return 1;
+    *size = len;
+    return buf;
 }
 
+// `--input FILE`: no terminal, the whole input up front, output to stdout. A run like
+// that always comes out the same, so with `--cache DIR` it's only done the first time.
+int run_job(int argc, const char* argv[], int first_image, unsigned flags,
+            const char* input_path, const char* cache_dir, uint64_t cache_bytes) {
+    int count = argc - first_image;
+    const void* images[count > 0 ? count : 1];
+    size_t sizes[count > 0 ? count : 1];
+    for (int i = 0; i < count; ++i) {
+        images[i] = read_file(argv[first_image + i], &sizes[i]);
+        if (!images[i]) {
+            printf("failed to load image: %s\n", argv[first_image + i]);
+            exit(1);
+        }
+    }
+    vmtoy_job job = { images, sizes, (unsigned)count, NULL, 0, flags, 0 };
+    job.input = read_file(input_path, &job.input_size);
+    if (!job.input) {
+        printf("failed to read input: %s\n", input_path);
+        exit(1);
+    }
 
+    vmtoy_cache* cache = NULL;
+    if (cache_dir && !(cache = vmtoy_cache_open(cache_dir, cache_bytes))) {
+        fprintf(stderr, "can't use cache directory %s, running without it\n", cache_dir);
+    }
+    vmtoy_job_result r;
+    if (!vmtoy_job_run(&job, cache, &r)) {
+        printf("out of memory\n");
+        exit(1);
+    }
+    fwrite(r.output, 1, r.output_size, stdout);
+    fflush(stdout);
+    if (r.exit == VMTOY_EXIT_BAD_TRAP) {
+        fprintf(stderr, "\nunknown trap\n");
+    }
 
-// Catching Ctrl+C so we can exit gracefully and fix the terminal.
-void handle_interrupt(int signal) {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    int reason = r.exit;
+    vmtoy_job_result_free(&r);
+    vmtoy_cache_close(cache);
+    free((void*)job.input);
+    for (int i = 0; i < count; ++i) {
+        free((void*)images[i]);
+    }
+    return reason == VMTOY_EXIT_HALT || reason == VMTOY_EXIT_INPUT_EOF ? 0 : 1;
+}
+
+// `lc3-vm --disassemble IMAGE...`: what's in the images, a word per line, without
+// running anything. Data disassembles too; it just doesn't make much sense.
+int disassemble_images(int argc, const char* argv[], int first_image) {
+    for (int i = first_image; i < argc; ++i) {
+        size_t size;
+        uint8_t* image = read_file(argv[i], &size);
+        if (!image || size < 2) {
+            printf("failed to load image: %s\n", argv[i]);
+            free(image);
+            return 1;
+        }
+        printf("; %s\n", argv[i]);
+        uint16_t origin = (uint16_t)(image[0] << 8 | image[1]);
+        for (size_t at = 2; at + 1 < size; at += 2) {
+            uint16_t addr = (uint16_t)(origin + (at - 2) / 2);
+            uint16_t word = (uint16_t)(image[at] << 8 | image[at + 1]);
+            char text[32];
+            vmtoy_disassemble(word, text, sizeof(text));
+            printf("x%04X  %04X  %s\n", addr, word, text);
+        }
+        free(image);
+    }
+    return 0;
+}
+
+// `--trace-traps FILE`: what's in the VM's trap trace ring, as text, between quanta.
+// There's at most one TRAP per instruction, so quanta no longer than the ring never
+// lose any.
+#define TRACE_RING 4096
+
+void write_trace(vmtoy* vm, FILE* out) {
+    vmtoy_trap_event events[256];
+    size_t n;
+    while ((n = vmtoy_trace_read(vm, events, sizeof(events) / sizeof(events[0]))) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            char line[256];
+            vmtoy_trace_format(vm, &events[i], line, sizeof(line));
+            fprintf(out, "%s\n", line);
+        }
+    }
+    fflush(out);
 }
 
 int main(int argc, const char* argv[]) {
@@ -217,196 +296,233 @@ int main(int argc, const char* argv[]) {
     // Fix the terminal input mode.
     disable_input_buffering();
 
+    // A couple of switches before the image list.
+    int first_image = 1;
+    unsigned show = 0;
+    unsigned flags = 0;
+    unsigned harts = 1;
+    const char* restore_path = NULL;
+    const char* save_path = NULL;
+    const char* input_path = NULL;
+    const char* cache_dir = NULL;
+    uint64_t cache_mb = 256;
+    const char* shm_io = NULL;
+    const char* publish = NULL;
+    int disassemble = 0;
+    const char* trace_path = NULL;
+    for (; first_image < argc && argv[first_image][0] == '-'; ++first_image) {
+        if (strcmp(argv[first_image], "--strict-traps") == 0) {
+            flags |= VMTOY_F_STRICT_TRAPS;
+        } else if (strcmp(argv[first_image], "--sparse") == 0) {
+            flags |= VMTOY_F_SPARSE_MEMORY;
+        } else if (strcmp(argv[first_image], "--arena") == 0) {
+            flags |= VMTOY_F_ARENA;
+        } else if (strcmp(argv[first_image], "--predecode") == 0) {
+            flags |= VMTOY_F_PREDECODE;
+        } else if (strcmp(argv[first_image], "--trap-stats") == 0) {
+            show |= SHOW_TRAP_STATS;
+        } else if (strcmp(argv[first_image], "--footprint") == 0) {
+            show |= SHOW_FOOTPRINT;
+        } else if (strcmp(argv[first_image], "--harts") == 0 && first_image + 1 < argc) {
+            harts = (unsigned)atoi(argv[++first_image]);
+        } else if (strcmp(argv[first_image], "--restore") == 0 && first_image + 1 < argc) {
+            restore_path = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--save") == 0 && first_image + 1 < argc) {
+            save_path = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--input") == 0 && first_image + 1 < argc) {
+            input_path = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--cache") == 0 && first_image + 1 < argc) {
+            cache_dir = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--cache-size") == 0 && first_image + 1 < argc) {
+            cache_mb = strtoull(argv[++first_image], NULL, 10);
+        } else if (strcmp(argv[first_image], "--shm-io") == 0 && first_image + 1 < argc) {
+            shm_io = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--publish") == 0 && first_image + 1 < argc) {
+            publish = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--trace-traps") == 0 && first_image + 1 < argc) {
+            trace_path = argv[++first_image];
+        } else if (strcmp(argv[first_image], "--disassemble") == 0) {
+            disassemble = 1;
+        } else if (strcmp(argv[first_image], "--monitor") == 0 && first_image + 1 < argc) {
+            restore_input_buffering();
+            return show_monitor(argv[first_image + 1]);
+        } else {
+            break;
+        }
+    }
+
     // Check if the user gave us a program to run.
-    if (argc < 2) {
-         printf("lc3 [image-file]...\n");
+    if (first_image >= argc && !restore_path) {
+         printf("lc3 [--strict-traps] [--sparse] [--arena] [--predecode] [--trap-stats] [--footprint] [--harts N] [--restore snapshot] [--save snapshot] [--input file [--cache dir] [--cache-size MB]] [--shm-io name] [--publish name] [--monitor name] [--trace-traps file] [--disassemble] [image-file]... [--pipe image-file...]...\n");
          exit(2);
     }
-
-    // Load the program(s) into memory.
-    // Yes, you can load multiple files. They just go into different places in memory.
-    for (int j = 1; j < argc; ++j) {
-        if (!read_image(argv[j])) {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+    if (disassemble) {
+        restore_input_buffering();
+        return disassemble_images(argc, argv, first_image);
+    }
+    if (cache_dir && !input_path) {
+        printf("--cache needs --input: only runs with all their input up front can be cached\n");
+        exit(2);
+    }
+    if (input_path) {
+        int piped = 0;
+        for (int j = first_image; j < argc; ++j) {
+            if (strcmp(argv[j], "--pipe") == 0) piped = 1;
         }
+        if (piped || harts != 1 || restore_path || save_path || trace_path) {
+            printf("--input doesn't mix with --harts, --pipe, snapshots or --trace-traps\n");
+            exit(2);
+        }
+        return run_job(argc, argv, first_image, flags, input_path, cache_dir, cache_mb << 20);
+    }
+    if ((restore_path || save_path) && harts != 1) {
+        printf("snapshots are for a single hart\n");
+        exit(2);
     }
 
-    // Resetting the mood ring (condition flag) to zero.
-    regs[R_COND] = FL_ZRO;
-
-    // LC-3 programs usually start at address 0x3000. It's just a rule.
-    enum { PC_START = 0x3000 };
-
-    // Point the PC to the starting line.
-    regs[R_PC] = PC_START;
+    if ((shm_io || publish || trace_path) && harts != 1) {
+        printf("--shm-io, --publish and --trace-traps are for a single hart\n");
+        exit(2);
+    }
 
-    // And... we're off!
-    int running  = 1;
+    for (int j = first_image; j < argc; ++j) {
+        if (strcmp(argv[j], "--pipe") == 0) {
+            if (harts != 1 || restore_path || save_path || shm_io || publish || trace_path) {
+                printf("--pipe doesn't mix with --harts, snapshots, --shm-io, --publish or --trace-traps\n");
+                exit(2);
+            }
+            return run_pipeline(argc, argv, first_image, flags, show);
+        }
+    }
 
-    while(running) {
-        // Fetch the instruction and increment the PC.
-        // "What do I do next?"
-        uint16_t instr = mem_read(regs[R_PC]++);
+    // Picking up where a saved session left off: the snapshot pages itself in as the
+    // program touches its memory.
+    vmtoy_smp* smp = NULL;
+    vmtoy* vm;
+    if (restore_path) {
+        vm = vmtoy_snapshot_restore(restore_path, VMTOY_RESTORE_LAZY);
+        if (!vm) {
+            printf("failed to restore snapshot: %s\n", restore_path);
+            exit(1);
+        }
+    } else if (harts == 1) {
+        // The plain old VM, with memory of its own so --sparse and --arena apply to it.
+        vm = vmtoy_create(flags);
+        if (!vm) {
+            printf("out of memory\n");
+            exit(1);
+        }
+    } else {
+        // Harts sharing one flat memory.
+        smp = vmtoy_smp_create(harts, flags);
+        if (!smp) {
+            printf("can't create %u harts\n", harts);
+            exit(1);
+        }
+        vm = vmtoy_smp_hart(smp, 0);
+    }
 
-        uint16_t op = instr >> 12;
+    vmtoy_io console = { no_keyboard_read, no_keyboard_poll, console_write, console_flush, NULL };
+    for (unsigned h = 1; h < harts; ++h) {
+        vmtoy_set_io(vmtoy_smp_hart(smp, h), &console);
+    }
 
-        uint16_t r0, r1, r2, imm_flag, pcoffset;
+    // Load the program(s) into memory.
+    // Yes, you can load multiple files. They just go into different places in memory.
+    for (int j = first_image; j < argc; ++j) {
+        if (!vmtoy_load_image_file(vm, argv[j])) {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
 
-        // This is where the magic happens. We look at the opcode (the first 4 bits)
-        // and decide which operation to execute. It's the heartbeat of the CPU.
-        // The documentation of different op codes can be found online
-        switch(op) {
-            case OP_ADD:
-            r0 = (instr >> 9) & 0x7;
-            r1 = (instr >> 6) & 0x7;
+    // Letting other processes watch.
+    if (publish) {
+        if (!vmtoy_monitor_publish(vm, publish)) {
+            printf("can't publish the VM as %s\n", publish);
+            exit(1);
+        }
+        publish_name = publish;
+    }
 
-            imm_flag = (instr >> 5) & 0x1;
+    // Keyboard and console in shared memory, for a driver in another process.
+    vmtoy_shm_io* shm = NULL;
+    if (shm_io) {
+        shm = vmtoy_shm_io_create(shm_io, 0);
+        if (!shm) {
+            printf("can't create shared memory I/O: %s\n", shm_io);
+            exit(1);
+        }
+        shm_name = shm_io;
+        vmtoy_shm_io_attach(shm, vm);
+    }
 
-            if (imm_flag) {
-                uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                regs[r0] = regs[r1] + imm5;
-            } else {
-                uint16_t r2 = instr & 0x7;
-                regs[r0] = regs[r1] + regs[r2];
-            }
-            update_flags(r0);
-            break;
-            case OP_AND:
-            r0 = (instr >> 9) & 0x7;
-            r1 = (instr >> 6) & 0x7;
+    // Keeping a log of the TRAPs, strace style.
+    FILE* trace = NULL;
+    if (trace_path) {
+        trace = fopen(trace_path, "w");
+        if (!trace || !vmtoy_trace_traps(vm, TRACE_RING)) {
+            printf("can't trace traps to %s\n", trace_path);
+            exit(1);
+        }
+    }
 
-            imm_flag = (instr >> 5) & 0x1;
+    // Decoding the whole program now, so it runs at full speed from the first instruction.
+    // (Harts sharing memory don't predecode; for them this does nothing.)
+    if (flags & VMTOY_F_PREDECODE) {
+        vmtoy_predecode(vm);
+    }
 
-            if (imm_flag) {
-                uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-                regs[r0] = regs[r1] & imm5;
-            } else {
-                uint16_t r2 = instr & 0x7;
-                regs[r0] = regs[r1] & regs[r2];
-            }
-            update_flags(r0);
-            break;
-            case OP_NOT:
-            r0 = (instr >> 9) & 0x7;
-            r1 = (instr >> 6) & 0x7;
-            regs[r0] = ~regs[r1];
-            update_flags(r0);
-            break;
-            case OP_BR:
-            uint16_t cond_flag = (instr >> 9) & 0x7;
-            pcoffset = sign_extend(instr & 0x1FF, 9);
-            if (cond_flag & regs[R_COND]) {
-                regs[R_PC] += pcoffset;
-            }
-            break;
-            case OP_JMP:
-                r1 = (instr >> 6) & 0x7;
-                regs[R_PC] = regs[r1];
-            break;
-            case OP_JSR:
-            cond_flag = (instr >> 11) & 1;
-            regs[R_R7] = regs[R_PC];
-            if (cond_flag == 0) {
-                r1 = (instr >> 6) & 0x7;
-                regs[R_PC] = regs[r1];
+    // And... we're off!
+    int reason;
+    if (harts == 1) {
+        unsigned idle = 0;
+        uint64_t last = 0;
+        uint64_t quantum = trace ? TRACE_RING : QUANTUM;
+        while ((reason = vmtoy_run_for(vm, quantum)) == VMTOY_EXIT_BUDGET
+               || (shm && reason == VMTOY_EXIT_BLOCKED)) {
+            // Blocked straight away counts as idle; blocked after doing some work doesn't.
+            if (trace) write_trace(vm, trace);
+            uint64_t now = vmtoy_icount(vm);
+            if (now != last) {
+                idle = 0;
+                last = now;
             } else {
-                regs[R_PC] += sign_extend(instr & 0x7FF, 11);
+                shm_idle(&idle);
             }
-            break;
-            case OP_LD:
-            r0 =  (instr >> 9) & 0x7;
-            regs[r0] = mem_read( regs[R_PC] + sign_extend((instr & 0x1FF), 9));
-            update_flags(r0);
-            break;
-            case OP_LDI:
-            uint16_t r0 = (instr >> 9) & 0x7;
-            pcoffset = sign_extend(instr & 0x1FF, 9);
-            regs[r0] = mem_read(mem_read(regs[R_PC] + pcoffset));
-            update_flags(r0);
-            break;
-            case OP_LDR:
-            r0 = (instr >> 9) & 0x7;
-            r1 = (instr >> 6 & 0x7);
-            uint16_t offset_6 = sign_extend(instr & 0x3F, 6);
+        }
+    } else {
+        if (!vmtoy_smp_run(smp)) {
+            printf("can't start the hart threads\n");
+        }
+        reason = vmtoy_smp_exit(smp, 0);
+    }
 
-            regs[r0] = mem_read(regs[r1] + offset_6);
-            update_flags(r0);
-            break;
-            case OP_LEA:
-            r0 = (instr >> 9) & 0x7;
-            pcoffset = sign_extend(instr & 0x1FF, 9);
-            regs[r0] = regs[R_PC] + pcoffset;
-            update_flags(r0);
-            break;
-            case OP_ST:
-                r0 = (instr >> 9) & 0x7;
-                pcoffset = sign_extend(instr & 0x1FF, 9);
-                mem_write(regs[R_PC] + pcoffset, regs[r0]);
-            break;
-            case OP_STI:
-            r0 = (instr >> 9) & 0x7;
-            pcoffset = sign_extend(instr & 0x1FF, 9);
-            mem_write(mem_read(regs[R_PC] + pcoffset), regs[r0]);
-            break;
-            case OP_STR:
-             r0 = (instr >> 9) & 0x7;
-                r1 = (instr >> 6) & 0x7;
-                pcoffset = sign_extend(instr & 0x3F, 6);
-               mem_write(regs[r1] + pcoffset, regs[r0]);
-            break;
-            case OP_TRAP:
-            regs[R_R7] = regs[R_PC];
-
-            switch (instr & 0xFF) {
-                case TRAP_GETC:
-                    regs[R_R0] = (uint16_t)getchar();
-                    update_flags(R_R0);
-                break;
-                case TRAP_OUT:
-                    putc((char)regs[R_R0], stdout);
-                    fflush(stdout);
-                break;
-                case TRAP_PUTS:
-                    uint16_t* c = memory + regs[R_R0];
-                    while(*c) {
-                        putc((char)*c, stdout);
-                        ++c;
-                    }
-                    fflush(stdout);
-                break;
-                case TRAP_IN:
-                    printf("Enter a character: ");
-                    char ch = getchar();
-                    putc(ch, stdout);
-                    fflush(stdout);
-                    regs[R_R0] = (uint16_t)c;
-                    update_flags(R_R0);
-                break;
-                case TRAP_PUTSP:
-                    uint16_t* sp = memory + regs[R_R0];
-                    while (*sp)
-                    {
-                        char char1 = (*sp) & 0xFF;
-                        putc(char1, stdout);
-                        char char2 = (*sp) >> 8;
-                        if (char2) putc(char2, stdout);
-                        ++sp;
-                    }
-                    fflush(stdout);
-                break;
-                case TRAP_HALT:
-                    puts("HALT");
-                    fflush(stdout);
-                    running = 0;
-                break;
-            }
-            break;
-            case OP_RES:
-            case OP_RTI:
-            default:
-            // Bad OP_CODE todo
-            break;
+    restore_input_buffering();
+    vmtoy_shm_io_close(shm);
+    shm_name = NULL;
+    if (trace) {
+        write_trace(vm, trace);
+        if (vmtoy_trace_dropped(vm)) {
+            fprintf(trace, "(%llu earlier traps didn't fit in the ring)\n",
+                    (unsigned long long)vmtoy_trace_dropped(vm));
+        }
+        fclose(trace);
+    }
+    if (save_path && !vmtoy_snapshot_save(vm, save_path)) {
+        printf("failed to save snapshot: %s\n", save_path);
+    }
+    if (!smp) {
+        report(vm, reason, show, NULL);
+        vmtoy_destroy(vm);
+        publish_name = NULL;
+    } else {
+        for (unsigned h = 0; h < harts; ++h) {
+            char who[32];
+            snprintf(who, sizeof(who), "hart %u", h);
+            report(vmtoy_smp_hart(smp, h), vmtoy_smp_exit(smp, h), show, who);
         }
-    };
+        vmtoy_smp_destroy(smp);
+    }
+    return reason == VMTOY_EXIT_HALT || reason == VMTOY_EXIT_INPUT_EOF ? 0 : 1;
 }
@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "internal.h"
+
+// The arena
+// With VMTOY_F_ARENA, VMs (and their sparse pages) come out of 2 MiB chunks instead of
+// malloc(). Each chunk is backed by one huge page when the kernel will give us one, so
+// a scheduler hopping between hundreds of VMs touches a handful of TLB entries rather
+// than a few per VM. Every chunk holds objects of one class only, and a VM context
+// sits right in front of its memory.
+//
+// Freed objects go on a free list for their class and get handed out again. Chunks are
+// never given back to the OS: a host that had 500 VMs once will probably have 500 again.
+
+#define CHUNK_BYTES ((size_t)2 << 20)
+
+// Objects start on cache lines so two VMs never share one.
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct free_obj {
+    struct free_obj* next;
+};
+
+struct arena_class {
+    size_t size;
+    char* next;           // Bump allocation in the newest chunk...
+    char* end;
+    struct free_obj* free; // ...after the free list is empty.
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct arena_class classes[ARENA_CLASS_COUNT];
+    vmtoy_arena_stats stats;
+} arena = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .classes = {
+        [ARENA_NONE] = { 0, NULL, NULL, NULL },
+        [ARENA_VM] = { ARENA_ROUND(sizeof(vmtoy)), NULL, NULL, NULL },
+        [ARENA_VM_FLAT] = { ARENA_ROUND(sizeof(vmtoy)) + MEMORY_BYTES, NULL, NULL, NULL },
+        [ARENA_PAGE] = { PAGE_WORDS * sizeof(uint16_t), NULL, NULL, NULL },
+    },
+};
+
+// A fresh chunk, 2 MiB aligned so it can be a huge page. Explicit hugetlbfs pages
+// first; they're only there if the admin reserved some. Otherwise ordinary memory
+// with a polite request for transparent huge pages.
+static char* chunk_new(void)
+{
+    void* p = mmap(NULL, CHUNK_BYTES, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        arena.stats.huge_chunks++;
+        return p;
+    }
+
+    // Map twice as much and trim, so what's left starts on a 2 MiB boundary.
+    char* raw = mmap(NULL, 2 * CHUNK_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) { return NULL; }
+    char* aligned = (char*)(((uintptr_t)raw + CHUNK_BYTES - 1) & ~(uintptr_t)(CHUNK_BYTES - 1));
+    if (aligned > raw) { munmap(raw, (size_t)(aligned - raw)); }
+    char* tail = aligned + CHUNK_BYTES;
+    if (tail < raw + 2 * CHUNK_BYTES) { munmap(tail, (size_t)(raw + 2 * CHUNK_BYTES - tail)); }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, CHUNK_BYTES, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+// A zeroed object of the given class, or NULL.
+void* arena_alloc(int cls)
+{
+    struct arena_class* c = &arena.classes[cls];
+    void* obj = NULL;
+    int recycled = 0;
+
+    pthread_mutex_lock(&arena.lock);
+    if (c->free) {
+        obj = c->free;
+        c->free = c->free->next;
+        recycled = 1;
+    } else {
+        if (c->next == NULL || (size_t)(c->end - c->next) < c->size) {
+            char* chunk = chunk_new();
+            if (chunk) {
+                arena.stats.chunks++;
+                c->next = chunk;
+                c->end = chunk + CHUNK_BYTES;
+            }
+        }
+        if (c->next && (size_t)(c->end - c->next) >= c->size) {
+            obj = c->next;
+            c->next += c->size;
+        }
+    }
+    if (obj) {
+        arena.stats.in_use++;
+    }
+    pthread_mutex_unlock(&arena.lock);
+
+    // Straight from a fresh chunk it's zero already, but recycled objects aren't.
+    if (recycled) { memset(obj, 0, c->size); }
+    return obj;
+}
+
+void arena_free(int cls, void* obj)
+{
+    if (!obj) { return; }
+    struct arena_class* c = &arena.classes[cls];
+    pthread_mutex_lock(&arena.lock);
+    struct free_obj* f = obj;
+    f->next = c->free;
+    c->free = f;
+    arena.stats.in_use--;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+// Where the flat memory of an ARENA_VM_FLAT object lives: right after the context.
+uint16_t* arena_vm_memory(vmtoy* vm)
+{
+    return (uint16_t*)((char*)vm + arena.classes[ARENA_VM].size);
+}
+
+void vmtoy_arena_get_stats(vmtoy_arena_stats* stats)
+{
+    pthread_mutex_lock(&arena.lock);
+    *stats = arena.stats;
+    pthread_mutex_unlock(&arena.lock);
+}
@@ -0,0 +1,260 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "snapshot.h"
+
+// The result cache
+// One file per job result in a directory, named after the job's key (job.c):
+//   struct cache_entry, then the output.
+// A result goes in under a temporary name and is renamed into place, so readers (this
+// process or any other sharing the directory) only ever see whole entries. A process
+// that dies halfway through a store leaves its temporary file behind; those go once
+// they're a few minutes old, which no store in progress ever is.
+//
+// The directory is kept under `max_bytes`: once it goes over, the entries used least
+// recently go until it's back down to 90%. A hit bumps the entry's mtime, so mtime
+// order is use order. The byte count is only this process's idea of the total; it
+// starts from a scan of the directory and gets corrected by every eviction pass, which
+// is plenty for a cache.
+
+#define CACHE_MAGIC "VMTOYRES"
+#define CACHE_VERSION 2
+#define CACHE_SUFFIX ".res"
+#define CACHE_TMP_SUFFIX ".tmp"
+#define CACHE_TMP_MAX_AGE 300   // Seconds.
+
+struct cache_entry {
+    char magic[8];
+    uint32_t version;
+    int32_t exit;
+    uint64_t key[2];
+    uint64_t icount;
+    uint64_t output_size;
+};
+
+struct vmtoy_cache {
+    pthread_mutex_t lock;
+    char* dir;
+    uint64_t max_bytes;
+    uint64_t bytes;      // What we think the directory holds.
+    vmtoy_cache_stats stats;
+};
+
+static void entry_path(const vmtoy_cache* c, const uint64_t key[2], char* path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx%016llx" CACHE_SUFFIX, c->dir,
+             (unsigned long long)key[0], (unsigned long long)key[1]);
+}
+
+static int has_suffix(const char* name, const char* suffix)
+{
+    size_t n = strlen(name);
+    size_t s = strlen(suffix);
+    return n > s && strcmp(name + n - s, suffix) == 0;
+}
+
+struct cache_file {
+    char* name;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+static int older_first(const void* a, const void* b)
+{
+    const struct cache_file* x = a;
+    const struct cache_file* y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) { return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1; }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) { return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1; }
+    return strcmp(x->name, y->name);
+}
+
+// Counts what's in the directory and, if that's over `limit`, removes the oldest
+// entries until it isn't. Temporary files left over from a crash go on the way.
+// Called with the lock held.
+static void cache_trim(vmtoy_cache* c, uint64_t limit)
+{
+    DIR* d = opendir(c->dir);
+    if (!d) { return; }
+
+    struct cache_file* files = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t total = 0;
+    int dfd = dirfd(d);
+    time_t stale = time(NULL) - CACHE_TMP_MAX_AGE;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        int entry = has_suffix(de->d_name, CACHE_SUFFIX);
+        if ((!entry && !has_suffix(de->d_name, CACHE_TMP_SUFFIX))
+            || fstatat(dfd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (!entry) {
+            if (st.st_mtim.tv_sec < stale) { unlinkat(dfd, de->d_name, 0); }
+            continue;
+        }
+        if (count == cap) {
+            size_t ncap = cap ? cap * 2 : 64;
+            struct cache_file* nf = realloc(files, ncap * sizeof(*files));
+            if (!nf) { break; }
+            files = nf;
+            cap = ncap;
+        }
+        files[count].name = strdup(de->d_name);
+        if (!files[count].name) { break; }
+        files[count].size = (uint64_t)st.st_size;
+        files[count].mtime = st.st_mtim;
+        total += files[count].size;
+        count++;
+    }
+
+    if (total > limit) {
+        qsort(files, count, sizeof(*files), older_first);
+        for (size_t i = 0; i < count && total > limit; ++i) {
+            if (unlinkat(dfd, files[i].name, 0) == 0 || errno == ENOENT) {
+                total -= files[i].size;
+                c->stats.evicted++;
+            }
+        }
+    }
+    c->bytes = total;
+    for (size_t i = 0; i < count; ++i) {
+        free(files[i].name);
+    }
+    free(files);
+    closedir(d);
+}
+
+vmtoy_cache* vmtoy_cache_open(const char* dir, uint64_t max_bytes)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) { return NULL; }
+    vmtoy_cache* c = calloc(1, sizeof(*c));
+    if (!c) { return NULL; }
+    c->dir = strdup(dir);
+    if (!c->dir) {
+        free(c);
+        return NULL;
+    }
+    c->max_bytes = max_bytes;
+    pthread_mutex_init(&c->lock, NULL);
+    cache_trim(c, max_bytes);
+    return c;
+}
+
+void vmtoy_cache_close(vmtoy_cache* c)
+{
+    if (!c) { return; }
+    pthread_mutex_destroy(&c->lock);
+    free(c->dir);
+    free(c);
+}
+
+void vmtoy_cache_get_stats(vmtoy_cache* c, vmtoy_cache_stats* stats)
+{
+    pthread_mutex_lock(&c->lock);
+    *stats = c->stats;
+    stats->bytes = c->bytes;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void count_lookup(vmtoy_cache* c, int hit)
+{
+    pthread_mutex_lock(&c->lock);
+    if (hit) {
+        c->stats.hits++;
+    } else {
+        c->stats.misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_lookup(vmtoy_cache* c, const uint64_t key[2], vmtoy_job_result* out)
+{
+    char path[4096];
+    entry_path(c, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        count_lookup(c, 0);
+        return 0;
+    }
+
+    struct cache_entry e;
+    struct stat st;
+    int ok = read_all(fd, &e, sizeof(e), 0)
+          && memcmp(e.magic, CACHE_MAGIC, sizeof(e.magic)) == 0
+          && e.version == CACHE_VERSION
+          && e.key[0] == key[0] && e.key[1] == key[1]
+          && fstat(fd, &st) == 0
+          && (uint64_t)st.st_size == sizeof(e) + e.output_size;
+    uint8_t* output = NULL;
+    if (ok && e.output_size) {
+        output = malloc(e.output_size);
+        ok = output && read_all(fd, output, e.output_size, sizeof(e));
+    }
+    // Used just now, so it's the last to go.
+    if (ok) { futimens(fd, NULL); }
+    close(fd);
+
+    if (!ok) {
+        free(output);
+        count_lookup(c, 0);
+        return 0;
+    }
+    out->exit = e.exit;
+    out->icount = e.icount;
+    out->output = output;
+    out->output_size = e.output_size;
+    count_lookup(c, 1);
+    return 1;
+}
+
+void cache_store(vmtoy_cache* c, const uint64_t key[2], const vmtoy_job_result* r)
+{
+    uint64_t size = sizeof(struct cache_entry) + r->output_size;
+    // Bigger than the whole cache: it would only push everything else out.
+    if (size > c->max_bytes) { return; }
+
+    struct cache_entry e;
+    memset(&e, 0, sizeof(e));
+    memcpy(e.magic, CACHE_MAGIC, sizeof(e.magic));
+    e.version = CACHE_VERSION;
+    e.exit = r->exit;
+    e.key[0] = key[0];
+    e.key[1] = key[1];
+    e.icount = r->icount;
+    e.output_size = r->output_size;
+
+    char path[4096];
+    char tmp[4096 + 32];
+    entry_path(c, key, path, sizeof(path));
+    // Unique per store, so two threads storing the same result don't share a file.
+    static unsigned long seq;
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%lu" CACHE_TMP_SUFFIX, path, (long)getpid(),
+             __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { return; }
+    int ok = write_all(fd, &e, sizeof(e), 0)
+          && (!r->output_size || write_all(fd, r->output, r->output_size, sizeof(e)));
+    if (close(fd) != 0) { ok = 0; }
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->stats.stored++;
+    c->bytes += size;
+    // Down to 90% rather than just under, so we aren't back here on the very next store.
+    if (c->bytes > c->max_bytes) { cache_trim(c, c->max_bytes - c->max_bytes / 10); }
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include "internal.h"
+
+// Calling into the guest
+// The host plays the part of a JSR: arguments go in R0 and up, R7 points at a return
+// address no real code lives at, and we run until the routine RETs there.
+// Everything the caller could see (registers, run loop state, a half-printed
+// string) is stashed on the C stack, so calls nest as deep as handlers like.
+
+int vmtoy_call(vmtoy* vm, uint16_t addr, const uint16_t* args, unsigned nargs,
+               uint64_t budget, uint16_t* result)
+{
+    if (vm->call_depth >= VMTOY_CALL_MAX_DEPTH) {
+        return VMTOY_EXIT_TOO_DEEP;
+    }
+    // R7 is the return address, so that's the most arguments we can pass.
+    if (nargs > R_R7) {
+        nargs = R_R7;
+    }
+
+    uint16_t saved_regs[R_COUNT];
+    memcpy(saved_regs, vm->regs, sizeof(saved_regs));
+    int saved_exit = vm->exit;
+    uint16_t saved_out_pos = vm->out_pos;
+
+    for (unsigned i = 0; i < nargs; ++i) {
+        vm->regs[R_R0 + i] = args[i];
+    }
+    vm->regs[R_R7] = VMTOY_CALL_RETURN;
+    vm->regs[R_PC] = addr;
+    vm->out_pos = 0;
+
+    vm->call_depth++;
+    int reason = vmtoy_run_for(vm, budget);
+    vm->call_depth--;
+
+    if (result) {
+        *result = vm->regs[R_R0];
+    }
+
+    memcpy(vm->regs, saved_regs, sizeof(saved_regs));
+    vm->out_pos = saved_out_pos;
+    // Whoever was running before us carries on as if nothing happened,
+    // unless somebody asked everyone to stop in the meantime.
+    vm->exit = reason == VMTOY_EXIT_STOPPED ? VMTOY_EXIT_STOPPED : saved_exit;
+    return reason;
+}
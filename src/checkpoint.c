@@ -0,0 +1,274 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "internal.h"
+#include "snapshot.h"
+
+// Incremental checkpoints
+// A long job wants to survive a crash without stopping for a full snapshot every few
+// seconds. So: one full snapshot to start with (the base), then every checkpoint
+// appends a record to a log with just the pages written since the one before, plus
+// the registers. Knowing which pages those are costs nothing while the VM runs: after
+// each checkpoint we write-protect the pages we saved (mem_protect()), and the first
+// write to each goes down mem_write_slow(), which marks it dirty on its way through.
+//
+// A record is:
+//   struct ckpt_record, then `pages` times { uint16_t page; uint16_t pad; words[256] },
+//   then a 64-bit hash of all of the above.
+// A crash halfway through appending leaves a record whose hash doesn't add up; restore
+// and compaction stop at the last good one.
+
+#define CKPT_MAGIC "VMTOYCKP"
+
+struct ckpt_record {
+    char magic[8];
+    uint64_t seq;       // Counts up by one per record, across compactions.
+    uint32_t pages;
+    uint32_t reserved;
+    struct snap_state state;
+};
+
+struct ckpt_page {
+    uint16_t page;
+    uint16_t pad;
+    uint16_t words[PAGE_WORDS];
+};
+
+struct vmtoy_checkpoint {
+    vmtoy* vm;
+    int log_fd;
+    unsigned options;
+    uint64_t seq;
+    off_t log_end;      // Where the last good record ends; -1 if the log's past saving.
+    uint8_t* buf;       // Room for the biggest record there can be.
+};
+
+#define CKPT_MAX_BYTES \
+    (sizeof(struct ckpt_record) + PAGE_COUNT * sizeof(struct ckpt_page) + sizeof(uint64_t))
+
+static uint64_t record_hash(const uint8_t* rec, size_t size)
+{
+    return hash_words((const uint16_t*)rec, size / 2, 0x434B5054);
+}
+
+vmtoy_checkpoint* vmtoy_checkpoint_start(vmtoy* vm, const char* base_path, const char* log_path,
+                                         unsigned options)
+{
+    // Harts share their memory, and each keeps its own page table.
+    if (vm->mem_kind == MEM_BORROWED) { return NULL; }
+
+    vmtoy_checkpoint* c = calloc(1, sizeof(*c));
+    if (!c) { return NULL; }
+    c->buf = malloc(CKPT_MAX_BYTES);
+    c->log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (!c->buf || c->log_fd < 0 || !vmtoy_snapshot_save(vm, base_path)) {
+        vmtoy_checkpoint_close(c);
+        return NULL;
+    }
+    c->vm = vm;
+    c->options = options;
+
+    // Everything from here on is news.
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        mem_protect(vm, p);
+    }
+    return c;
+}
+
+void vmtoy_checkpoint_close(vmtoy_checkpoint* c)
+{
+    if (!c) { return; }
+    if (c->log_fd >= 0) { close(c->log_fd); }
+    free(c->buf);
+    free(c);
+}
+
+int vmtoy_checkpoint_write(vmtoy_checkpoint* c)
+{
+    vmtoy* vm = c->vm;
+    if (c->log_end < 0) { return 0; }
+    // The page table of a hibernating VM doesn't have its pages in it.
+    if (vm->hib && !vmtoy_wake(vm)) { return 0; }
+
+    struct ckpt_record* rec = (struct ckpt_record*)c->buf;
+    memset(rec, 0, sizeof(*rec));
+    memcpy(rec->magic, CKPT_MAGIC, sizeof(rec->magic));
+    rec->seq = c->seq + 1;
+    snap_state_save(&rec->state, vm);
+
+    struct ckpt_page* out = (struct ckpt_page*)(rec + 1);
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (!mem_dirty(vm, p)) { continue; }
+        out->page = (uint16_t)p;
+        out->pad = 0;
+        memcpy(out->words, vm->rd[p], sizeof(out->words));
+        out++;
+        rec->pages++;
+    }
+    size_t size = (size_t)((uint8_t*)out - c->buf);
+    uint64_t hash = record_hash(c->buf, size);
+    memcpy(c->buf + size, &hash, sizeof(hash));
+    size += sizeof(hash);
+
+    // One write, so a record is either all there or obviously torn. A torn one comes
+    // off again straight away: restore stops at the first bad record, and it'd take
+    // every good one written after it down with it.
+    if (write(c->log_fd, c->buf, size) != (ssize_t)size
+        || ((c->options & VMTOY_CHECKPOINT_SYNC) && fdatasync(c->log_fd) != 0)) {
+        // If it won't come off, nothing written after it would count either.
+        if (ftruncate(c->log_fd, c->log_end) != 0) { c->log_end = -1; }
+        return 0;
+    }
+    c->log_end += (off_t)size;
+
+    // Only now that it's safely written do those pages stop being dirty.
+    out = (struct ckpt_page*)(rec + 1);
+    for (uint32_t i = 0; i < rec->pages; ++i) {
+        mem_protect(vm, out[i].page);
+    }
+    c->seq++;
+    return 1;
+}
+
+// Calls `fn` with every good record in the log, in order. Returns how many there were.
+typedef void (*ckpt_fn)(const struct ckpt_record* rec, void* ctx);
+
+// The hash only catches accidents, so check the page numbers before anybody indexes
+// a page table (or a memory image) with them.
+static int pages_fit(const struct ckpt_record* rec)
+{
+    const struct ckpt_page* pg = (const struct ckpt_page*)(rec + 1);
+    for (uint32_t i = 0; i < rec->pages; ++i) {
+        if (pg[i].page >= PAGE_COUNT) { return 0; }
+    }
+    return 1;
+}
+
+static unsigned log_replay(int fd, ckpt_fn fn, void* ctx)
+{
+    uint8_t* buf = malloc(CKPT_MAX_BYTES);
+    if (!buf) { return 0; }
+
+    unsigned count = 0;
+    uint64_t seq = 0;
+    off_t offset = 0;
+    for (;;) {
+        struct ckpt_record* rec = (struct ckpt_record*)buf;
+        if (!read_all(fd, rec, sizeof(*rec), offset)) { break; }
+        if (memcmp(rec->magic, CKPT_MAGIC, sizeof(rec->magic)) != 0
+            || (count && rec->seq != seq + 1) || rec->pages > PAGE_COUNT) { break; }
+        seq = rec->seq;
+        size_t size = sizeof(*rec) + rec->pages * sizeof(struct ckpt_page);
+        uint64_t hash;
+        if (!read_all(fd, buf + sizeof(*rec), size - sizeof(*rec) + sizeof(hash), offset + (off_t)sizeof(*rec))) {
+            break;
+        }
+        memcpy(&hash, buf + size, sizeof(hash));
+        if (hash != record_hash(buf, size) || !pages_fit(rec)) { break; }
+
+        fn(rec, ctx);
+        count++;
+        offset += (off_t)(size + sizeof(hash));
+    }
+    free(buf);
+    return count;
+}
+
+// The state hash follows along a word at a time, so a lazily restored VM only reads
+// the pages the log has in it.
+static void apply_to_vm(const struct ckpt_record* rec, void* ctx)
+{
+    vmtoy* vm = ctx;
+    const struct ckpt_page* pg = (const struct ckpt_page*)(rec + 1);
+    for (uint32_t i = 0; i < rec->pages; ++i) {
+        uint16_t* dst = mem_page_for_write(vm, pg[i].page);
+        if (!dst) { continue; }
+        if (vm->flags & VMTOY_F_STATE_HASH) {
+            for (unsigned w = 0; w < PAGE_WORDS; ++w) {
+                mem_hash_write(vm, (uint16_t)(pg[i].page << PAGE_SHIFT | w), dst[w], pg[i].words[w]);
+            }
+        }
+        memcpy(dst, pg[i].words, sizeof(pg[i].words));
+    }
+    snap_state_apply(vm, &rec->state);
+}
+
+vmtoy* vmtoy_checkpoint_restore(const char* base_path, const char* log_path, unsigned how)
+{
+    vmtoy* vm = vmtoy_snapshot_restore(base_path, how);
+    if (!vm) { return NULL; }
+    int fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        log_replay(fd, apply_to_vm, vm);
+        close(fd);
+    }
+    return vm;
+}
+
+struct compact_ctx {
+    uint16_t* memory;
+    struct snap_header* h;
+};
+
+static void apply_to_image(const struct ckpt_record* rec, void* ctx)
+{
+    struct compact_ctx* cc = ctx;
+    const struct ckpt_page* pg = (const struct ckpt_page*)(rec + 1);
+    for (uint32_t i = 0; i < rec->pages; ++i) {
+        memcpy(cc->memory + ((size_t)pg[i].page << PAGE_SHIFT), pg[i].words, sizeof(pg[i].words));
+    }
+    memcpy(cc->h->regs, rec->state.regs, sizeof(cc->h->regs));
+    cc->h->kbsr = rec->state.kbsr;
+    cc->h->kbdr = rec->state.kbdr;
+    cc->h->out_pos = rec->state.out_pos;
+    cc->h->icount = rec->state.icount;
+}
+
+// Folds the log into a new base and empties the log. The new base goes in under a
+// temporary name first, so a crash leaves either the old base and the whole log, or the
+// new base and a log whose records it already has (replaying those again is harmless:
+// every record is whole pages and whole registers).
+int vmtoy_checkpoint_compact(const char* base_path, const char* log_path)
+{
+    int base = open(base_path, O_RDONLY | O_CLOEXEC);
+    if (base < 0) { return 0; }
+    struct snap_header h;
+    uint8_t* head = calloc(1, SNAP_HEADER_BYTES);
+    uint16_t* memory = malloc(MEMORY_BYTES);
+    int ok = head && memory && snap_header_read(base, &h)
+          && read_all(base, memory, MEMORY_BYTES, h.header_bytes);
+    close(base);
+
+    int log = ok ? open(log_path, O_RDWR | O_CLOEXEC) : -1;
+    if (log >= 0) {
+        struct compact_ctx cc = { memory, &h };
+        log_replay(log, apply_to_image, &cc);
+    }
+
+    char tmp[4096];
+    ok = ok && snprintf(tmp, sizeof(tmp), "%s.tmp", base_path) < (int)sizeof(tmp);
+    if (ok) {
+        h.header_bytes = SNAP_HEADER_BYTES;
+        // The memory has moved on from the hash the base came with (if it had one).
+        h.version = SNAP_VERSION;
+        h.memory_hash = (h.flags & VMTOY_F_STATE_HASH) ? mem_hash_image(memory) : 0;
+        memcpy(head, &h, sizeof(h));
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = fd >= 0
+          && write_all(fd, head, SNAP_HEADER_BYTES, 0)
+          && write_all(fd, memory, MEMORY_BYTES, SNAP_HEADER_BYTES)
+          && fsync(fd) == 0;
+        if (fd >= 0) { close(fd); }
+        ok = ok && rename(tmp, base_path) == 0;
+        if (!ok) { unlink(tmp); }
+    }
+    if (ok && log >= 0) { ok = ftruncate(log, 0) == 0; }
+    if (log >= 0) { close(log); }
+    free(head);
+    free(memory);
+    return ok;
+}
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+// Cloning
+// A clone is always a sparse VM whose pages are the same read-only shared pages dedup
+// makes (see dedup.c). Whichever VM writes to one first gets its own copy through
+// mem_page_for_write().
+//
+// How much a clone costs depends on the original. A sparse original's own pages are
+// turned into shared ones the first time it's cloned, so after that cloning it again
+// (or cloning a clone) costs a context and a reference count per page, and copies
+// nothing. Flat memory has to stay one array, so a flat original keeps its pages, and
+// every clone of it gets a fresh copy of each page that isn't all zeros. That's a
+// whole memory per clone. Clone a flat VM once and clone the clone from then on (the
+// explorer does this with its root).
+
+// A read-only copy of page `p` that `vm` and one more VM can both point at, with a
+// reference taken for that other VM. NULL if the page is all zeros or we're out of memory.
+static struct shared_page* share_page(vmtoy* vm, unsigned p)
+{
+    if (vm->page_kind[p] == PAGE_SHARED) {
+        struct shared_page* sp = (struct shared_page*)
+            ((char*)vm->rd[p] - offsetof(struct shared_page, words));
+        __atomic_add_fetch(&sp->refs, 1, __ATOMIC_RELAXED);
+        return sp;
+    }
+    if (vm->page_kind[p] == PAGE_ZERO || mem_page_is_zero(vm->rd[p])) { return NULL; }
+
+    struct shared_page* sp = malloc(sizeof(*sp));
+    if (!sp) { return NULL; }
+    sp->refs = 1;
+    sp->hash = 0;
+    sp->next = NULL;
+    memcpy(sp->words, vm->rd[p], sizeof(sp->words));
+    // Flat memory stays as it is (see above); a page of its own we can swap for the
+    // shared copy.
+    if (vm->page_kind[p] == PAGE_PRIVATE) {
+        sp->refs++;
+        mem_share_page(vm, p, sp);
+    }
+    return sp;
+}
+
+vmtoy* vmtoy_clone(vmtoy* vm)
+{
+    // Harts share their memory with each other, which a clone couldn't.
+    if (vm->mem_kind == MEM_BORROWED) { return NULL; }
+    if (vm->hib && !vmtoy_wake(vm)) { return NULL; }
+
+    vmtoy* c = vm_new(vm->flags | VMTOY_F_SPARSE_MEMORY, NULL, MEM_HEAP);
+    if (!c) { return NULL; }
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        struct shared_page* sp = share_page(vm, p);
+        if (sp) {
+            c->rd[p] = sp->words;
+            c->page_kind[p] = PAGE_SHARED;
+        } else if (vm->page_kind[p] != PAGE_ZERO && !mem_page_is_zero(vm->rd[p])) {
+            vmtoy_destroy(c);
+            return NULL;
+        }
+    }
+
+    memcpy(c->regs, vm->regs, sizeof(c->regs));
+    c->state_hash = vm->state_hash;
+    c->icount = vm->icount;
+    c->kbsr = vm->kbsr;
+    c->kbdr = vm->kbdr;
+    c->out_pos = vm->out_pos;
+    c->io = vm->io;
+    memcpy(c->traps, vm->traps, sizeof(c->traps));
+    return c;
+}
@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "internal.h"
+
+// Page dedup
+// KSM for VMs. Sessions of the same program end up with lots of identical pages (code,
+// tables, buffers nobody wrote yet), so every now and then we hash the private pages of
+// sparse VMs and point identical ones at a single read-only copy. The next write to a
+// merged page goes down mem_write_slow() like any other read-only page and gets a copy
+// of its own back (see mem_page_for_write()).
+//
+// Like KSM we only merge pages that look settled: a page has to hash the same on two
+// scans in a row before it's worth sharing. Pages that have gone back to all zeros are
+// simply handed back and pointed at the zero page.
+//
+// A scan edits the page tables of the VMs it looks at, so those VMs mustn't be running
+// at the time. The scheduler takes care of that when it does the scanning.
+
+#define DEDUP_MIN_BUCKETS 256
+
+struct vmtoy_dedup {
+    pthread_mutex_t lock;
+    struct shared_page** buckets;
+    size_t nbuckets;  // Always a power of two.
+    size_t count;     // Pages in the table.
+    uint64_t zeroed;  // Pages handed back because they were all zeros.
+    uint64_t merged;  // Private pages swapped for a shared one.
+};
+
+void shared_page_put(uint16_t* words)
+{
+    struct shared_page* sp = (struct shared_page*)((char*)words - offsetof(struct shared_page, words));
+    if (__atomic_sub_fetch(&sp->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(sp);
+    }
+}
+
+vmtoy_dedup* vmtoy_dedup_create(void)
+{
+    vmtoy_dedup* d = calloc(1, sizeof(*d));
+    if (!d) { return NULL; }
+    d->buckets = calloc(DEDUP_MIN_BUCKETS, sizeof(*d->buckets));
+    if (!d->buckets) {
+        free(d);
+        return NULL;
+    }
+    d->nbuckets = DEDUP_MIN_BUCKETS;
+    pthread_mutex_init(&d->lock, NULL);
+    return d;
+}
+
+// Drops the table's references. Pages still in use stay around until their last VM lets go.
+void vmtoy_dedup_destroy(vmtoy_dedup* d)
+{
+    if (!d) { return; }
+    for (size_t b = 0; b < d->nbuckets; ++b) {
+        struct shared_page* sp = d->buckets[b];
+        while (sp) {
+            struct shared_page* next = sp->next;
+            shared_page_put(sp->words);
+            sp = next;
+        }
+    }
+    pthread_mutex_destroy(&d->lock);
+    free(d->buckets);
+    free(d);
+}
+
+static void table_grow(vmtoy_dedup* d)
+{
+    size_t nbuckets = d->nbuckets * 2;
+    struct shared_page** buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets) { return; } // Longer chains, but still correct.
+    for (size_t b = 0; b < d->nbuckets; ++b) {
+        struct shared_page* sp = d->buckets[b];
+        while (sp) {
+            struct shared_page* next = sp->next;
+            size_t nb = sp->hash & (nbuckets - 1);
+            sp->next = buckets[nb];
+            buckets[nb] = sp;
+            sp = next;
+        }
+    }
+    free(d->buckets);
+    d->buckets = buckets;
+    d->nbuckets = nbuckets;
+}
+
+// The shared copy of `words`, made if it's the first time we see them, with a
+// reference taken for the caller. NULL if we're out of memory.
+static struct shared_page* table_get(vmtoy_dedup* d, const uint16_t* words, uint64_t hash)
+{
+    struct shared_page** chain = &d->buckets[hash & (d->nbuckets - 1)];
+    for (struct shared_page* sp = *chain; sp; sp = sp->next) {
+        if (sp->hash == hash && memcmp(sp->words, words, sizeof(sp->words)) == 0) {
+            __atomic_add_fetch(&sp->refs, 1, __ATOMIC_RELAXED);
+            return sp;
+        }
+    }
+
+    struct shared_page* sp = malloc(sizeof(*sp));
+    if (!sp) { return NULL; }
+    sp->refs = 2;
+    sp->hash = hash;
+    memcpy(sp->words, words, sizeof(sp->words));
+    sp->next = *chain;
+    *chain = sp;
+    if (++d->count > d->nbuckets) { table_grow(d); }
+    return sp;
+}
+
+// Pages only the table still holds on to aren't saving anybody anything.
+static void table_prune(vmtoy_dedup* d)
+{
+    for (size_t b = 0; b < d->nbuckets; ++b) {
+        struct shared_page** link = &d->buckets[b];
+        while (*link) {
+            struct shared_page* sp = *link;
+            if (__atomic_load_n(&sp->refs, __ATOMIC_ACQUIRE) == 1) {
+                *link = sp->next;
+                d->count--;
+                free(sp);
+            } else {
+                link = &sp->next;
+            }
+        }
+    }
+}
+
+// One VM's worth of scanning. Returns how many pages it gave up.
+static unsigned scan_vm(vmtoy_dedup* d, vmtoy* vm)
+{
+    unsigned saved = 0;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (vm->page_kind[p] != PAGE_PRIVATE) { continue; }
+        const uint16_t* words = vm->rd[p];
+
+        if (mem_page_is_zero(words)) {
+            mem_zero_page(vm, p);
+            vm->page_hash[p] = 0;
+            d->zeroed++;
+            saved++;
+            continue;
+        }
+
+        uint64_t hash = hash_words(words, PAGE_WORDS, 0);
+        uint32_t seen = (uint32_t)hash | 1;
+        if (vm->page_hash[p] != seen) {
+            // Changed since last time (or new): check back next scan.
+            vm->page_hash[p] = seen;
+            continue;
+        }
+
+        struct shared_page* sp = table_get(d, words, hash);
+        if (!sp) { break; }
+        mem_share_page(vm, p, sp);
+        d->merged++;
+        saved++;
+    }
+    return saved;
+}
+
+// The scheduler's way in: one VM at a time between quanta, pruning once per lap.
+unsigned dedup_scan_vm(vmtoy_dedup* d, vmtoy* vm, int prune)
+{
+    pthread_mutex_lock(&d->lock);
+    unsigned saved = scan_vm(d, vm);
+    if (prune) { table_prune(d); }
+    pthread_mutex_unlock(&d->lock);
+    return saved;
+}
+
+unsigned vmtoy_dedup_scan(vmtoy_dedup* d, vmtoy* const* vms, unsigned count)
+{
+    unsigned saved = 0;
+    pthread_mutex_lock(&d->lock);
+    for (unsigned i = 0; i < count; ++i) {
+        saved += scan_vm(d, vms[i]);
+    }
+    table_prune(d);
+    pthread_mutex_unlock(&d->lock);
+    return saved;
+}
+
+void vmtoy_dedup_get_stats(vmtoy_dedup* d, vmtoy_dedup_stats* stats)
+{
+    uint64_t users = 0;
+    size_t live = 0;
+    pthread_mutex_lock(&d->lock);
+    for (size_t b = 0; b < d->nbuckets; ++b) {
+        for (struct shared_page* sp = d->buckets[b]; sp; sp = sp->next) {
+            uint32_t refs = __atomic_load_n(&sp->refs, __ATOMIC_ACQUIRE);
+            if (refs > 1) {
+                users += refs - 1;
+                live++;
+            }
+        }
+    }
+    stats->shared_pages = live;
+    stats->sharing = users;
+    stats->merged = d->merged;
+    stats->zeroed = d->zeroed;
+    pthread_mutex_unlock(&d->lock);
+
+    // N VMs on one shared page would otherwise hold N pages.
+    stats->bytes_saved = (users - live) * PAGE_WORDS * sizeof(uint16_t);
+}
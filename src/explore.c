@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+// State-space exploration
+// Games make decent search problems: every time the program stops for a key, that's a
+// state, and every key we could press leads to another. vmtoy_explore_run() searches
+// that tree a level at a time:
+//  - every state in the frontier gets cloned once per candidate input (clone.c), and
+//    each clone is fed its one key and run until it wants the next one;
+//  - the new states are looked up by their state hash (memory.c keeps it up to date on
+//    every write), and the ones we've seen before, by any path, are dropped;
+//  - what's left is the next frontier: all of it for BFS, the best `beam_width` of it
+//    by the caller's score for beam search.
+// Frontier states are spread over a pool of worker threads. Clones share their pages
+// with the state they came from, so each state only costs the pages it changed.
+//
+// "Wants the next key" means the program either blocked in GETC, or polled KBSR after
+// its key was used up. A state that takes more than `step_budget` instructions to get
+// there counts as stuck and is dropped, as is one that halts.
+
+#define EXPLORE_DEFAULT_BUDGET 1000000
+
+// One state we found, kept for working out how we got there.
+struct explore_node {
+    uint32_t parent;
+    uint8_t input;
+};
+
+struct explore_state {
+    vmtoy* vm;
+    uint32_t node;
+    int64_t score;
+};
+
+struct vmtoy_explore {
+    vmtoy_explore_options opt;
+    vmtoy_explore_stats stats;
+
+    struct explore_node* nodes;
+    size_t nnodes;
+    size_t nodes_cap;
+
+    // Every state hash seen so far. Open addressing, 0 = empty, grown between levels
+    // so the workers only ever add to it.
+    uint64_t* seen;
+    size_t seen_cap; // Always a power of two.
+
+    struct explore_state* frontier;
+    size_t nfrontier;
+
+    // This level's work: results[i * ninputs + k] is frontier[i] fed inputs[k].
+    struct explore_state* results;
+    size_t next;     // Next frontier index a worker should take.
+};
+
+// The one key a clone gets, handed over through the normal I/O callbacks.
+struct feed {
+    vmtoy* vm;
+    int ch;
+    int used;
+};
+
+static int feed_read(void* ctx)
+{
+    struct feed* f = ctx;
+    if (f->used) { return VMTOY_IO_AGAIN; }
+    f->used = 1;
+    return f->ch;
+}
+
+static int feed_poll(void* ctx)
+{
+    struct feed* f = ctx;
+    // Polling for a key after we've run out is as good as waiting for one.
+    if (f->used) { vmtoy_stop(f->vm); }
+    return !f->used;
+}
+
+static int feed_write(void* ctx, int ch)
+{
+    return 0;
+}
+
+static const vmtoy_io idle_io = { feed_read, feed_poll, feed_write, NULL, NULL };
+
+static uint64_t seen_key(uint64_t hash)
+{
+    return hash ? hash : 1;
+}
+
+// Nonzero if `hash` wasn't there before. Safe to call from several workers at once.
+static int seen_add(vmtoy_explore* e, uint64_t hash)
+{
+    uint64_t key = seen_key(hash);
+    size_t mask = e->seen_cap - 1;
+    for (size_t i = key & mask;; i = (i + 1) & mask) {
+        uint64_t cur = __atomic_load_n(&e->seen[i], __ATOMIC_RELAXED);
+        if (cur == key) { return 0; }
+        if (cur == 0) {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&e->seen[i], &expected, key, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return 1;
+            }
+            if (expected == key) { return 0; }
+        }
+    }
+}
+
+// Makes sure `more` more hashes fit with the table at most half full.
+static int seen_reserve(vmtoy_explore* e, size_t more)
+{
+    size_t want = (size_t)(e->stats.states + more) * 2;
+    if (want <= e->seen_cap) { return 1; }
+    size_t cap = e->seen_cap ? e->seen_cap : 1024;
+    while (cap < want) { cap *= 2; }
+
+    uint64_t* seen = calloc(cap, sizeof(*seen));
+    if (!seen) { return 0; }
+    for (size_t i = 0; i < e->seen_cap; ++i) {
+        uint64_t key = e->seen[i];
+        if (!key) { continue; }
+        size_t j = key & (cap - 1);
+        while (seen[j]) { j = (j + 1) & (cap - 1); }
+        seen[j] = key;
+    }
+    free(e->seen);
+    e->seen = seen;
+    e->seen_cap = cap;
+    return 1;
+}
+
+static int node_add(vmtoy_explore* e, uint32_t parent, uint8_t input)
+{
+    if (e->nnodes == e->nodes_cap) {
+        size_t cap = e->nodes_cap ? e->nodes_cap * 2 : 1024;
+        struct explore_node* nodes = realloc(e->nodes, cap * sizeof(*nodes));
+        if (!nodes) { return 0; }
+        e->nodes = nodes;
+        e->nodes_cap = cap;
+    }
+    e->nodes[e->nnodes].parent = parent;
+    e->nodes[e->nnodes].input = input;
+    e->nnodes++;
+    return 1;
+}
+
+// Feeds `from` one key and runs it to its next input wait. NULL if it never got there.
+static vmtoy* step(vmtoy_explore* e, vmtoy* from, uint8_t input)
+{
+    vmtoy* vm = vmtoy_clone(from);
+    if (!vm) { return NULL; }
+
+    struct feed f = { vm, input, 0 };
+    vmtoy_io io = idle_io;
+    io.ctx = &f;
+    vm->io = io;
+    int exit = vmtoy_run_for(vm, e->opt.step_budget);
+    vm->io = idle_io;
+    // If that was feed_poll() stopping it, the stop has been delivered: don't let it
+    // stop the next run before it starts too.
+    vm->exit = VMTOY_EXIT_BUDGET;
+
+    int waiting = f.used && (exit == VMTOY_EXIT_STOPPED
+                             || (exit == VMTOY_EXIT_BLOCKED && vm->wait == WAIT_INPUT));
+    if (!waiting) {
+        __atomic_add_fetch(exit == VMTOY_EXIT_BUDGET ? &e->stats.stuck : &e->stats.halted, 1,
+                           __ATOMIC_RELAXED);
+        vmtoy_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+static void* worker(void* arg)
+{
+    vmtoy_explore* e = arg;
+    unsigned ninputs = e->opt.input_count;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED);
+        if (i >= e->nfrontier) { break; }
+
+        struct explore_state* from = &e->frontier[i];
+        for (unsigned k = 0; k < ninputs; ++k) {
+            vmtoy* vm = step(e, from->vm, e->opt.inputs[k]);
+            if (!vm) { continue; }
+            if (!seen_add(e, vmtoy_state_hash(vm))) {
+                __atomic_add_fetch(&e->stats.duplicates, 1, __ATOMIC_RELAXED);
+                vmtoy_destroy(vm);
+                continue;
+            }
+            struct explore_state* out = &e->results[i * ninputs + k];
+            out->vm = vm;
+            out->node = from->node;
+            out->score = e->opt.score ? e->opt.score(vm, e->opt.score_ctx) : 0;
+        }
+    }
+    return NULL;
+}
+
+// Best first; ties go to whichever was found first, so results don't depend on threads.
+static int by_score(const void* a, const void* b)
+{
+    const struct explore_state* x = a;
+    const struct explore_state* y = b;
+    if (x->score != y->score) { return x->score > y->score ? -1 : 1; }
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+// Runs one level on the worker pool and makes the results the new frontier. 0 when it
+// found nothing new (or ran out of memory), leaving the frontier as it was.
+static int explore_level(vmtoy_explore* e, pthread_t* threads, unsigned nthreads)
+{
+    unsigned ninputs = e->opt.input_count;
+    size_t nresults = e->nfrontier * ninputs;
+    if (!seen_reserve(e, nresults)) { return 0; }
+    e->results = calloc(nresults, sizeof(*e->results));
+    if (!e->results) { return 0; }
+    e->next = 0;
+
+    unsigned started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, worker, e) == 0) {
+        started++;
+    }
+    if (!started) { worker(e); }
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    e->stats.expanded += e->nfrontier;
+
+    // Gather them up in order and give each a node of its own.
+    size_t count = 0;
+    for (size_t r = 0; r < nresults; ++r) {
+        struct explore_state* s = &e->results[r];
+        if (!s->vm) { continue; }
+        if (!node_add(e, s->node, e->opt.inputs[r % ninputs])) {
+            vmtoy_destroy(s->vm);
+            continue;
+        }
+        s->node = (uint32_t)(e->nnodes - 1);
+        e->results[count++] = *s;
+    }
+    e->stats.states += count;
+
+    // Nothing new at all: that's the end, and the last level stays the result.
+    if (!count) {
+        free(e->results);
+        e->results = NULL;
+        return 0;
+    }
+
+    size_t keep = count;
+    if (e->opt.strategy == VMTOY_EXPLORE_BEAM || e->opt.score) {
+        qsort(e->results, count, sizeof(*e->results), by_score);
+    }
+    if (e->opt.strategy == VMTOY_EXPLORE_BEAM && keep > e->opt.beam_width) {
+        keep = e->opt.beam_width;
+    }
+    for (size_t r = keep; r < count; ++r) {
+        vmtoy_destroy(e->results[r].vm);
+    }
+
+    for (size_t i = 0; i < e->nfrontier; ++i) {
+        vmtoy_destroy(e->frontier[i].vm);
+    }
+    free(e->frontier);
+    e->frontier = e->results;
+    e->nfrontier = keep;
+    e->results = NULL;
+    e->stats.depth++;
+    return 1;
+}
+
+vmtoy_explore* vmtoy_explore_run(vmtoy* root, const vmtoy_explore_options* options)
+{
+    vmtoy_explore* e = calloc(1, sizeof(*e));
+    if (!e) { return NULL; }
+    e->opt = *options;
+    if (!e->opt.step_budget) { e->opt.step_budget = EXPLORE_DEFAULT_BUDGET; }
+    if (!e->opt.beam_width) { e->opt.beam_width = 1; }
+    if (!e->opt.threads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        e->opt.threads = n > 0 ? (unsigned)n : 1;
+    }
+
+    // The root goes in as state 0, keeping its state hash from here on.
+    e->frontier = calloc(1, sizeof(*e->frontier));
+    vmtoy* vm = e->frontier ? vmtoy_clone(root) : NULL;
+    pthread_t* threads = calloc(e->opt.threads, sizeof(*threads));
+    if (!vm || !threads || !node_add(e, 0, 0) || !seen_reserve(e, 1)) {
+        vmtoy_destroy(vm);
+        free(threads);
+        vmtoy_explore_destroy(e);
+        return NULL;
+    }
+    vm->flags |= VMTOY_F_STATE_HASH;
+    mem_rehash(vm);
+    vm->io = idle_io;
+    seen_add(e, vmtoy_state_hash(vm));
+    e->stats.states = 1;
+    e->frontier[0].vm = vm;
+    e->nfrontier = 1;
+
+    for (unsigned d = 0; d < e->opt.depth && e->nfrontier && e->opt.input_count; ++d) {
+        if (e->opt.max_states && e->stats.states >= e->opt.max_states) { break; }
+        if (!explore_level(e, threads, e->opt.threads)) { break; }
+    }
+    free(threads);
+    return e;
+}
+
+void vmtoy_explore_destroy(vmtoy_explore* e)
+{
+    if (!e) { return; }
+    for (size_t i = 0; i < e->nfrontier; ++i) {
+        vmtoy_destroy(e->frontier[i].vm);
+    }
+    free(e->frontier);
+    free(e->nodes);
+    free(e->seen);
+    free(e);
+}
+
+void vmtoy_explore_get_stats(const vmtoy_explore* e, vmtoy_explore_stats* stats)
+{
+    *stats = e->stats;
+}
+
+size_t vmtoy_explore_count(const vmtoy_explore* e)
+{
+    return e->nfrontier;
+}
+
+const vmtoy* vmtoy_explore_state(const vmtoy_explore* e, size_t i)
+{
+    return i < e->nfrontier ? e->frontier[i].vm : NULL;
+}
+
+int64_t vmtoy_explore_score(const vmtoy_explore* e, size_t i)
+{
+    return i < e->nfrontier ? e->frontier[i].score : 0;
+}
+
+size_t vmtoy_explore_path(const vmtoy_explore* e, size_t i, uint8_t* inputs, size_t max)
+{
+    if (i >= e->nfrontier) { return 0; }
+    size_t len = 0;
+    for (uint32_t n = e->frontier[i].node; n != 0; n = e->nodes[n].parent) { len++; }
+    if (len > max) { return len; }
+
+    size_t at = len;
+    for (uint32_t n = e->frontier[i].node; n != 0; n = e->nodes[n].parent) {
+        inputs[--at] = e->nodes[n].input;
+    }
+    return len;
+}
@@ -0,0 +1,41 @@
+#ifndef VMTOY_HASH_H
+#define VMTOY_HASH_H
+
+// A quick 64-bit hash for runs of guest words. Not cryptographic, just well mixed and
+// fast: four words at a time through a multiply, then a final avalanche. Anything that
+// compares contents by hash (page dedup, caches) still has to check for real on a match.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_K1 0x9E3779B97F4A7C15ull
+#define HASH_K2 0xC2B2AE3D27D4EB4Full
+
+static inline uint64_t hash_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= HASH_K2;
+    h ^= h >> 29;
+    h *= HASH_K1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t hash_words(const uint16_t* words, size_t count, uint64_t seed)
+{
+    uint64_t h = seed ^ (count * HASH_K1);
+    size_t body = count & ~(size_t)3;
+    for (size_t i = 0; i < body; i += 4) {
+        uint64_t v;
+        memcpy(&v, words + i, sizeof(v));
+        h = (h ^ (v * HASH_K2)) * HASH_K1;
+        h ^= h >> 31;
+    }
+    for (size_t i = body; i < count; ++i) {
+        h = (h ^ words[i]) * HASH_K1;
+    }
+    return hash_mix(h);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+// Hibernation
+// A session waiting for a key it may not get for hours doesn't need its memory laid
+// out ready to run. vmtoy_hibernate() packs every page with the page codec (pack.c)
+// into one blob and gives the pages back; the VM is left looking like a sparse VM with
+// nothing written yet. The next vmtoy_run_for() (or anything else that writes to it)
+// unpacks it again, which takes a few tens of microseconds for a whole memory.
+//
+// Registers, devices and trap table stay where they are: they're small, and it means
+// everything but memory works the same asleep or awake.
+
+// Only pages with something in them are listed; the rest come back as zeros.
+struct hib_page {
+    uint8_t page;
+    uint16_t size;
+};
+
+struct hib_blob {
+    int wake_flat;   // Come back as a flat VM rather than a sparse one.
+    unsigned count;  // Entries in `pages`...
+    size_t size;     // ...and bytes of packed data after them, in the same order.
+    struct hib_page pages[];
+};
+
+static const uint8_t* hib_data(const struct hib_blob* hib)
+{
+    return (const uint8_t*)&hib->pages[hib->count];
+}
+
+int vmtoy_hibernate(vmtoy* vm)
+{
+    if (vm->hib) { return 1; }
+    // Memory that isn't ours to give back (or that somebody's watching) stays awake.
+    if (vm->mem_kind == MEM_BORROWED || vm->mem_kind == MEM_ARENA || vm->mem_kind == MEM_PUBLISHED
+        || vm->windows) { return 0; }
+
+    uint8_t* scratch = malloc((size_t)PAGE_COUNT * PACK_BOUND);
+    if (!scratch) { return 0; }
+
+    struct hib_page pages[PAGE_COUNT];
+    unsigned count = 0;
+    size_t size = 0;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (vm->page_kind[p] == PAGE_ZERO || mem_page_is_zero(vm->rd[p])) { continue; }
+        size_t n = pack_page(vm->rd[p], scratch + size);
+        pages[count].page = (uint8_t)p;
+        pages[count].size = (uint16_t)n;
+        count++;
+        size += n;
+    }
+
+    struct hib_blob* hib = malloc(sizeof(*hib) + count * sizeof(pages[0]) + size);
+    if (!hib) {
+        free(scratch);
+        return 0;
+    }
+    // Template VMs come back sparse: the pages they share with the template are
+    // gone either way, and sparse only pays for what's there.
+    hib->wake_flat = vm->mem_kind == MEM_HEAP;
+    hib->count = count;
+    hib->size = size;
+    memcpy(hib->pages, pages, count * sizeof(pages[0]));
+    memcpy((uint8_t*)hib_data(hib), scratch, size);
+    free(scratch);
+
+    mem_release(vm);
+    mem_init_sparse(vm);
+    memset(vm->page_hash, 0, sizeof(vm->page_hash));
+    vm->hib = hib;
+    return 1;
+}
+
+int vmtoy_wake(vmtoy* vm)
+{
+    struct hib_blob* hib = vm->hib;
+    if (!hib) { return 1; }
+
+    if (hib->wake_flat) {
+        uint16_t* memory = calloc(VMTOY_MEMORY_WORDS, sizeof(uint16_t));
+        if (!memory) { return 0; }
+        mem_init_flat(vm, memory, MEM_HEAP);
+    }
+    vm->hib = NULL;
+
+    // Unpacking a page writes it, but that isn't the program writing it: the dirty
+    // bits checkpoints and migration go by come back exactly as they were.
+    uint64_t dirty[PAGE_COUNT / 64];
+    memcpy(dirty, vm->dirty, sizeof(dirty));
+
+    const uint8_t* data = hib_data(hib);
+    for (unsigned i = 0; i < hib->count; ++i) {
+        const struct hib_page* e = &hib->pages[i];
+        uint16_t* page = mem_page_for_write(vm, e->page);
+        if (!page || !unpack_page(data, e->size, page)) {
+            // Back to sleep, blob and all, so nothing's lost.
+            mem_release(vm);
+            mem_init_sparse(vm);
+            memcpy(vm->dirty, dirty, sizeof(dirty));
+            vm->hib = hib;
+            return 0;
+        }
+        data += e->size;
+    }
+    memcpy(vm->dirty, dirty, sizeof(dirty));
+    // And nothing is writable yet, so the first store to each page still takes the
+    // slow path and gets noticed, like after mem_protect().
+    memset(vm->wr, 0, sizeof(vm->wr));
+    free(hib);
+    return 1;
+}
+
+int vmtoy_hibernating(const vmtoy* vm)
+{
+    return vm->hib != NULL;
+}
+
+// Reading a sleeping VM without waking it, for the host's read-only peeks.
+// Pages that aren't in the blob (or don't unpack) read as zeros.
+static void hib_page(const struct hib_blob* hib, unsigned p, uint16_t* out)
+{
+    const uint8_t* data = hib_data(hib);
+    for (unsigned i = 0; i < hib->count; ++i) {
+        const struct hib_page* e = &hib->pages[i];
+        if (e->page == p && unpack_page(data, e->size, out)) { return; }
+        data += e->size;
+    }
+    memset(out, 0, PAGE_WORDS * sizeof(uint16_t));
+}
+
+uint16_t hib_peek(const vmtoy* vm, uint16_t address)
+{
+    uint16_t page[PAGE_WORDS];
+    hib_page(vm->hib, address >> PAGE_SHIFT, page);
+    return page[address & PAGE_MASK];
+}
+
+void hib_copy_out(const vmtoy* vm, uint16_t* dst)
+{
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        hib_page(vm->hib, p, dst + (p << PAGE_SHIFT));
+    }
+}
+
+void hib_free(vmtoy* vm)
+{
+    free(vm->hib);
+    vm->hib = NULL;
+}
+
+size_t hib_size(const vmtoy* vm)
+{
+    const struct hib_blob* hib = vm->hib;
+    return hib ? sizeof(*hib) + hib->count * sizeof(hib->pages[0]) + hib->size : 0;
+}
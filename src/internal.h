@@ -0,0 +1,331 @@
+#ifndef VMTOY_INTERNAL_H
+#define VMTOY_INTERNAL_H
+
+// The inside of a vmtoy. Only the library (and the benchmarks) get to see this.
+
+#include <sys/types.h>
+
+#include "vmtoy.h"
+#include "isa.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// Short names for the registers, so the interpreter reads like the LC-3 manual.
+enum {
+    R_R0 = VMTOY_R0,
+    R_R1 = VMTOY_R1,
+    R_R2 = VMTOY_R2,
+    R_R3 = VMTOY_R3,
+    R_R4 = VMTOY_R4,
+    R_R5 = VMTOY_R5,
+    R_R6 = VMTOY_R6,
+    R_R7 = VMTOY_R7,
+    R_PC = VMTOY_PC,
+    R_COND = VMTOY_COND,
+    R_COUNT = VMTOY_REG_COUNT,
+};
+
+// Conditional flags
+// The CPU's mood ring. It tells us the result of the last calculation.
+enum {
+    FL_POS = 1 << 0, // Positive
+    FL_ZRO = 1 << 1, // Zero
+    FL_NEG = 1 << 2, // Negative
+};
+
+// Defining trap codes for performing I/O tasks
+// These are like system calls. "Hey computer, print this" or "Hey computer, gimme a key press".
+enum
+{
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25   /* halt the program */
+};
+
+// Defines memory mapped registers
+// It's like a secret trapdoor in memory that actually talks to hardware.
+// Everything from MMIO_BASE up goes through mmio_read()/mmio_write().
+enum
+{
+    MMIO_BASE = 0xFE00,
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_HARTID = 0xFE10, /* which hart is asking (read only) */
+    MR_NHARTS = 0xFE12, /* how many harts share this memory (read only) */
+    MR_AADDR = 0xFE14,  /* address the atomic registers below work on */
+    MR_ASWAP = 0xFE16,  /* write: swap memory[AADDR] with the value, old value -> ARES */
+    MR_AADD = 0xFE18,   /* write: add the value to memory[AADDR], old value -> ARES */
+    MR_ARES = 0xFE1A,   /* result of the last ASWAP/AADD (read only) */
+    MR_FENCE = 0xFE1C,  /* write: full memory fence */
+    MR_MBSR = 0xFE20,   /* mailbox status: bit 15 = something to receive, bit 14 = room to send */
+    MR_MBRX = 0xFE22,   /* mailbox receive: read takes the next word, waits if there is none */
+    MR_MBTX = 0xFE24    /* mailbox send: write queues a word, waits if the queue is full */
+};
+
+// Where a VM's memory came from.
+enum {
+    MEM_BORROWED = 0, // Somebody else's (harts share one memory). Not ours to free.
+    MEM_HEAP,         // calloc()
+    MEM_MAPPED,       // mmap(), e.g. a private mapping of a template
+    MEM_SPARSE,       // No flat array at all, just pages allocated as they're written
+    MEM_ARENA,        // Right behind the VM context in the same arena object
+    MEM_LAZY,         // Filled in from a snapshot as it's touched (see uffd.c)
+    MEM_PUBLISHED,    // In a shared memory segment for monitors to read (see monitor.c)
+};
+
+// What the arena hands out (see arena.c).
+enum {
+    ARENA_NONE = 0, // Not from the arena: plain malloc().
+    ARENA_VM,       // A VM context on its own.
+    ARENA_VM_FLAT,  // A VM context with its flat memory right after it.
+    ARENA_PAGE,     // One sparse page.
+    ARENA_CLASS_COUNT,
+};
+
+// The page table. See memory.c.
+#define PAGE_SHIFT 8
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_WORDS - 1)
+#define PAGE_COUNT (VMTOY_MEMORY_WORDS >> PAGE_SHIFT)
+
+// What's behind each page.
+enum {
+    PAGE_FLAT = 0, // Part of the VM's flat memory array.
+    PAGE_ZERO,     // The shared page of zeros; allocated on first write.
+    PAGE_PRIVATE,  // A page of its own, allocated on write.
+    PAGE_SHARED,   // A read-only page shared with other VMs by dedup; copied on write.
+    PAGE_WINDOW,   // A host buffer (vmtoy_map_window()); it can change between runs.
+    PAGE_WINDOW_RO, // The same, but the guest's stores go nowhere.
+};
+
+// Nothing worked out from what's in a window (decoded code, say) can be kept from one
+// run to the next, because the host may have rewritten it in between.
+static inline int page_is_window(int kind)
+{
+    return kind == PAGE_WINDOW || kind == PAGE_WINDOW_RO;
+}
+
+// A page dedup found in more than one place. rd[] points at `words`.
+struct shared_page {
+    uint32_t refs;            // Every VM using it, plus one for the dedup table.
+    uint64_t hash;
+    struct shared_page* next; // Hash chain in the dedup table.
+    uint16_t words[PAGE_WORDS];
+};
+
+// The size of a whole guest memory in bytes.
+#define MEMORY_BYTES ((size_t)VMTOY_MEMORY_WORDS * sizeof(uint16_t))
+
+// What a VM that came back with VMTOY_EXIT_BLOCKED is waiting for, so a scheduler
+// knows when it's worth running it again.
+enum {
+    WAIT_NONE = 0,
+    WAIT_MBOX_RX,  // something to arrive in its receive mailbox
+    WAIT_MBOX_TX,  // room in its send mailbox
+    WAIT_INPUT,    // a key
+    WAIT_OUTPUT,   // the console to take more output
+};
+
+struct trap_slot {
+    vmtoy_trap_fn fn;
+    void* ctx;
+    const char* name;
+    uint64_t count;   // How many times the guest called this vector.
+};
+
+struct vmtoy {
+    uint16_t regs[R_COUNT];
+    // Guest memory, as the interpreter sees it: rd[] is always readable, wr[] is NULL
+    // wherever a write needs to go through mem_write_slow().
+    uint16_t* rd[PAGE_COUNT];
+    uint16_t* wr[PAGE_COUNT];
+    uint8_t page_kind[PAGE_COUNT];
+    uint32_t page_hash[PAGE_COUNT]; // What dedup saw in each page last time, 0 = nothing yet.
+    uint64_t dirty[PAGE_COUNT / 64]; // Pages made writable since the last mem_protect().
+    uint64_t state_hash;     // Zobrist hash of memory, kept up to date with VMTOY_F_STATE_HASH.
+    unsigned windows;        // Pages mapped to host buffers.
+
+    struct hib_blob* hib;    // Packed memory while hibernating (see hibernate.c).
+    struct uffd_range* lazy; // The demand pager behind MEM_LAZY memory.
+    struct vm_monitor* mon;  // The segment behind MEM_PUBLISHED memory.
+    struct vm_trace* trace;  // The trap trace ring, NULL when not tracing.
+    struct vm_code* code;    // Decoded code with VMTOY_F_PREDECODE, NULL otherwise.
+    uint16_t* memory;        // The flat array behind the page table, NULL if sparse.
+    int mem_kind;            // Where memory came from, so we know how to give it back.
+    int arena_cls;           // Where the vmtoy itself came from (ARENA_*).
+    int exit;                // Nonzero makes the run loop leave after this instruction.
+    unsigned flags;
+    uint64_t icount;
+
+    // Keyboard device. These live here rather than in memory[] so every VM
+    // gets its own keyboard no matter whose memory it is running on.
+    uint16_t kbsr;
+    uint16_t kbdr;
+
+    // Multiprocessor registers. A VM on its own is hart 0 of 1.
+    uint16_t hart_id;
+    uint16_t nharts;
+    uint16_t amo_addr;
+    uint16_t amo_result;
+
+    // Mailboxes (either can be NULL) and what we're blocked on, if anything.
+    struct vmtoy_mbox* mbox_rx;
+    struct vmtoy_mbox* mbox_tx;
+    int wait;
+
+    // How many vmtoy_call()s we are inside of.
+    unsigned call_depth;
+
+    // How far PUTS/PUTSP got before the output side said VMTOY_IO_AGAIN.
+    uint16_t out_pos;
+
+    vmtoy_io io;
+    struct trap_slot traps[256];
+};
+
+uint16_t mmio_read(vmtoy* vm, uint16_t address);
+void mmio_write(vmtoy* vm, uint16_t address, uint16_t val);
+
+void mem_init_flat(vmtoy* vm, uint16_t* memory, int mem_kind);
+void mem_init_sparse(vmtoy* vm);
+void mem_release(vmtoy* vm);
+uint16_t* mem_page_for_write(vmtoy* vm, unsigned page);
+void mem_write_slow(vmtoy* vm, uint16_t address, uint16_t val);
+int mem_poke(vmtoy* vm, uint16_t address, uint16_t val);
+void mem_copy_out(const vmtoy* vm, uint16_t* dst);
+void mem_protect(vmtoy* vm, unsigned page);
+void mem_hash_write(vmtoy* vm, uint16_t address, uint16_t old, uint16_t val);
+uint64_t mem_hash_full(const vmtoy* vm);
+uint64_t mem_hash_image(const uint16_t* memory);
+void mem_rehash(vmtoy* vm);
+
+static inline int mem_dirty(const vmtoy* vm, unsigned page)
+{
+    return (int)(vm->dirty[page / 64] >> (page % 64)) & 1;
+}
+void mem_zero_page(vmtoy* vm, unsigned page);
+void mem_share_page(vmtoy* vm, unsigned page, struct shared_page* shared);
+int mem_page_is_zero(const uint16_t* words);
+void shared_page_put(uint16_t* words);
+unsigned dedup_scan_vm(vmtoy_dedup* d, vmtoy* vm, int prune);
+
+// The page codec. A packed page never takes more than PACK_BOUND bytes.
+#define PACK_BOUND (3 * PAGE_WORDS)
+size_t pack_page(const uint16_t* in, uint8_t* out);
+int unpack_page(const uint8_t* in, size_t size, uint16_t* out);
+
+int read_all(int fd, void* buf, size_t size, off_t offset);
+struct uffd_range* uffd_map(int fd, off_t offset);
+uint16_t* uffd_memory(struct uffd_range* r);
+void uffd_unmap(struct uffd_range* r);
+size_t uffd_loaded_bytes(const struct uffd_range* r);
+
+int cache_lookup(vmtoy_cache* c, const uint64_t key[2], vmtoy_job_result* out);
+void cache_store(vmtoy_cache* c, const uint64_t key[2], const vmtoy_job_result* r);
+
+int trace_trap(vmtoy* vm, struct trap_slot* slot, uint16_t instr, uint64_t icount);
+
+// Running TRAP `instr`, the icount'th instruction: whatever the handler returns.
+static inline int do_trap(vmtoy* vm, uint16_t instr, uint64_t icount)
+{
+    // One table lookup and one indirect call, whatever the vector.
+    // Unknown vectors land on trap_unknown, so there's no branch for them; the only one
+    // is for tracing, and that's never taken unless somebody asked for it.
+    struct trap_slot* t = &vm->traps[isa_trapvect8(instr)];
+    t->count++;
+    if (unlikely(vm->trace != NULL)) { return trace_trap(vm, t, instr, icount); }
+    return t->fn(vm, (uint8_t)instr, t->ctx);
+}
+
+// The engines. Both run up to `instructions` instructions, the first of them being
+// instruction number `icount`, and return how many they got through; vmtoy_run_for()
+// does the bookkeeping either side. See vmtoy.c and predecode.c.
+uint64_t interp_run(vmtoy* vm, uint64_t instructions, uint64_t icount);
+uint64_t code_run(vmtoy* vm, uint64_t instructions, uint64_t icount);
+
+// The predecoder's side of the page table. Every function here wants vm->code set.
+struct vm_code* code_new(void);
+void code_free(vmtoy* vm);
+int code_holds(const vmtoy* vm, unsigned page);
+void code_write(vmtoy* vm, uint16_t address, uint16_t val);
+void code_forget(vmtoy* vm, unsigned page);
+void code_forget_all(vmtoy* vm);
+void code_loaded(vmtoy* vm, uint16_t origin);
+void monitor_update(vmtoy* vm);
+void monitor_release(vmtoy* vm);
+
+uint16_t hib_peek(const vmtoy* vm, uint16_t address);
+void hib_copy_out(const vmtoy* vm, uint16_t* dst);
+void hib_free(vmtoy* vm);
+size_t hib_size(const vmtoy* vm);
+
+// The host's view of memory: no devices, nothing allocated.
+static inline uint16_t mem_peek(const vmtoy* vm, uint16_t address)
+{
+    return vm->rd[address >> PAGE_SHIFT][address & PAGE_MASK];
+}
+
+// The mailbox registers. They set vm->exit to VMTOY_EXIT_BLOCKED when the guest has to wait.
+uint16_t mbox_status(vmtoy* vm);
+uint16_t mbox_receive(vmtoy* vm);
+void mbox_send(vmtoy* vm, uint16_t val);
+// Nonzero when whatever a blocked VM is waiting for has happened.
+int vm_ready(vmtoy* vm);
+
+// Reading from memory.
+// Usually simple, but if you touch the device page, magic happens.
+// Harts share memory (see smp.c), so guest loads and stores are relaxed atomics:
+// no data race as far as C is concerned, and still a plain move on the machine.
+static inline uint16_t mem_read(vmtoy* vm, uint16_t address)
+{
+    if (unlikely(address >= MMIO_BASE)) {
+        return mmio_read(vm, address);
+    }
+    return __atomic_load_n(&vm->rd[address >> PAGE_SHIFT][address & PAGE_MASK], __ATOMIC_RELAXED);
+}
+
+// Writing is one table lookup too, unless the page wants to know about it
+// (device page, untouched sparse page...).
+static inline void mem_write(vmtoy* vm, uint16_t address, uint16_t val)
+{
+    uint16_t* page = vm->wr[address >> PAGE_SHIFT];
+    if (likely(page != NULL)) {
+        __atomic_store_n(&page[address & PAGE_MASK], val, __ATOMIC_RELAXED);
+        return;
+    }
+    mem_write_slow(vm, address, val);
+}
+
+// Updating the conditional flag (R_COND) based on the latest result.
+// Did we get a zero? A positive? A negative? The CPU needs to know.
+static inline void update_flags(vmtoy* vm, uint16_t r)
+{
+    uint16_t v = vm->regs[r];
+    if (v == 0) {
+        vm->regs[R_COND] = FL_ZRO;
+    } else if (v >> 15) {
+        vm->regs[R_COND] = FL_NEG;
+    } else {
+        vm->regs[R_COND] = FL_POS;
+    }
+}
+
+// LC-3 is big-endian, but most modern computers are little-endian.
+// We need to swap bytes so everyone understands each other.
+static inline uint16_t swap_16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+void* arena_alloc(int cls);
+void arena_free(int cls, void* obj);
+uint16_t* arena_vm_memory(vmtoy* vm);
+
+vmtoy* vm_new(unsigned flags, uint16_t* memory, int mem_kind);
+void trap_init(vmtoy* vm);
+
+#endif
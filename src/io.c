@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "internal.h"
+
+// The default I/O: the keyboard is stdin and the console is stdout.
+
+static int stdio_read(void* ctx)
+{
+    int ch = getchar();
+    return ch == EOF ? VMTOY_IO_EOF : ch;
+}
+
+// Checking if a key was pressed without blocking.
+// "Hey, anybody there? No? Okay moving on."
+static int stdio_poll(void* ctx)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+}
+
+static int stdio_write(void* ctx, int ch)
+{
+    putc(ch, stdout);
+    return 0;
+}
+
+static void stdio_flush(void* ctx)
+{
+    fflush(stdout);
+}
+
+void io_stdio_init(vmtoy_io* io)
+{
+    io->read = stdio_read;
+    io->poll = stdio_poll;
+    io->write = stdio_write;
+    io->flush = stdio_flush;
+    io->ctx = NULL;
+}
+
+void vmtoy_set_io(vmtoy* vm, const vmtoy_io* io)
+{
+    if (io) {
+        vm->io = *io;
+    } else {
+        io_stdio_init(&vm->io);
+    }
+}
+
+int vmtoy_putc(vmtoy* vm, int ch)
+{
+    return vm->io.write(vm->io.ctx, ch & 0xFF);
+}
@@ -0,0 +1,188 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+// Disassembling and assembling
+// Both work off the tables isa.def makes, so there's nothing in here about where any
+// particular bit goes: only about how the kinds of field are written.
+
+const struct isa_field_info isa_fields[ISA_FIELD_COUNT] = {
+    [ISA_F_none] = { "none", 0, 0, ISA_NONE },
+#define ISA_FIELD(name, shift, bits, kind) [ISA_F_##name] = { #name, shift, bits, kind },
+#include "isa.def"
+};
+
+const struct isa_form_info isa_forms[ISA_FORM_COUNT] = {
+#define ISA_FORM(name, opcode, mask, bits, mnemonic, a, b, c, example, text) \
+    [FORM_##name] = { #name, mnemonic, OP_##opcode, mask, bits, \
+                      { ISA_F_##a, ISA_F_##b, ISA_F_##c }, example, text },
+#include "isa.def"
+};
+
+static uint16_t field_get(enum isa_field f, uint16_t instr)
+{
+    const struct isa_field_info* fi = &isa_fields[f];
+    uint16_t x = (uint16_t)((instr >> fi->shift) & ((1u << fi->bits) - 1));
+    if (fi->kind == ISA_SIGNED && (x >> (fi->bits - 1) & 1)) {
+        x |= (uint16_t)(0xFFFFu << fi->bits);
+    }
+    return x;
+}
+
+static uint16_t field_put(enum isa_field f, uint16_t value)
+{
+    const struct isa_field_info* fi = &isa_fields[f];
+    return (uint16_t)((value & ((1u << fi->bits) - 1)) << fi->shift);
+}
+
+// The word a form and its operands make. .FILL is the one form whose operand is
+// the whole word.
+static uint16_t encode(const struct isa_form_info* form, const uint16_t* values)
+{
+    uint16_t instr = form->bits;
+    for (unsigned i = 0; i < 3 && form->operands[i] != ISA_F_none; ++i) {
+        if (isa_fields[form->operands[i]].kind == ISA_WORD) { return values[i]; }
+        instr |= field_put(form->operands[i], values[i]);
+    }
+    return instr;
+}
+
+int vmtoy_disassemble(uint16_t instr, char* buf, size_t size)
+{
+    const struct isa_form_info* form = &isa_forms[isa_form_of(instr)];
+    uint16_t values[3] = { 0, 0, 0 };
+    for (unsigned i = 0; i < 3; ++i) {
+        values[i] = field_get(form->operands[i], instr);
+    }
+    // Bits the form doesn't use, set anyway: the program never said this, so don't
+    // put words in its mouth.
+    if (encode(form, values) != instr) {
+        return snprintf(buf, size, ".FILL x%04X", instr);
+    }
+
+    char text[64];
+    int len = snprintf(text, sizeof(text), "%s", form->mnemonic);
+    for (unsigned i = 0, written = 0; i < 3 && form->operands[i] != ISA_F_none; ++i) {
+        const struct isa_field_info* fi = &isa_fields[form->operands[i]];
+        const char* sep = fi->kind == ISA_COND ? "" : written++ ? ", " : " ";
+        switch (fi->kind) {
+            case ISA_REG:
+                len += snprintf(text + len, sizeof(text) - len, "%sR%u", sep, values[i]);
+                break;
+            case ISA_SIGNED:
+                len += snprintf(text + len, sizeof(text) - len, "%s#%d", sep, (int16_t)values[i]);
+                break;
+            case ISA_UNSIGNED:
+                len += snprintf(text + len, sizeof(text) - len, "%sx%02X", sep, values[i]);
+                break;
+            case ISA_WORD:
+                len += snprintf(text + len, sizeof(text) - len, "%sx%04X", sep, values[i]);
+                break;
+            case ISA_COND:
+                len += snprintf(text + len, sizeof(text) - len, "%s%s%s", values[i] & 4 ? "n" : "",
+                                values[i] & 2 ? "z" : "", values[i] & 1 ? "p" : "");
+                break;
+        }
+    }
+    return snprintf(buf, size, "%s", text);
+}
+
+// The assembler's side. Mnemonics and register names can be any case, operands are
+// separated by commas or spaces, and a ; starts a comment.
+
+static const char* skip_space(const char* s)
+{
+    while (isspace((unsigned char)*s) || *s == ',') { ++s; }
+    return s;
+}
+
+// Rn, #decimal or xhex, depending on what the field wants.
+static const char* parse_operand(const char* s, const struct isa_field_info* fi, uint16_t* out)
+{
+    long v;
+    char* end;
+    if (fi->kind == ISA_REG) {
+        if ((*s != 'R' && *s != 'r') || s[1] < '0' || s[1] > '7') { return NULL; }
+        *out = (uint16_t)(s[1] - '0');
+        return s + 2;
+    }
+    if (*s == '#') {
+        v = strtol(s + 1, &end, 10);
+    } else if (*s == 'x' || *s == 'X') {
+        v = strtol(s + 1, &end, 16);
+    } else {
+        return NULL;
+    }
+    if (end == s + 1) { return NULL; }
+
+    // Signed fields take what fits signed; everything else takes what fits unsigned,
+    // so .FILL x8000 and .FILL #-1 both work.
+    long lo = fi->kind == ISA_SIGNED ? -(1L << (fi->bits - 1)) : 0;
+    long hi = fi->kind == ISA_SIGNED ? (1L << (fi->bits - 1)) - 1 : (1L << fi->bits) - 1;
+    if (fi->kind == ISA_WORD) { lo = -(1L << 15); }
+    if (v < lo || v > hi) { return NULL; }
+    *out = (uint16_t)v;
+    return end;
+}
+
+// BR, BRn, BRzp...: which flags, or -1 if it isn't a BR at all. Plain BR is BRnzp.
+static int parse_nzp(const char* s, size_t len)
+{
+    if (len < 2 || toupper((unsigned char)s[0]) != 'B' || toupper((unsigned char)s[1]) != 'R') {
+        return -1;
+    }
+    if (len == 2) { return 7; }
+    int nzp = 0;
+    int last = 8;
+    for (size_t i = 2; i < len; ++i) {
+        char c = (char)tolower((unsigned char)s[i]);
+        int bit = c == 'n' ? 4 : c == 'z' ? 2 : c == 'p' ? 1 : 0;
+        // In order, once each.
+        if (!bit || bit >= last) { return -1; }
+        nzp |= bit;
+        last = bit;
+    }
+    return nzp;
+}
+
+static int mnemonic_is(const char* s, size_t len, const char* mnemonic)
+{
+    if (strlen(mnemonic) != len) { return 0; }
+    for (size_t i = 0; i < len; ++i) {
+        if (toupper((unsigned char)s[i]) != toupper((unsigned char)mnemonic[i])) { return 0; }
+    }
+    return 1;
+}
+
+int vmtoy_assemble(const char* text, uint16_t* out)
+{
+    const char* s = skip_space(text);
+    size_t len = 0;
+    while (s[len] && !isspace((unsigned char)s[len]) && s[len] != ';') { ++len; }
+    int nzp = parse_nzp(s, len);
+
+    // The first form with this mnemonic whose operands parse. ADD R0, R0, R1 and
+    // ADD R0, R0, #1 are different forms, told apart by their last operand.
+    for (unsigned f = 0; f < ISA_FORM_COUNT; ++f) {
+        const struct isa_form_info* form = &isa_forms[f];
+        int is_br = form->operands[0] == ISA_F_nzp;
+        if (is_br ? nzp < 0 : !mnemonic_is(s, len, form->mnemonic)) { continue; }
+
+        uint16_t values[3] = { 0, 0, 0 };
+        const char* p = s + len;
+        unsigned i = 0;
+        if (is_br) { values[i++] = (uint16_t)nzp; }
+        for (; i < 3 && form->operands[i] != ISA_F_none && p; ++i) {
+            p = parse_operand(skip_space(p), &isa_fields[form->operands[i]], &values[i]);
+        }
+        if (!p) { continue; }
+        p = skip_space(p);
+        if (*p && *p != ';') { continue; }
+        *out = encode(form, values);
+        return 1;
+    }
+    return 0;
+}
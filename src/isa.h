@@ -0,0 +1,90 @@
+#ifndef VMTOY_ISA_H
+#define VMTOY_ISA_H
+
+// The instruction set, as far as the engines are concerned. All of it comes out of
+// isa.def; nothing in here knows a bit position of its own.
+
+#include <stdint.h>
+
+// Define OPCodes
+// These are the commands the CPU understands. It's a small vocabulary, but it gets the job done.
+enum {
+#define ISA_OPCODE(name, value, what) OP_##name = value,
+#include "isa.def"
+};
+
+// How a field is written in assembly; see isa.def.
+enum isa_kind {
+    ISA_NONE,
+    ISA_REG,
+    ISA_SIGNED,
+    ISA_UNSIGNED,
+    ISA_COND,
+    ISA_WORD,
+    ISA_FLAG,
+};
+
+enum isa_field {
+    ISA_F_none,
+#define ISA_FIELD(name, shift, bits, kind) ISA_F_##name,
+#include "isa.def"
+    ISA_FIELD_COUNT
+};
+
+// isa_dr(instr), isa_imm5(instr) and friends, and isa_put_dr(value) and friends to go
+// the other way. Signed fields come out sign extended, ready to add to a register.
+#define ISA_FIELD(name, shift, bits, kind) \
+    static inline uint16_t isa_##name(uint16_t instr) \
+    { \
+        uint16_t x = (uint16_t)((instr >> (shift)) & ((1u << (bits)) - 1)); \
+        if ((kind) == ISA_SIGNED && (x >> ((bits) - 1) & 1)) { \
+            x |= (uint16_t)(0xFFFFu << (bits)); \
+        } \
+        return x; \
+    } \
+    static inline uint16_t isa_put_##name(uint16_t value) \
+    { \
+        return (uint16_t)((value & ((1u << (bits)) - 1)) << (shift)); \
+    }
+#include "isa.def"
+
+// The forms: one per way of writing an instruction, in isa.def's order.
+enum isa_form {
+#define ISA_FORM(name, opcode, mask, bits, mnemonic, a, b, c, example, text) FORM_##name,
+#include "isa.def"
+    ISA_FORM_COUNT
+};
+
+struct isa_field_info {
+    const char* name;
+    uint8_t shift;
+    uint8_t bits;
+    uint8_t kind;        // enum isa_kind
+};
+
+struct isa_form_info {
+    const char* name;
+    const char* mnemonic;
+    uint8_t opcode;
+    uint16_t mask;
+    uint16_t bits;
+    uint8_t operands[3]; // enum isa_field, ISA_F_none past the last one
+    uint16_t example;
+    const char* text;
+};
+
+extern const struct isa_field_info isa_fields[ISA_FIELD_COUNT];
+extern const struct isa_form_info isa_forms[ISA_FORM_COUNT];
+
+// Which form an instruction word is. Every word is one of them. This is a chain of
+// compares, not a table: an engine that decodes ahead of time calls it once per word,
+// and the switch interpreter doesn't call it at all.
+static inline enum isa_form isa_form_of(uint16_t instr)
+{
+#define ISA_FORM(name, opcode, mask, bits, mnemonic, a, b, c, example, text) \
+    if ((instr & (mask)) == ((bits) & (mask))) { return FORM_##name; }
+#include "isa.def"
+    return FORM_RES;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "internal.h"
+
+// Batch jobs
+// A job is everything that decides how a headless run turns out: the images, all of the
+// input up front, and the options that change what the program sees. Nothing else
+// gets in (no terminal, no clock), so the same job always gives the same output, exit
+// reason and instruction count. That's what makes it safe to look the result up in a
+// cache (cache.c) instead of running it again.
+
+struct job_io {
+    const uint8_t* input;
+    size_t input_size;
+    size_t pos;
+    uint8_t* output;
+    size_t output_size;
+    size_t output_cap;
+    int failed;      // Ran out of memory for the output.
+};
+
+static int job_read(void* ctx)
+{
+    struct job_io* j = ctx;
+    return j->pos < j->input_size ? j->input[j->pos++] : VMTOY_IO_EOF;
+}
+
+// Reading never has to wait: it's either the next byte or the end.
+static int job_poll(void* ctx)
+{
+    return 1;
+}
+
+static int job_write(void* ctx, int ch)
+{
+    struct job_io* j = ctx;
+    if (j->output_size == j->output_cap) {
+        size_t cap = j->output_cap ? j->output_cap * 2 : 4096;
+        uint8_t* out = realloc(j->output, cap);
+        if (!out) {
+            j->failed = 1;
+            return 0;
+        }
+        j->output = out;
+        j->output_cap = cap;
+    }
+    j->output[j->output_size++] = (uint8_t)ch;
+    return 0;
+}
+
+// Only strict traps changes what a program does; the memory flags just change how.
+static unsigned job_flags(const vmtoy_job* job)
+{
+    return job->flags & VMTOY_F_STRICT_TRAPS;
+}
+
+// Two 64-bit hashes of everything in the job, lengths included so that moving bytes
+// from one image to the next makes a different key.
+static int job_key(const vmtoy_job* job, uint64_t key[2])
+{
+    size_t size = 4 * sizeof(uint64_t) + job->input_size;
+    for (unsigned i = 0; i < job->image_count; ++i) {
+        size += sizeof(uint64_t) + job->image_sizes[i];
+    }
+    // Rounded up to whole words, with a zero to spare.
+    uint8_t* buf = calloc(1, size + 1);
+    if (!buf) { return 0; }
+
+    uint8_t* p = buf;
+    uint64_t head[4] = { VMTOY_VERSION_MAJOR << 16 | VMTOY_VERSION_MINOR, job_flags(job),
+                         job->max_instructions, job->image_count };
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    for (unsigned i = 0; i < job->image_count; ++i) {
+        uint64_t n = job->image_sizes[i];
+        memcpy(p, &n, sizeof(n));
+        p += sizeof(n);
+        if (job->image_sizes[i]) { memcpy(p, job->images[i], job->image_sizes[i]); }
+        p += job->image_sizes[i];
+    }
+    // A job with no input may well have no input pointer either.
+    if (job->input_size) { memcpy(p, job->input, job->input_size); }
+
+    size_t words = (size + 1) / 2;
+    key[0] = hash_words((const uint16_t*)buf, words, 0x4A4F4231);
+    key[1] = hash_words((const uint16_t*)buf, words, 0x4A4F4232 ^ HASH_K2);
+    free(buf);
+    return 1;
+}
+
+static int job_execute(const vmtoy_job* job, vmtoy_job_result* out)
+{
+    vmtoy* vm = vmtoy_create(job->flags);
+    if (!vm) { return 0; }
+    for (unsigned i = 0; i < job->image_count; ++i) {
+        if (!vmtoy_load_image(vm, job->images[i], job->image_sizes[i])) {
+            vmtoy_destroy(vm);
+            return 0;
+        }
+    }
+
+    struct job_io j = { job->input, job->input_size, 0, NULL, 0, 0, 0 };
+    vmtoy_io io = { job_read, job_poll, job_write, NULL, &j };
+    vmtoy_set_io(vm, &io);
+
+    // The run only stops early if it's told to, so the instruction count is the budget.
+    uint64_t budget = job->max_instructions ? job->max_instructions : UINT64_MAX;
+    int exit = vmtoy_run_for(vm, budget);
+    out->exit = exit;
+    out->icount = vmtoy_icount(vm);
+    out->output = j.output;
+    out->output_size = j.output_size;
+    out->cached = 0;
+    vmtoy_destroy(vm);
+    if (j.failed) {
+        vmtoy_job_result_free(out);
+        return 0;
+    }
+    return 1;
+}
+
+int vmtoy_job_run(const vmtoy_job* job, vmtoy_cache* cache, vmtoy_job_result* out)
+{
+    memset(out, 0, sizeof(*out));
+    uint64_t key[2];
+    // Without a key there's nothing to look up, but the job can still run.
+    if (cache && !job_key(job, key)) { cache = NULL; }
+    if (cache && cache_lookup(cache, key, out)) {
+        out->cached = 1;
+        return 1;
+    }
+    if (!job_execute(job, out)) { return 0; }
+    // Running out of memory is the host's problem, not the job's: try again next time.
+    if (cache && out->exit != VMTOY_EXIT_NO_MEMORY) { cache_store(cache, key, out); }
+    return 1;
+}
+
+void vmtoy_job_result_free(vmtoy_job_result* r)
+{
+    free(r->output);
+    r->output = NULL;
+    r->output_size = 0;
+}
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+
+#include "internal.h"
+#include "ring.h"
+
+// Mailboxes
+// A mailbox is one lock-free queue of words going one way. Give a VM one to receive
+// on and one to send on, chain them up, and you've got a pipeline of LC-3 programs.
+// A guest that reads an empty mailbox (or writes a full one) doesn't spin: its
+// vmtoy_run_for() comes back VMTOY_EXIT_BLOCKED and the instruction is retried
+// once the scheduler sees the mailbox is ready.
+
+struct vmtoy_mbox {
+    struct ring ring;
+};
+
+vmtoy_mbox* vmtoy_mbox_create(unsigned capacity)
+{
+    if (capacity == 0) { capacity = 1; }
+    size_t size = ring_size(capacity);
+    // Round up so aligned_alloc is happy.
+    size = (size + RING_CACHELINE - 1) & ~(size_t)(RING_CACHELINE - 1);
+    vmtoy_mbox* mb = aligned_alloc(RING_CACHELINE, size);
+    if (!mb) { return NULL; }
+    ring_init(&mb->ring, capacity);
+    return mb;
+}
+
+void vmtoy_mbox_destroy(vmtoy_mbox* mb)
+{
+    free(mb);
+}
+
+void vmtoy_mbox_connect(vmtoy* vm, vmtoy_mbox* rx, vmtoy_mbox* tx)
+{
+    vm->mbox_rx = rx;
+    vm->mbox_tx = tx;
+}
+
+int vmtoy_mbox_send(vmtoy_mbox* mb, uint16_t word)
+{
+    return ring_push(&mb->ring, word);
+}
+
+int vmtoy_mbox_receive(vmtoy_mbox* mb, uint16_t* word)
+{
+    return ring_pop(&mb->ring, word);
+}
+
+unsigned vmtoy_mbox_count(const vmtoy_mbox* mb)
+{
+    return ring_count(&mb->ring);
+}
+
+uint16_t mbox_status(vmtoy* vm)
+{
+    uint16_t status = 0;
+    if (vm->mbox_rx && ring_count(&vm->mbox_rx->ring)) { status |= 1 << 15; }
+    if (vm->mbox_tx && ring_space(&vm->mbox_tx->ring)) { status |= 1 << 14; }
+    return status;
+}
+
+uint16_t mbox_receive(vmtoy* vm)
+{
+    uint16_t w;
+    if (vm->mbox_rx && ring_pop(&vm->mbox_rx->ring, &w)) {
+        return w;
+    }
+    vm->wait = WAIT_MBOX_RX;
+    vm->exit = VMTOY_EXIT_BLOCKED;
+    return 0;
+}
+
+void mbox_send(vmtoy* vm, uint16_t val)
+{
+    if (vm->mbox_tx && ring_push(&vm->mbox_tx->ring, val)) {
+        return;
+    }
+    vm->wait = WAIT_MBOX_TX;
+    vm->exit = VMTOY_EXIT_BLOCKED;
+}
+
+int vm_ready(vmtoy* vm)
+{
+    switch (vm->wait) {
+        case WAIT_MBOX_RX:
+            return vm->mbox_rx && ring_count(&vm->mbox_rx->ring) != 0;
+        case WAIT_MBOX_TX:
+            return vm->mbox_tx && ring_space(&vm->mbox_tx->ring) != 0;
+        case WAIT_INPUT:
+            return vm->io.poll(vm->io.ctx);
+    }
+    // Nothing to check (or nothing we know how to check): just try again.
+    return 1;
+}
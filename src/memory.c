@@ -0,0 +1,372 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hash.h"
+#include "internal.h"
+
+// Guest memory
+// Every VM looks at its memory through a page table: 256 pages of 256 words. `rd[p]`
+// always points at something readable and `wr[p]` either points at the same words or
+// is NULL, which sends the write down mem_write_slow(). That's the one hook every
+// memory trick hangs off (sparse pages, copy-on-write, dirty tracking, state hashing)
+// without the interpreter having to know.
+//
+// Two backends fill the table in:
+//  - flat: one contiguous 64K-word array, every entry points straight into it.
+//  - sparse: nothing allocated up front. Reads of untouched pages hit one shared page
+//    of zeros, and the first write to a page allocates it. A program that touches
+//    4 KB costs about 4 KB. Dedup (dedup.c) can later swap private pages for shared
+//    read-only ones, which get copied back on the next write.
+//
+// Either kind can have host buffers mapped over some of its pages (windows): the table
+// just points at the host's words, so the guest reads and writes them in place.
+//
+// With VMTOY_F_PREDECODE, pages holding decoded code (predecode.c) stay on the slow
+// path too, so a store to one can decode the word again. Anything that hands out a
+// page to be filled in wholesale (mem_page_for_write(), dedup, windows, a new page
+// table) throws the page's decoded code away instead.
+
+// One page of zeros for every sparse VM's untouched pages. It's const, so if anybody
+// ever writes through it by mistake they find out right away.
+static const uint16_t zero_page[PAGE_WORDS];
+
+// Sparse pages come from the arena if the VM does.
+static uint16_t* page_alloc(vmtoy* vm)
+{
+    if (vm->flags & VMTOY_F_ARENA) { return arena_alloc(ARENA_PAGE); }
+    return calloc(PAGE_WORDS, sizeof(uint16_t));
+}
+
+static void page_free(vmtoy* vm, uint16_t* page)
+{
+    if (vm->flags & VMTOY_F_ARENA) {
+        arena_free(ARENA_PAGE, page);
+    } else {
+        free(page);
+    }
+}
+
+// A VM keeping a state hash needs to see every write, so nothing is ever writable.
+static inline int mem_fast_writes(const vmtoy* vm)
+{
+    return !(vm->flags & VMTOY_F_STATE_HASH);
+}
+
+void mem_init_flat(vmtoy* vm, uint16_t* memory, int mem_kind)
+{
+    if (vm->code) { code_forget_all(vm); }
+    vm->memory = memory;
+    vm->mem_kind = mem_kind;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        vm->rd[p] = memory + (p << PAGE_SHIFT);
+        vm->wr[p] = mem_fast_writes(vm) ? vm->rd[p] : NULL;
+        vm->page_kind[p] = PAGE_FLAT;
+    }
+    // The device pages always take the slow path so mmio_write() sees every store.
+    vm->wr[MMIO_BASE >> PAGE_SHIFT] = NULL;
+    vm->wr[0xFFFF >> PAGE_SHIFT] = NULL;
+}
+
+void mem_init_sparse(vmtoy* vm)
+{
+    if (vm->code) { code_forget_all(vm); }
+    vm->memory = NULL;
+    vm->mem_kind = MEM_SPARSE;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        vm->rd[p] = (uint16_t*)zero_page;
+        vm->wr[p] = NULL;
+        vm->page_kind[p] = PAGE_ZERO;
+    }
+}
+
+void mem_release(vmtoy* vm)
+{
+    hib_free(vm);
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (vm->page_kind[p] == PAGE_PRIVATE) {
+            page_free(vm, vm->rd[p]);
+        } else if (vm->page_kind[p] == PAGE_SHARED) {
+            shared_page_put(vm->rd[p]);
+        }
+    }
+    switch (vm->mem_kind) {
+        case MEM_HEAP:
+            free(vm->memory);
+            break;
+        case MEM_MAPPED:
+            munmap(vm->memory, MEMORY_BYTES);
+            break;
+        case MEM_LAZY:
+            uffd_unmap(vm->lazy);
+            vm->lazy = NULL;
+            break;
+        case MEM_PUBLISHED:
+            monitor_release(vm);
+            break;
+    }
+    vm->memory = NULL;
+}
+
+// Somewhere we can write page `p`, making one if we have to. NULL if we're out of memory.
+static uint16_t* page_for_write(vmtoy* vm, unsigned p)
+{
+    switch (vm->page_kind[p]) {
+        case PAGE_ZERO: {
+            uint16_t* page = page_alloc(vm);
+            if (!page) { return NULL; }
+            vm->rd[p] = page;
+            vm->page_kind[p] = PAGE_PRIVATE;
+            break;
+        }
+        case PAGE_SHARED: {
+            // Somebody else might be reading this one: time for our own copy.
+            uint16_t* page = page_alloc(vm);
+            if (!page) { return NULL; }
+            memcpy(page, vm->rd[p], PAGE_WORDS * sizeof(uint16_t));
+            shared_page_put(vm->rd[p]);
+            vm->rd[p] = page;
+            vm->page_kind[p] = PAGE_PRIVATE;
+            break;
+        }
+        case PAGE_WINDOW_RO:
+            return NULL;
+    }
+    // Leave the device pages (and decoded code) on the slow path.
+    if (p < (MMIO_BASE >> PAGE_SHIFT) && mem_fast_writes(vm) && !(vm->code && code_holds(vm, p))) {
+        vm->wr[p] = vm->rd[p];
+    }
+    vm->dirty[p / 64] |= (uint64_t)1 << (p % 64);
+    return vm->rd[p];
+}
+
+// The same for callers that write the page themselves, who knows what: whatever was
+// decoded from it goes.
+uint16_t* mem_page_for_write(vmtoy* vm, unsigned p)
+{
+    if (vm->code) { code_forget(vm, p); }
+    return page_for_write(vm, p);
+}
+
+// Sends the next write to page `p` down the slow path again, so it shows up as
+// dirty. That's all dirty tracking is: a write-protected page table entry.
+void mem_protect(vmtoy* vm, unsigned p)
+{
+    vm->dirty[p / 64] &= ~((uint64_t)1 << (p % 64));
+    vm->wr[p] = NULL;
+}
+
+// Dedup's side of the page table: trade a private page for the zero page or a shared one.
+int mem_page_is_zero(const uint16_t* words)
+{
+    return memcmp(words, zero_page, sizeof(zero_page)) == 0;
+}
+
+static void page_forget(vmtoy* vm, unsigned p)
+{
+    if (vm->code) { code_forget(vm, p); }
+    if (vm->page_kind[p] == PAGE_PRIVATE) {
+        page_free(vm, vm->rd[p]);
+    } else if (vm->page_kind[p] == PAGE_SHARED) {
+        shared_page_put(vm->rd[p]);
+    }
+    vm->wr[p] = NULL;
+}
+
+void mem_zero_page(vmtoy* vm, unsigned p)
+{
+    page_forget(vm, p);
+    vm->rd[p] = (uint16_t*)zero_page;
+    vm->page_kind[p] = PAGE_ZERO;
+}
+
+// The caller has already taken a reference on `shared` for us.
+void mem_share_page(vmtoy* vm, unsigned p, struct shared_page* shared)
+{
+    page_forget(vm, p);
+    vm->rd[p] = shared->words;
+    vm->page_kind[p] = PAGE_SHARED;
+}
+
+void mem_write_slow(vmtoy* vm, uint16_t address, uint16_t val)
+{
+    if (address >= MMIO_BASE) {
+        mmio_write(vm, address, val);
+        return;
+    }
+    // Like writing to ROM: nothing happens.
+    if (vm->page_kind[address >> PAGE_SHIFT] == PAGE_WINDOW_RO) { return; }
+    uint16_t* page = page_for_write(vm, address >> PAGE_SHIFT);
+    if (unlikely(!page)) {
+        vm->exit = VMTOY_EXIT_NO_MEMORY;
+        return;
+    }
+    if (unlikely(vm->flags & VMTOY_F_STATE_HASH)) {
+        mem_hash_write(vm, address, page[address & PAGE_MASK], val);
+    }
+    __atomic_store_n(&page[address & PAGE_MASK], val, __ATOMIC_RELAXED);
+    if (unlikely(vm->code != NULL)) { code_write(vm, address, val); }
+}
+
+// The host's way in: no devices, but pages still get allocated on demand.
+int mem_poke(vmtoy* vm, uint16_t address, uint16_t val)
+{
+    if (unlikely(vm->hib) && !vmtoy_wake(vm)) { return 0; }
+    uint16_t* page = page_for_write(vm, address >> PAGE_SHIFT);
+    if (!page) { return 0; }
+    if (vm->flags & VMTOY_F_STATE_HASH) {
+        mem_hash_write(vm, address, page[address & PAGE_MASK], val);
+    }
+    page[address & PAGE_MASK] = val;
+    if (vm->code) { code_write(vm, address, val); }
+    return 1;
+}
+
+// Windows
+// Mapping a window hides whatever the pages held: private and shared pages are given
+// up, flat memory stays where it is underneath and comes back when it's unmapped.
+// Either way the pages count as written, so checkpoints and migration pick up the
+// change.
+int vmtoy_map_window(vmtoy* vm, uint16_t addr, uint16_t* buf, size_t words, unsigned flags)
+{
+    if (!buf || !words || (addr & PAGE_MASK) || (words & PAGE_MASK)
+        || (size_t)addr + words > MMIO_BASE) { return 0; }
+    // Harts share one memory but each has its own page table.
+    if (vm->mem_kind == MEM_BORROWED) { return 0; }
+    if (unlikely(vm->hib) && !vmtoy_wake(vm)) { return 0; }
+
+    unsigned first = addr >> PAGE_SHIFT;
+    unsigned count = (unsigned)(words >> PAGE_SHIFT);
+    for (unsigned i = 0; i < count; ++i) {
+        if (page_is_window(vm->page_kind[first + i])) { return 0; }
+    }
+    int read_only = (flags & VMTOY_WINDOW_READ_ONLY) != 0;
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned p = first + i;
+        page_forget(vm, p);
+        vm->rd[p] = buf + ((size_t)i << PAGE_SHIFT);
+        vm->wr[p] = !read_only && mem_fast_writes(vm) ? vm->rd[p] : NULL;
+        vm->page_kind[p] = read_only ? PAGE_WINDOW_RO : PAGE_WINDOW;
+        vm->page_hash[p] = 0;
+        vm->dirty[p / 64] |= (uint64_t)1 << (p % 64);
+    }
+    vm->windows += count;
+    mem_rehash(vm);
+    return 1;
+}
+
+void vmtoy_unmap_window(vmtoy* vm, uint16_t addr, size_t words)
+{
+    unsigned first = addr >> PAGE_SHIFT;
+    for (size_t i = 0; i < (words + PAGE_MASK) >> PAGE_SHIFT && first + i < PAGE_COUNT; ++i) {
+        unsigned p = first + (unsigned)i;
+        if (!page_is_window(vm->page_kind[p])) { continue; }
+        if (vm->memory) {
+            vm->rd[p] = vm->memory + (p << PAGE_SHIFT);
+            vm->wr[p] = mem_fast_writes(vm) ? vm->rd[p] : NULL;
+            vm->page_kind[p] = PAGE_FLAT;
+        } else {
+            vm->rd[p] = (uint16_t*)zero_page;
+            vm->wr[p] = NULL;
+            vm->page_kind[p] = PAGE_ZERO;
+        }
+        vm->dirty[p / 64] |= (uint64_t)1 << (p % 64);
+        vm->windows--;
+    }
+    mem_rehash(vm);
+}
+
+// State hashing
+// A Zobrist-style hash: every (address, value) pair has its own random-looking 64-bit
+// key, and the hash of a memory is the XOR of the keys of all its words. Zero words
+// have key 0, so a fresh memory hashes to 0, and a write only has to XOR out the old
+// word's key and XOR in the new one. Search code uses it to spot states it has already
+// seen without looking at 128 KB each time.
+static inline uint64_t zobrist(uint32_t address, uint16_t val)
+{
+    return val ? hash_mix((uint64_t)address << 16 | val) : 0;
+}
+
+void mem_hash_write(vmtoy* vm, uint16_t address, uint16_t old, uint16_t val)
+{
+    vm->state_hash ^= zobrist(address, old) ^ zobrist(address, val);
+}
+
+// The long way round: every word, once.
+uint64_t mem_hash_full(const vmtoy* vm)
+{
+    if (vm->hib) {
+        uint16_t* copy = malloc(MEMORY_BYTES);
+        if (!copy) { return 0; }
+        hib_copy_out(vm, copy);
+        uint64_t h = mem_hash_image(copy);
+        free(copy);
+        return h;
+    }
+    uint64_t h = 0;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (vm->page_kind[p] == PAGE_ZERO) { continue; }
+        for (unsigned i = 0; i < PAGE_WORDS; ++i) {
+            h ^= zobrist(p << PAGE_SHIFT | i, vm->rd[p][i]);
+        }
+    }
+    return h;
+}
+
+// The same for memory that isn't in a VM, like a snapshot being compacted.
+uint64_t mem_hash_image(const uint16_t* memory)
+{
+    uint64_t h = 0;
+    for (uint32_t a = 0; a < VMTOY_MEMORY_WORDS; ++a) {
+        h ^= zobrist(a, memory[a]);
+    }
+    return h;
+}
+
+// For code that fills memory in behind the write hook's back (restores and the like).
+void mem_rehash(vmtoy* vm)
+{
+    if (vm->flags & VMTOY_F_STATE_HASH) { vm->state_hash = mem_hash_full(vm); }
+}
+
+// Registers and the keyboard latch go in as if they lived just past the end of memory.
+uint64_t vmtoy_state_hash(const vmtoy* vm)
+{
+    uint64_t h = (vm->flags & VMTOY_F_STATE_HASH) ? vm->state_hash : mem_hash_full(vm);
+    for (unsigned r = 0; r < R_COUNT; ++r) {
+        h ^= zobrist(VMTOY_MEMORY_WORDS + r, vm->regs[r]);
+    }
+    h ^= zobrist(VMTOY_MEMORY_WORDS + R_COUNT, vm->kbsr);
+    h ^= zobrist(VMTOY_MEMORY_WORDS + R_COUNT + 1, vm->kbdr);
+    return h;
+}
+
+void mem_copy_out(const vmtoy* vm, uint16_t* dst)
+{
+    if (vm->hib) {
+        hib_copy_out(vm, dst);
+        return;
+    }
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        memcpy(dst + (p << PAGE_SHIFT), vm->rd[p], PAGE_WORDS * sizeof(uint16_t));
+    }
+}
+
+size_t vmtoy_memory_footprint(const vmtoy* vm)
+{
+    size_t bytes = hib_size(vm);
+    // Only what the pager has brought in so far.
+    if (vm->mem_kind == MEM_LAZY) {
+        bytes += uffd_loaded_bytes(vm->lazy);
+    }
+    if (vm->mem_kind == MEM_HEAP || vm->mem_kind == MEM_MAPPED || vm->mem_kind == MEM_ARENA
+        || vm->mem_kind == MEM_PUBLISHED) {
+        bytes += MEMORY_BYTES;
+    }
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (vm->page_kind[p] == PAGE_PRIVATE) {
+            bytes += PAGE_WORDS * sizeof(uint16_t);
+        }
+    }
+    return bytes;
+}
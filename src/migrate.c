@@ -0,0 +1,243 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "snapshot.h"
+
+// Live migration
+// Moving a running VM to another process without stopping it for as long as it takes
+// to copy 128 KB. It's the usual pre-copy dance:
+//  1. vmtoy_migrate_start() write-protects every page and queues every page with
+//     something in it.
+//  2. Each vmtoy_migrate_step() sends what's queued plus whatever the VM has dirtied
+//     since the last step, and write-protects it again. The host keeps running the
+//     VM in between, so every pass has less to send than the one before.
+//  3. vmtoy_migrate_finish(), called between two vmtoy_run_for()s, sends the last few
+//     dirty pages, the registers and the devices, and ends the stream. That's the
+//     only time the VM isn't running anywhere, and it's a few pages' worth of write().
+// The receiving end is just vmtoy_migrate_receive() reading it all back.
+//
+// Dirty tracking is the same write-protect trick checkpoints use (see memory.c), so
+// don't checkpoint a VM while it's being migrated. Hibernating is fine: waking keeps
+// the dirty bits, and the first store to each page after it still gets noticed.
+//
+// The stream:
+//   struct mig_hello, then messages of { uint8_t type; uint8_t page; uint16_t size; }
+//   followed by `size` bytes: a packed page (pack.c) for MIG_PAGE, a struct snap_state
+//   for MIG_DONE, which is always last.
+
+#define MIG_MAGIC "VMTOYMIG"
+#define MIG_VERSION 1
+
+enum {
+    MIG_PAGE = 1,
+    MIG_DONE,
+};
+
+struct mig_hello {
+    char magic[8];
+    uint16_t version;
+    uint16_t endian;
+    uint32_t flags; // The VM's VMTOY_F_* flags.
+};
+
+struct mig_msg {
+    uint8_t type;
+    uint8_t page;
+    uint16_t size;
+};
+
+struct vmtoy_migration {
+    vmtoy* vm;
+    int fd;
+    uint64_t todo[PAGE_COUNT / 64]; // Pages from before we started that haven't gone yet.
+    uint8_t* buf;                    // One pass, packed.
+    uint64_t pages_sent;
+    uint64_t bytes_sent;
+};
+
+#define MIG_MAX_BYTES (PAGE_COUNT * (sizeof(struct mig_msg) + PACK_BOUND) \
+                       + sizeof(struct mig_msg) + sizeof(struct snap_state))
+
+// Pipes and sockets take what they like per write(), so keep at it.
+static int send_all(int fd, const void* buf, size_t size)
+{
+    const uint8_t* p = buf;
+    while (size) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void* buf, size_t size)
+{
+    uint8_t* p = buf;
+    while (size) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 1;
+}
+
+static int page_pending(const vmtoy_migration* m, unsigned p)
+{
+    return (int)(m->todo[p / 64] >> (p % 64)) & 1 || mem_dirty(m->vm, p);
+}
+
+vmtoy_migration* vmtoy_migrate_start(vmtoy* vm, int fd)
+{
+    // Harts share their memory, and each keeps its own page table.
+    if (vm->mem_kind == MEM_BORROWED) { return NULL; }
+    // The page table of a hibernating VM doesn't have its pages in it.
+    if (vm->hib && !vmtoy_wake(vm)) { return NULL; }
+
+    vmtoy_migration* m = calloc(1, sizeof(*m));
+    if (!m) { return NULL; }
+    m->buf = malloc(MIG_MAX_BYTES);
+    m->vm = vm;
+    m->fd = fd;
+
+    struct mig_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, MIG_MAGIC, sizeof(hello.magic));
+    hello.version = MIG_VERSION;
+    hello.endian = SNAP_ENDIAN;
+    hello.flags = vm->flags;
+    if (!m->buf || !send_all(fd, &hello, sizeof(hello))) {
+        vmtoy_migrate_cancel(m);
+        return NULL;
+    }
+
+    // The other side starts with zeros, so pages of zeros don't need to go at all.
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        mem_protect(vm, p);
+        if (vm->page_kind[p] != PAGE_ZERO && !mem_page_is_zero(vm->rd[p])) {
+            m->todo[p / 64] |= (uint64_t)1 << (p % 64);
+        }
+    }
+    return m;
+}
+
+void vmtoy_migrate_cancel(vmtoy_migration* m)
+{
+    if (!m) { return; }
+    free(m->buf);
+    free(m);
+}
+
+unsigned vmtoy_migrate_pending(const vmtoy_migration* m)
+{
+    unsigned count = 0;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        count += (unsigned)page_pending(m, p);
+    }
+    return count;
+}
+
+// Packs up to `max_pages` pending pages (0 = all of them) into m->buf.
+static size_t pack_pending(vmtoy_migration* m, unsigned max_pages)
+{
+    vmtoy* vm = m->vm;
+    uint8_t* out = m->buf;
+    unsigned count = 0;
+    for (unsigned p = 0; p < PAGE_COUNT && (!max_pages || count < max_pages); ++p) {
+        if (!page_pending(m, p)) { continue; }
+        // Protected before it's copied, so a write from here on gets it sent again.
+        mem_protect(vm, p);
+        m->todo[p / 64] &= ~((uint64_t)1 << (p % 64));
+
+        struct mig_msg msg = { MIG_PAGE, (uint8_t)p, 0 };
+        msg.size = (uint16_t)pack_page(vm->rd[p], out + sizeof(msg));
+        memcpy(out, &msg, sizeof(msg));
+        out += sizeof(msg) + msg.size;
+        count++;
+    }
+    m->pages_sent += count;
+    return (size_t)(out - m->buf);
+}
+
+int vmtoy_migrate_step(vmtoy_migration* m, unsigned max_pages)
+{
+    if (m->vm->hib && !vmtoy_wake(m->vm)) { return 0; }
+    size_t size = pack_pending(m, max_pages);
+    m->bytes_sent += size;
+    return send_all(m->fd, m->buf, size);
+}
+
+int vmtoy_migrate_finish(vmtoy_migration* m)
+{
+    vmtoy* vm = m->vm;
+    int ok = !vm->hib || vmtoy_wake(vm);
+    if (ok) {
+        // Whatever the console has buffered goes out from here, before the VM moves on.
+        if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+
+        size_t size = pack_pending(m, 0);
+        struct mig_msg msg = { MIG_DONE, 0, sizeof(struct snap_state) };
+        struct snap_state st;
+        snap_state_save(&st, vm);
+        memcpy(m->buf + size, &msg, sizeof(msg));
+        memcpy(m->buf + size + sizeof(msg), &st, sizeof(st));
+        size += sizeof(msg) + sizeof(st);
+        m->bytes_sent += size;
+        ok = send_all(m->fd, m->buf, size);
+    }
+    vmtoy_migrate_cancel(m);
+    return ok;
+}
+
+void vmtoy_migrate_get_stats(const vmtoy_migration* m, vmtoy_migrate_stats* stats)
+{
+    stats->pages_sent = m->pages_sent;
+    stats->bytes_sent = m->bytes_sent;
+    stats->pending = vmtoy_migrate_pending(m);
+}
+
+vmtoy* vmtoy_migrate_receive(int fd)
+{
+    struct mig_hello hello;
+    if (!recv_all(fd, &hello, sizeof(hello))
+        || memcmp(hello.magic, MIG_MAGIC, sizeof(hello.magic)) != 0
+        || hello.version != MIG_VERSION || hello.endian != SNAP_ENDIAN) {
+        return NULL;
+    }
+
+    vmtoy* vm = vm_new(hello.flags, NULL, MEM_HEAP);
+    if (!vm) { return NULL; }
+
+    uint8_t packed[PACK_BOUND];
+    uint16_t words[PAGE_WORDS];
+    for (;;) {
+        struct mig_msg msg;
+        if (!recv_all(fd, &msg, sizeof(msg))) { break; }
+
+        if (msg.type == MIG_DONE) {
+            struct snap_state st;
+            if (msg.size != sizeof(st) || !recv_all(fd, &st, sizeof(st))) { break; }
+            snap_state_apply(vm, &st);
+            mem_rehash(vm);
+            return vm;
+        }
+        if (msg.type != MIG_PAGE || msg.size > sizeof(packed)
+            || !recv_all(fd, packed, msg.size) || !unpack_page(packed, msg.size, words)) {
+            break;
+        }
+        // A sparse VM doesn't need to allocate a page just to keep it zero.
+        if (vm->page_kind[msg.page] == PAGE_ZERO && mem_page_is_zero(words)) { continue; }
+        uint16_t* page = mem_page_for_write(vm, msg.page);
+        if (!page) { break; }
+        memcpy(page, words, sizeof(words));
+    }
+    // The stream ended early or made no sense; the sender still has the VM.
+    vmtoy_destroy(vm);
+    return NULL;
+}
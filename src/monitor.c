@@ -0,0 +1,193 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+// Live monitoring
+// A monitor (a dashboard, a debugger, a bot's watchdog) wants to see what a VM is doing
+// without stopping it or asking it anything. vmtoy_monitor_publish() moves the VM's
+// memory into a named POSIX shared memory segment and puts a copy of its registers
+// next to it; anybody who can open the segment then reads both straight out of memory.
+//
+// The segment:
+//   struct mon_header (one page), then the flat guest memory.
+// The memory is the VM's own, live: the interpreter doesn't do anything different for
+// it. The registers live in the interpreter's hands, so they're copied into the header
+// at the end of every vmtoy_run_for() (a quantum, for the scheduler and lc3-vm), never
+// from inside the run loop. That copy is guarded by a sequence lock: the count is odd
+// while it's being written, so a reader that saw the same even count before and after
+// copying it knows it got one whole set of registers.
+//
+// Readers map it read-only. The segment is mode 0600, and it shows everything the
+// program has in memory.
+
+#define MON_MAGIC "VMTOYMON"
+#define MON_VERSION 1
+#define MON_HEADER_BYTES 4096
+
+struct mon_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t alive;       // Cleared when the VM is destroyed.
+    uint32_t seq;         // The sequence lock around everything below.
+    uint16_t regs[VMTOY_REG_COUNT];
+    uint16_t kbsr;
+    uint16_t kbdr;
+    int32_t exit;         // Why the last vmtoy_run_for() came back.
+    uint64_t icount;
+};
+
+struct vm_monitor {
+    struct mon_header* hdr;
+    char* name;
+};
+
+struct vmtoy_monitor {
+    const struct mon_header* hdr;
+};
+
+#define MON_BYTES (MON_HEADER_BYTES + MEMORY_BYTES)
+
+int vmtoy_monitor_publish(vmtoy* vm, const char* name)
+{
+    _Static_assert(sizeof(struct mon_header) <= MON_HEADER_BYTES, "monitor header too big");
+    // Harts share one memory, and windows aren't the VM's memory to move.
+    if (vm->mon || vm->mem_kind == MEM_BORROWED || vm->windows) { return 0; }
+    if (unlikely(vm->hib) && !vmtoy_wake(vm)) { return 0; }
+
+    struct vm_monitor* m = calloc(1, sizeof(*m));
+    if (!m) { return 0; }
+    m->name = strdup(name);
+    int fd = m->name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600) : -1;
+    if (fd < 0) {
+        free(m->name);
+        free(m);
+        return 0;
+    }
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)MON_BYTES) == 0) {
+        p = mmap(NULL, MON_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        free(m->name);
+        free(m);
+        return 0;
+    }
+
+    // From here on the VM runs on the segment's memory, like any other flat memory.
+    m->hdr = p;
+    uint16_t* memory = (uint16_t*)((char*)p + MON_HEADER_BYTES);
+    mem_copy_out(vm, memory);
+    mem_release(vm);
+    mem_init_flat(vm, memory, MEM_PUBLISHED);
+    memset(vm->page_hash, 0, sizeof(vm->page_hash));
+    // Every page is somewhere new, as far as checkpoints and migration are concerned.
+    memset(vm->dirty, 0xFF, sizeof(vm->dirty));
+    vm->mon = m;
+
+    m->hdr->version = MON_VERSION;
+    m->hdr->alive = 1;
+    monitor_update(vm);
+    // The magic goes in last, so a reader that opens it too early sees it isn't ready.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(m->hdr->magic, MON_MAGIC, sizeof(m->hdr->magic));
+    return 1;
+}
+
+void monitor_update(vmtoy* vm)
+{
+    struct mon_header* h = vm->mon->hdr;
+    uint32_t seq = h->seq;
+    __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (unsigned r = 0; r < VMTOY_REG_COUNT; ++r) {
+        __atomic_store_n(&h->regs[r], vm->regs[r], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->kbsr, vm->kbsr, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->kbdr, vm->kbdr, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->exit, vm->exit, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->icount, vm->icount, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// The VM is going away: readers hear about it, and the name goes.
+void monitor_release(vmtoy* vm)
+{
+    struct vm_monitor* m = vm->mon;
+    __atomic_store_n(&m->hdr->alive, 0, __ATOMIC_RELEASE);
+    shm_unlink(m->name);
+    munmap(m->hdr, MON_BYTES);
+    free(m->name);
+    free(m);
+    vm->mon = NULL;
+}
+
+// The reader's side.
+vmtoy_monitor* vmtoy_monitor_open(const char* name)
+{
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) { return NULL; }
+    void* p = mmap(NULL, MON_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) { return NULL; }
+    const struct mon_header* h = p;
+    if (memcmp(h->magic, MON_MAGIC, sizeof(h->magic)) != 0 || h->version != MON_VERSION) {
+        munmap(p, MON_BYTES);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    vmtoy_monitor* m = malloc(sizeof(*m));
+    if (!m) {
+        munmap(p, MON_BYTES);
+        return NULL;
+    }
+    m->hdr = h;
+    return m;
+}
+
+void vmtoy_monitor_close(vmtoy_monitor* m)
+{
+    if (!m) { return; }
+    munmap((void*)m->hdr, MON_BYTES);
+    free(m);
+}
+
+int vmtoy_monitor_read(vmtoy_monitor* m, vmtoy_monitor_state* out)
+{
+    const struct mon_header* h = m->hdr;
+    // The VM only holds the lock for a few dozen stores, so this hardly ever goes round
+    // more than twice. If it never comes free, whoever was writing died mid-way.
+    for (unsigned tries = 0; tries < 100000; ++tries) {
+        uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            if (tries % 64 == 63) { sched_yield(); }
+            continue;
+        }
+        for (unsigned r = 0; r < VMTOY_REG_COUNT; ++r) {
+            out->regs[r] = __atomic_load_n(&h->regs[r], __ATOMIC_RELAXED);
+        }
+        out->kbsr = __atomic_load_n(&h->kbsr, __ATOMIC_RELAXED);
+        out->kbdr = __atomic_load_n(&h->kbdr, __ATOMIC_RELAXED);
+        out->exit = __atomic_load_n(&h->exit, __ATOMIC_RELAXED);
+        out->icount = __atomic_load_n(&h->icount, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+            out->updates = seq / 2;
+            out->alive = (int)__atomic_load_n(&h->alive, __ATOMIC_ACQUIRE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const uint16_t* vmtoy_monitor_memory(vmtoy_monitor* m)
+{
+    return (const uint16_t*)((const char*)m->hdr + MON_HEADER_BYTES);
+}
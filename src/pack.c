@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "internal.h"
+
+// The page codec
+// A tiny LZ-style compressor for one page of guest words, built for speed over ratio.
+// LC-3 memory is mostly zeros, code and short tables, so three kinds of token do:
+//
+//   0x00-0x3F  n+1 literal words follow (little-endian)
+//   0x40-0x7F  n+1 zero words
+//   0x80-0xFF  n+2 words copied from `d+1` words back, d being the next byte
+//
+// A copy from one word back is how runs of the same word come out. Matches are found
+// through a 256-entry table of where each pair of words was last seen. Good enough to
+// squash a typical page by 3-10x, and the decoder is a few compares per token.
+
+#define LITERAL_MAX 64
+#define ZERO_MAX 64
+#define MATCH_MIN 2
+#define MATCH_MAX 129
+#define DISTANCE_MAX 256
+
+static inline unsigned pair_slot(const uint16_t* w)
+{
+    uint32_t h = ((uint32_t)w[0] << 16 | w[1]) * 2654435761u;
+    return h >> 24;
+}
+
+static uint8_t* flush_literals(uint8_t* out, const uint16_t* words, unsigned count)
+{
+    while (count) {
+        unsigned n = count > LITERAL_MAX ? LITERAL_MAX : count;
+        *out++ = (uint8_t)(n - 1);
+        for (unsigned i = 0; i < n; ++i) {
+            *out++ = (uint8_t)(words[i] & 0xFF);
+            *out++ = (uint8_t)(words[i] >> 8);
+        }
+        words += n;
+        count -= n;
+    }
+    return out;
+}
+
+// Squeezes a page into `out`, which needs PACK_BOUND bytes. Returns the packed size.
+size_t pack_page(const uint16_t* in, uint8_t* out)
+{
+    int16_t seen[256];
+    memset(seen, 0xFF, sizeof(seen));
+
+    uint8_t* start = out;
+    unsigned lit = 0; // Where the pending literals begin.
+    unsigned i = 0;
+    while (i < PAGE_WORDS) {
+        // A run of zeros?
+        if (in[i] == 0) {
+            unsigned n = 1;
+            while (i + n < PAGE_WORDS && n < ZERO_MAX && in[i + n] == 0) { n++; }
+            if (n >= 2) {
+                out = flush_literals(out, in + lit, i - lit);
+                *out++ = (uint8_t)(0x40 | (n - 1));
+                i += n;
+                lit = i;
+                continue;
+            }
+        }
+
+        // Something we've already seen? The word just before us counts too, for runs.
+        if (i + 1 < PAGE_WORDS) {
+            unsigned slot = pair_slot(in + i);
+            int from = seen[slot];
+            seen[slot] = (int16_t)i;
+            if (i > 0 && in[i] == in[i - 1] && in[i + 1] == in[i]) { from = (int)i - 1; }
+            if (from >= 0 && i - (unsigned)from <= DISTANCE_MAX
+                && in[from] == in[i] && in[from + 1] == in[i + 1]) {
+                unsigned n = MATCH_MIN;
+                while (i + n < PAGE_WORDS && n < MATCH_MAX && in[from + n] == in[i + n]) { n++; }
+                out = flush_literals(out, in + lit, i - lit);
+                *out++ = (uint8_t)(0x80 | (n - MATCH_MIN));
+                *out++ = (uint8_t)(i - (unsigned)from - 1);
+                // Remember a few of the pairs we jumped over so later matches can find them.
+                for (unsigned j = i + 1; j + 1 < i + n && j + 1 < PAGE_WORDS; j += 2) {
+                    seen[pair_slot(in + j)] = (int16_t)j;
+                }
+                i += n;
+                lit = i;
+                continue;
+            }
+        }
+        i++;
+    }
+    out = flush_literals(out, in + lit, i - lit);
+    return (size_t)(out - start);
+}
+
+// The other way. Returns 0 if `in` isn't a whole, well-formed page.
+int unpack_page(const uint8_t* in, size_t size, uint16_t* out)
+{
+    const uint8_t* end = in + size;
+    unsigned i = 0;
+    while (in < end) {
+        uint8_t t = *in++;
+        if (t < 0x40) {
+            unsigned n = t + 1u;
+            if (i + n > PAGE_WORDS || (size_t)(end - in) < 2 * n) { return 0; }
+            for (unsigned k = 0; k < n; ++k, in += 2) {
+                out[i++] = (uint16_t)(in[0] | in[1] << 8);
+            }
+        } else if (t < 0x80) {
+            unsigned n = (t & 0x3F) + 1u;
+            if (i + n > PAGE_WORDS) { return 0; }
+            memset(out + i, 0, n * sizeof(uint16_t));
+            i += n;
+        } else {
+            if (in == end) { return 0; }
+            unsigned n = (t & 0x7F) + MATCH_MIN;
+            unsigned d = *in++ + 1u;
+            if (d > i || i + n > PAGE_WORDS) { return 0; }
+            // Word by word: a copy can overlap itself (that's how runs work).
+            for (unsigned k = 0; k < n; ++k, ++i) {
+                out[i] = out[i - d];
+            }
+        }
+    }
+    return i == PAGE_WORDS;
+}
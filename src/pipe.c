@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "internal.h"
+#include "ring.h"
+
+// Console pipelines
+// `a | b` without the shell: stage N's console output goes straight into a ring that
+// stage N+1's keyboard reads from. No processes, no pipes, no syscalls in between.
+// The first stage keeps whatever input it had and the last stage keeps its output.
+//
+// The run loop stays on one stage for as long as it makes progress, so the rings
+// fill and drain in big batches. A stage that blocks on input hands over to the
+// stage feeding it, and one that blocks on output hands over to the one it feeds.
+
+#define PIPE_QUANTUM (1 << 14)
+
+struct pipe_ring {
+    int closed;       // The writer has finished: once the ring is empty, that's EOF.
+    struct ring* ring;
+};
+
+struct stage {
+    vmtoy* vm;
+    vmtoy_io orig;          // What the stage had before we plumbed it in.
+    struct pipe_ring* in;   // NULL for the first stage.
+    struct pipe_ring* out;  // NULL for the last stage.
+    int done;
+    int exit;
+};
+
+struct vmtoy_pipeline {
+    unsigned count;
+    struct stage* stages;
+    struct pipe_ring* rings;
+};
+
+static int stage_read(void* ctx)
+{
+    struct stage* st = ctx;
+    if (!st->in) { return st->orig.read(st->orig.ctx); }
+
+    uint16_t w;
+    if (ring_pop(st->in->ring, &w)) { return w; }
+    // Check for closed only after finding it empty, and look once more in case the
+    // last few bytes went in just before the writer finished.
+    if (__atomic_load_n(&st->in->closed, __ATOMIC_ACQUIRE)) {
+        return ring_pop(st->in->ring, &w) ? w : VMTOY_IO_EOF;
+    }
+    return VMTOY_IO_AGAIN;
+}
+
+static int stage_poll(void* ctx)
+{
+    struct stage* st = ctx;
+    if (!st->in) { return st->orig.poll(st->orig.ctx); }
+    return ring_count(st->in->ring) != 0 || __atomic_load_n(&st->in->closed, __ATOMIC_ACQUIRE);
+}
+
+static int stage_write(void* ctx, int ch)
+{
+    struct stage* st = ctx;
+    if (!st->out) { return st->orig.write(st->orig.ctx, ch); }
+    return ring_push(st->out->ring, (uint16_t)ch) ? 0 : VMTOY_IO_AGAIN;
+}
+
+static void stage_flush(void* ctx)
+{
+    // Nothing to flush between stages: the bytes are already where the reader looks.
+    struct stage* st = ctx;
+    if (!st->out && st->orig.flush) { st->orig.flush(st->orig.ctx); }
+}
+
+void vmtoy_pipeline_destroy(vmtoy_pipeline* p)
+{
+    if (!p) { return; }
+    if (p->stages) {
+        // Give the stages their old I/O back.
+        for (unsigned i = 0; i < p->count; ++i) {
+            if (p->stages[i].vm) { vmtoy_set_io(p->stages[i].vm, &p->stages[i].orig); }
+        }
+    }
+    if (p->rings) {
+        for (unsigned i = 0; i + 1 < p->count; ++i) {
+            free(p->rings[i].ring);
+        }
+    }
+    free(p->rings);
+    free(p->stages);
+    free(p);
+}
+
+vmtoy_pipeline* vmtoy_pipeline_create(vmtoy* const* stages, unsigned count, unsigned capacity)
+{
+    if (count == 0) { return NULL; }
+    vmtoy_pipeline* p = calloc(1, sizeof(*p));
+    if (!p) { return NULL; }
+    p->count = count;
+    p->stages = calloc(count, sizeof(struct stage));
+    p->rings = calloc(count, sizeof(struct pipe_ring));
+    if (!p->stages || !p->rings) {
+        vmtoy_pipeline_destroy(p);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i + 1 < count; ++i) {
+        p->rings[i].ring = aligned_alloc(RING_CACHELINE, (ring_size(capacity) + RING_CACHELINE - 1) & ~(size_t)(RING_CACHELINE - 1));
+        if (!p->rings[i].ring) {
+            vmtoy_pipeline_destroy(p);
+            return NULL;
+        }
+        ring_init(p->rings[i].ring, capacity);
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        struct stage* st = &p->stages[i];
+        st->vm = stages[i];
+        st->orig = stages[i]->io;
+        st->in = i > 0 ? &p->rings[i - 1] : NULL;
+        st->out = i + 1 < count ? &p->rings[i] : NULL;
+
+        vmtoy_io io = { stage_read, stage_poll, stage_write, stage_flush, st };
+        vmtoy_set_io(st->vm, &io);
+    }
+    return p;
+}
+
+int vmtoy_pipeline_exit(const vmtoy_pipeline* p, unsigned stage)
+{
+    return stage < p->count ? p->stages[stage].exit : VMTOY_EXIT_STOPPED;
+}
+
+static void stage_finish(vmtoy_pipeline* p, unsigned i, int reason)
+{
+    struct stage* st = &p->stages[i];
+    st->done = 1;
+    st->exit = reason;
+    if (st->out) {
+        __atomic_store_n(&st->out->closed, 1, __ATOMIC_RELEASE);
+    }
+    // Nobody is listening any more. Same as SIGPIPE: the stages feeding us stop too.
+    if (i > 0 && !p->stages[i - 1].done) {
+        vmtoy_stop(p->stages[i - 1].vm);
+    }
+}
+
+int vmtoy_pipeline_run(vmtoy_pipeline* p)
+{
+    // Start from the front: nothing downstream has anything to read yet.
+    unsigned cur = 0;
+    unsigned idle = 0;
+
+    for (;;) {
+        struct stage* st = &p->stages[cur];
+        if (st->done) {
+            // Find somebody who isn't.
+            unsigned i;
+            for (i = 0; i < p->count && p->stages[i].done; ++i) {
+            }
+            if (i == p->count) { return VMTOY_EXIT_HALT; }
+            cur = i;
+            continue;
+        }
+
+        int reason = vmtoy_run_for(st->vm, PIPE_QUANTUM);
+        switch (reason) {
+            case VMTOY_EXIT_BUDGET:
+                idle = 0;
+                // Busy-polling an empty keyboard? Let the stage before it catch up.
+                if (st->in && !ring_count(st->in->ring) && !p->stages[cur - 1].done) {
+                    cur--;
+                }
+                break;
+            case VMTOY_EXIT_BLOCKED:
+                if (st->vm->wait == WAIT_INPUT && st->in && !p->stages[cur - 1].done) {
+                    cur--;
+                    idle = 0;
+                } else if (st->vm->wait == WAIT_OUTPUT && st->out && !p->stages[cur + 1].done) {
+                    cur++;
+                    idle = 0;
+                } else if (++idle >= p->count) {
+                    // Everybody is waiting on the outside world. Take a nap.
+                    struct timespec nap = { 0, 1000000 };
+                    nanosleep(&nap, NULL);
+                    idle = 0;
+                } else {
+                    cur = (cur + 1) % p->count;
+                }
+                break;
+            default:
+                stage_finish(p, cur, reason);
+                idle = 0;
+                if (cur + 1 < p->count) { cur++; }
+                break;
+        }
+    }
+}
@@ -0,0 +1,733 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+// Predecoding
+// The switch interpreter pulls every instruction apart again each time it runs it, and
+// sends all of them through the one indirect jump at the top of the switch, which the
+// branch predictor can't do much with. A VMTOY_F_PREDECODE VM decodes each page of code
+// once, into an op per word: the form, the registers, and the immediate already sign
+// extended (or, for PC-relative forms, the address it works out to). Running it is a
+// jump from one handler straight to the next (threaded code), so every handler gets an
+// indirect jump of its own to predict, and nothing is decoded twice.
+//
+// Decoded pages are kept off the fast write path (wr[] is NULL, see memory.c), so a
+// store into one goes through mem_write_slow(), which decodes that word again. Data
+// living next to the code costs a slow store, but self-modifying code just works, and
+// so does the host writing memory between runs. Windows are never decoded: the host
+// can change them behind our back. Anything that swaps a page out from under us
+// (dedup, windows, restores, hibernation) makes us forget it.
+//
+// Before the first instruction runs, an eager pass (vmtoy_predecode()) follows the
+// control flow from everywhere a program could start and decodes every page it finds
+// code in, on worker threads if there's enough of it, so there's no warming up: the
+// first run goes as fast as the hundredth. Pages it missed are decoded the first time
+// the program gets there.
+
+// FORM_NEXT_PAGE sits one past the last word of every page, and carries on in the next.
+#define FORM_NEXT_PAGE ISA_FORM_COUNT
+
+struct code_op {
+    uint8_t form;   // enum isa_form, or FORM_NEXT_PAGE
+    uint8_t dr;     // The nzp flags, for BR.
+    uint8_t sr1;
+    uint8_t sr2;
+    uint16_t imm;   // imm5 or offset6, or the address a PC-relative operand points at.
+    uint16_t instr; // The word itself.
+};
+
+struct code_page {
+    struct code_page* next; // On the dead list.
+    uint16_t base;          // Address of ops[0].
+    struct code_op ops[PAGE_WORDS + 1];
+};
+
+// Where images were loaded, so the analysis can start there too.
+#define MAX_ORIGINS 16
+
+struct vm_code {
+    struct code_page* page[PAGE_COUNT];
+    // Pages forgotten while code_run() might still be in them. They're freed once
+    // it's out, and `stale` tells it to look the page up again.
+    struct code_page* dead;
+    unsigned running;
+    int stale;
+    int warm;               // The eager pass has run since the last code_forget_all().
+    unsigned origins;
+    uint16_t origin[MAX_ORIGINS];
+    vmtoy_predecode_stats stats;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+struct vm_code* code_new(void)
+{
+    return calloc(1, sizeof(struct vm_code));
+}
+
+static void bury(struct vm_code* code)
+{
+    while (code->dead) {
+        struct code_page* cp = code->dead;
+        code->dead = cp->next;
+        free(cp);
+    }
+}
+
+void code_free(vmtoy* vm)
+{
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        free(vm->code->page[p]);
+    }
+    bury(vm->code);
+    free(vm->code);
+    vm->code = NULL;
+}
+
+int code_holds(const vmtoy* vm, unsigned p)
+{
+    return vm->code->page[p] != NULL;
+}
+
+static void decode_op(struct code_op* op, uint16_t pc, uint16_t instr)
+{
+    uint16_t next = (uint16_t)(pc + 1);
+    op->form = (uint8_t)isa_form_of(instr);
+    op->dr = (uint8_t)isa_dr(instr);
+    op->sr1 = (uint8_t)isa_sr1(instr);
+    op->sr2 = (uint8_t)isa_sr2(instr);
+    op->instr = instr;
+    switch (op->form) {
+        case FORM_ADD_IMM:
+        case FORM_AND_IMM:
+            op->imm = isa_imm5(instr);
+            break;
+        case FORM_LDR:
+        case FORM_STR:
+            op->imm = isa_offset6(instr);
+            break;
+        case FORM_BR:
+            op->dr = (uint8_t)isa_nzp(instr);
+            op->imm = (uint16_t)(next + isa_pcoffset9(instr));
+            break;
+        case FORM_LD:
+        case FORM_LDI:
+        case FORM_LEA:
+        case FORM_ST:
+        case FORM_STI:
+            op->imm = (uint16_t)(next + isa_pcoffset9(instr));
+            break;
+        case FORM_JSR:
+            op->imm = (uint16_t)(next + isa_pcoffset11(instr));
+            break;
+        default:
+            op->imm = 0;
+            break;
+    }
+}
+
+static void decode_page(struct code_page* cp, const uint16_t* words, unsigned p)
+{
+    cp->next = NULL;
+    cp->base = (uint16_t)(p << PAGE_SHIFT);
+    for (unsigned i = 0; i < PAGE_WORDS; ++i) {
+        decode_op(&cp->ops[i], (uint16_t)(cp->base + i), words[i]);
+    }
+    memset(&cp->ops[PAGE_WORDS], 0, sizeof(cp->ops[PAGE_WORDS]));
+    cp->ops[PAGE_WORDS].form = FORM_NEXT_PAGE;
+}
+
+// The device pages have to be read a word at a time, and windows can change between
+// one run and the next.
+static int can_decode(const vmtoy* vm, unsigned p)
+{
+    return p < (MMIO_BASE >> PAGE_SHIFT) && !page_is_window(vm->page_kind[p]);
+}
+
+static void install(vmtoy* vm, unsigned p, struct code_page* cp)
+{
+    vm->code->page[p] = cp;
+    vm->wr[p] = NULL;
+}
+
+// A page the eager pass didn't see coming. NULL if there's no memory for it.
+static struct code_page* decode_lazily(vmtoy* vm, unsigned p)
+{
+    struct code_page* cp = malloc(sizeof(*cp));
+    if (!cp) { return NULL; }
+    decode_page(cp, vm->rd[p], p);
+    install(vm, p, cp);
+    vm->code->stats.lazy_pages++;
+    return cp;
+}
+
+void code_write(vmtoy* vm, uint16_t address, uint16_t val)
+{
+    struct code_page* cp = vm->code->page[address >> PAGE_SHIFT];
+    if (!cp) { return; }
+    decode_op(&cp->ops[address & PAGE_MASK], address, val);
+    vm->code->stats.rewrites++;
+}
+
+void code_forget(vmtoy* vm, unsigned p)
+{
+    struct vm_code* code = vm->code;
+    struct code_page* cp = code->page[p];
+    if (!cp) { return; }
+    code->page[p] = NULL;
+    if (code->running) {
+        cp->next = code->dead;
+        code->dead = cp;
+        code->stale = 1;
+    } else {
+        free(cp);
+    }
+}
+
+void code_forget_all(vmtoy* vm)
+{
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        code_forget(vm, p);
+    }
+    vm->code->warm = 0;
+}
+
+void code_loaded(vmtoy* vm, uint16_t origin)
+{
+    struct vm_code* code = vm->code;
+    code->warm = 0;
+    for (unsigned i = 0; i < code->origins; ++i) {
+        if (code->origin[i] == origin) { return; }
+    }
+    if (code->origins < MAX_ORIGINS) { code->origin[code->origins++] = origin; }
+}
+
+// The analysis
+// A walk over the program's control flow, starting from the PC, every image's origin
+// and whatever the trap and interrupt vector tables at x0000-x01FF point at (our
+// traps are handled by the host, so those are usually empty, but an image that brings
+// its own OS fills them in). It follows both ways out of a BR, into every JSR and
+// past it, and through JMP and JSRR when it can tell where the register points: it
+// keeps track of what LEA and LD put in registers within a block, so it sees
+// "LEA R1, TABLE; ADD R1, R1, R0; LDR R2, R1, #0; JMP R2" as a jump through a table
+// and tries every entry. It doesn't have to be right, only cheap: whatever it misses
+// is decoded when the program gets there, and decoding data by mistake costs nothing
+// but the time.
+
+// What the walk knows about a register.
+enum {
+    VAL_UNKNOWN = 0,
+    VAL_CONST,  // Exactly v.
+    VAL_TABLE,  // v plus something we don't know: an index into the table at v.
+    VAL_ENTRY,  // One of the words in the table at v.
+};
+
+struct val {
+    uint8_t kind;
+    uint16_t v;
+};
+
+// The longest jump table we'll believe in.
+#define MAX_TABLE 64
+
+struct walk {
+    vmtoy* vm;
+    uint8_t queued[VMTOY_MEMORY_WORDS / 8]; // Block starts already on the list.
+    uint8_t seen[VMTOY_MEMORY_WORDS / 8];   // Instructions already walked over.
+    uint8_t pages[PAGE_COUNT];              // Pages we found code in.
+    uint32_t blocks;
+    uint32_t ntodo;
+    uint16_t todo[VMTOY_MEMORY_WORDS];
+};
+
+static int bit_test_and_set(uint8_t* bits, uint16_t i)
+{
+    int was = bits[i >> 3] >> (i & 7) & 1;
+    bits[i >> 3] |= (uint8_t)(1u << (i & 7));
+    return was;
+}
+
+// Zeros (BR never) and the opcodes that do nothing here are much more likely to be
+// data than code, and so is anything in a page nobody has written.
+static int looks_like_code(const vmtoy* vm, uint16_t addr)
+{
+    unsigned p = addr >> PAGE_SHIFT;
+    if (!can_decode(vm, p) || vm->page_kind[p] == PAGE_ZERO) { return 0; }
+    uint16_t instr = mem_peek(vm, addr);
+    enum isa_form form = isa_form_of(instr);
+    return instr != 0 && form != FORM_RES && form != FORM_RTI;
+}
+
+static void walk_push(struct walk* w, uint16_t addr)
+{
+    if (!looks_like_code(w->vm, addr) || bit_test_and_set(w->queued, addr)) { return; }
+    w->todo[w->ntodo++] = addr;
+}
+
+// Where a JMP or JSRR through `r` could go.
+static void walk_jump(struct walk* w, struct val r)
+{
+    switch (r.kind) {
+        case VAL_CONST:
+            walk_push(w, r.v);
+            break;
+        case VAL_TABLE:
+            // Into the table itself: a row of BRs, say.
+            for (unsigned i = 0; i < MAX_TABLE && looks_like_code(w->vm, (uint16_t)(r.v + i)); ++i) {
+                walk_push(w, (uint16_t)(r.v + i));
+            }
+            break;
+        case VAL_ENTRY:
+            for (unsigned i = 0; i < MAX_TABLE; ++i) {
+                uint16_t a = (uint16_t)(r.v + i);
+                if (a >= MMIO_BASE || !looks_like_code(w->vm, mem_peek(w->vm, a))) { break; }
+                walk_push(w, mem_peek(w->vm, a));
+            }
+            break;
+    }
+}
+
+static struct val val_load(const vmtoy* vm, uint16_t addr)
+{
+    struct val v = { VAL_UNKNOWN, 0 };
+    if (addr < MMIO_BASE) {
+        v.kind = VAL_CONST;
+        v.v = mem_peek(vm, addr);
+    }
+    return v;
+}
+
+// One block, and the ones it falls into, up to the first instruction that never falls
+// through or that we've been over already.
+static void walk_block(struct walk* w, uint16_t pc)
+{
+    const vmtoy* vm = w->vm;
+    struct val r[8];
+    memset(r, 0, sizeof(r));
+    w->blocks++;
+
+    for (;; ++pc) {
+        if (!looks_like_code(vm, pc) || bit_test_and_set(w->seen, pc)) { return; }
+        w->pages[pc >> PAGE_SHIFT] = 1;
+
+        uint16_t instr = mem_peek(vm, pc);
+        uint16_t next = (uint16_t)(pc + 1);
+        struct val a = r[isa_sr1(instr)];
+        struct val b = r[isa_sr2(instr)];
+        struct val* dr = &r[isa_dr(instr)];
+        switch (isa_form_of(instr)) {
+            case FORM_ADD_IMM:
+                dr->kind = a.kind == VAL_CONST || a.kind == VAL_TABLE ? a.kind : VAL_UNKNOWN;
+                dr->v = (uint16_t)(a.v + isa_imm5(instr));
+                break;
+            case FORM_ADD_REG:
+                if (a.kind == VAL_CONST && b.kind == VAL_CONST) {
+                    dr->kind = VAL_CONST;
+                    dr->v = (uint16_t)(a.v + b.v);
+                } else if ((a.kind == VAL_CONST || a.kind == VAL_TABLE) && b.kind == VAL_UNKNOWN) {
+                    dr->kind = VAL_TABLE;
+                    dr->v = a.v;
+                } else if ((b.kind == VAL_CONST || b.kind == VAL_TABLE) && a.kind == VAL_UNKNOWN) {
+                    dr->kind = VAL_TABLE;
+                    dr->v = b.v;
+                } else {
+                    dr->kind = VAL_UNKNOWN;
+                }
+                break;
+            case FORM_LEA:
+                dr->kind = VAL_CONST;
+                dr->v = (uint16_t)(next + isa_pcoffset9(instr));
+                break;
+            case FORM_LD:
+                *dr = val_load(vm, (uint16_t)(next + isa_pcoffset9(instr)));
+                break;
+            case FORM_LDR:
+                if (a.kind == VAL_CONST) {
+                    *dr = val_load(vm, (uint16_t)(a.v + isa_offset6(instr)));
+                } else if (a.kind == VAL_TABLE) {
+                    dr->kind = VAL_ENTRY;
+                    dr->v = (uint16_t)(a.v + isa_offset6(instr));
+                } else {
+                    dr->kind = VAL_UNKNOWN;
+                }
+                break;
+            case FORM_AND_REG:
+            case FORM_AND_IMM:
+            case FORM_NOT:
+            case FORM_LDI:
+                dr->kind = VAL_UNKNOWN;
+                break;
+            case FORM_BR:
+                walk_push(w, (uint16_t)(next + isa_pcoffset9(instr)));
+                if (isa_nzp(instr) == (FL_NEG | FL_ZRO | FL_POS)) { return; }
+                w->blocks++;
+                break;
+            case FORM_RET:
+            case FORM_JMP:
+                walk_jump(w, a);
+                return;
+            case FORM_JSR:
+            case FORM_JSRR:
+                if (isa_long_flag(instr)) {
+                    walk_push(w, (uint16_t)(next + isa_pcoffset11(instr)));
+                } else {
+                    walk_jump(w, a);
+                }
+                // Back from the subroutine, with who knows what in the registers.
+                memset(r, 0, sizeof(r));
+                w->blocks++;
+                break;
+            case FORM_TRAP:
+                if (isa_trapvect8(instr) == TRAP_HALT) { return; }
+                r[R_R0].kind = VAL_UNKNOWN;
+                r[R_R7].kind = VAL_UNKNOWN;
+                w->blocks++;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Decoding on worker threads
+// Decoding a page is a microsecond or so, and starting a thread costs tens of them, so
+// threads only come out for big programs on machines with CPUs to spare. Each worker
+// decodes its share of the pages into pages of its own; installing them in the page
+// table is left to the caller, once they've all finished.
+#define PAGES_PER_THREAD 64
+#define MAX_THREADS 8
+
+struct decode_job {
+    const vmtoy* vm;
+    const unsigned* pages;
+    struct code_page** out;
+    unsigned count;
+};
+
+static void* decode_worker(void* arg)
+{
+    struct decode_job* job = arg;
+    for (unsigned i = 0; i < job->count; ++i) {
+        struct code_page* cp = malloc(sizeof(*cp));
+        if (cp) { decode_page(cp, job->vm->rd[job->pages[i]], job->pages[i]); }
+        job->out[i] = cp;
+    }
+    return NULL;
+}
+
+static unsigned decode_threads(unsigned pages)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned n = pages / PAGES_PER_THREAD;
+    if (cpus > 0 && n > (unsigned long)cpus) { n = (unsigned)cpus; }
+    if (n > MAX_THREADS) { n = MAX_THREADS; }
+    return n ? n : 1;
+}
+
+static void decode_all(vmtoy* vm, const unsigned* pages, unsigned count)
+{
+    struct code_page** out = calloc(count ? count : 1, sizeof(*out));
+    if (!out) { return; }
+    unsigned nthreads = decode_threads(count);
+    struct decode_job jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS] = { 0 };
+    for (unsigned t = 0; t < nthreads; ++t) {
+        unsigned first = count * t / nthreads;
+        jobs[t].vm = vm;
+        jobs[t].pages = pages + first;
+        jobs[t].out = out + first;
+        jobs[t].count = count * (t + 1) / nthreads - first;
+    }
+    // The first share is ours; any worker that won't start, we do ourselves too.
+    for (unsigned t = 1; t < nthreads; ++t) {
+        started[t] = pthread_create(&threads[t], NULL, decode_worker, &jobs[t]) == 0;
+    }
+    decode_worker(&jobs[0]);
+    for (unsigned t = 1; t < nthreads; ++t) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            decode_worker(&jobs[t]);
+        }
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        if (!out[i]) { continue; }
+        install(vm, pages[i], out[i]);
+        vm->code->stats.eager_pages++;
+    }
+    vm->code->stats.threads = nthreads;
+    free(out);
+}
+
+// The eager pass: find the code, decode it. 0 if there wasn't memory to do it, in
+// which case everything gets decoded lazily.
+static int code_warm(vmtoy* vm)
+{
+    struct vm_code* code = vm->code;
+    uint64_t start = now_ns();
+    code->warm = 1;
+    struct walk* w = calloc(1, sizeof(*w));
+    if (!w) { return 0; }
+    w->vm = vm;
+
+    walk_push(w, vm->regs[R_PC]);
+    for (unsigned i = 0; i < code->origins; ++i) {
+        walk_push(w, code->origin[i]);
+    }
+    for (uint16_t v = 0; v < 0x200; ++v) {
+        if (vm->page_kind[v >> PAGE_SHIFT] == PAGE_ZERO) { continue; }
+        walk_push(w, mem_peek(vm, v));
+    }
+    while (w->ntodo) {
+        walk_block(w, w->todo[--w->ntodo]);
+    }
+
+    unsigned pages[PAGE_COUNT];
+    unsigned count = 0;
+    for (unsigned p = 0; p < PAGE_COUNT; ++p) {
+        if (w->pages[p] && !code->page[p]) { pages[count++] = p; }
+    }
+    code->stats.blocks = w->blocks;
+    free(w);
+    decode_all(vm, pages, count);
+    code->stats.analysis_ns += now_ns() - start;
+    return 1;
+}
+
+int vmtoy_predecode(vmtoy* vm)
+{
+    if (!vm->code) { return 0; }
+    if (unlikely(vm->hib) && !vmtoy_wake(vm)) { return 0; }
+    return code_warm(vm);
+}
+
+void vmtoy_predecode_get_stats(const vmtoy* vm, vmtoy_predecode_stats* stats)
+{
+    if (vm->code) {
+        *stats = vm->code->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+// The engine
+// `n` counts the instructions before `entry`, the op we came into this page at; the
+// ones since are `op - entry`, so there's no counting as we go. Straight-line code
+// only stops to look at the budget when it comes into a page, and only stops to look
+// at vm->exit there and after the few things that can set it: the device page, slow
+// stores and TRAPs. A stretch that would run past the end of the budget, and code we
+// can't decode, go to the switch interpreter instead.
+uint64_t code_run(vmtoy* vm, uint64_t instructions, uint64_t icount)
+{
+    static void* const handlers[ISA_FORM_COUNT + 1] = {
+#define ISA_FORM(name, opcode, mask, bits, mnemonic, a, b, c, example, text) [FORM_##name] = &&do_##name,
+#include "isa.def"
+        [FORM_NEXT_PAGE] = &&next_page,
+    };
+    uint16_t* regs = vm->regs;
+    struct vm_code* code = vm->code;
+    uint64_t n = 0;
+    const struct code_page* cp;
+    const struct code_op* entry;
+    const struct code_op* op;
+
+    if (unlikely(!code->warm)) { code_warm(vm); }
+    code->running++;
+
+#define DONE (n + (uint64_t)(op - entry) + 1)
+#define PC_OF(o) ((uint16_t)(cp->base + ((o) - cp->ops)))
+#define NEXT() do { ++op; goto *handlers[op->form]; } while (0)
+#define JUMP(target) do { \
+        uint16_t t_ = (target); \
+        n = DONE; \
+        regs[R_PC] = t_; \
+        goto enter; \
+    } while (0)
+    // As in the switch interpreter: a load from the device page can ask us to wait,
+    // and the destination register has to survive that.
+#define LOAD(r, address) do { \
+        uint16_t a_ = (address); \
+        uint16_t v_ = mem_read(vm, a_); \
+        if (unlikely(a_ >= MMIO_BASE)) { \
+            if (vm->exit == VMTOY_EXIT_BLOCKED) { goto stop; } \
+            regs[r] = v_; \
+            update_flags(vm, r); \
+            goto check; \
+        } \
+        regs[r] = v_; \
+    } while (0)
+#define STORE(address, val) do { \
+        uint16_t a_ = (address); \
+        uint16_t* page_ = vm->wr[a_ >> PAGE_SHIFT]; \
+        if (likely(page_ != NULL)) { \
+            __atomic_store_n(&page_[a_ & PAGE_MASK], (val), __ATOMIC_RELAXED); \
+        } else { \
+            mem_write_slow(vm, a_, (val)); \
+            goto check; \
+        } \
+    } while (0)
+
+enter:
+    if (unlikely(__atomic_load_n(&vm->exit, __ATOMIC_RELAXED))) { goto out; }
+    {
+        uint16_t pc = regs[R_PC];
+        unsigned p = pc >> PAGE_SHIFT;
+        uint64_t left = instructions - n;
+        cp = code->page[p];
+        if (unlikely(cp == NULL) && can_decode(vm, p)) { cp = decode_lazily(vm, p); }
+        if (unlikely(cp == NULL || left < (uint64_t)(PAGE_WORDS - (pc & PAGE_MASK)))) {
+            if (!left) { goto out; }
+            n += interp_run(vm, left < PAGE_WORDS ? left : PAGE_WORDS, icount + n);
+            goto enter;
+        }
+        entry = op = &cp->ops[pc & PAGE_MASK];
+        goto *handlers[op->form];
+    }
+
+do_ADD_REG:
+    regs[op->dr] = regs[op->sr1] + regs[op->sr2];
+    update_flags(vm, op->dr);
+    NEXT();
+do_ADD_IMM:
+    regs[op->dr] = regs[op->sr1] + op->imm;
+    update_flags(vm, op->dr);
+    NEXT();
+do_AND_REG:
+    regs[op->dr] = regs[op->sr1] & regs[op->sr2];
+    update_flags(vm, op->dr);
+    NEXT();
+do_AND_IMM:
+    regs[op->dr] = regs[op->sr1] & op->imm;
+    update_flags(vm, op->dr);
+    NEXT();
+do_NOT:
+    regs[op->dr] = ~regs[op->sr1];
+    update_flags(vm, op->dr);
+    NEXT();
+do_BR:
+    if (op->dr & regs[R_COND]) { JUMP(op->imm); }
+    NEXT();
+do_RET:
+do_JMP: {
+    uint16_t target = regs[op->sr1];
+    n = DONE;
+    regs[R_PC] = target;
+    // RET back to vmtoy_call()? That's the end of the call.
+    if (unlikely(target == VMTOY_CALL_RETURN) && vm->call_depth) {
+        vm->exit = VMTOY_EXIT_RETURN;
+    }
+    goto enter;
+}
+do_JSR:
+    regs[R_R7] = (uint16_t)(PC_OF(op) + 1);
+    JUMP(op->imm);
+do_JSRR: {
+    // The target first: JSRR R7 jumps to the *old* R7.
+    uint16_t target = regs[op->sr1];
+    regs[R_R7] = (uint16_t)(PC_OF(op) + 1);
+    JUMP(target);
+}
+do_LD:
+    LOAD(op->dr, op->imm);
+    update_flags(vm, op->dr);
+    NEXT();
+do_LDI: {
+    // A pointer from the device page can ask us to wait as well, and then the access
+    // it points at mustn't happen: the retry reads the pointer again.
+    uint16_t address = mem_read(vm, op->imm);
+    if (unlikely(vm->exit == VMTOY_EXIT_BLOCKED)) { goto stop; }
+    LOAD(op->dr, address);
+    update_flags(vm, op->dr);
+    goto check;
+}
+do_LDR:
+    LOAD(op->dr, regs[op->sr1] + op->imm);
+    update_flags(vm, op->dr);
+    NEXT();
+do_LEA:
+    regs[op->dr] = op->imm;
+    update_flags(vm, op->dr);
+    NEXT();
+do_ST:
+    STORE(op->imm, regs[op->dr]);
+    NEXT();
+do_STI: {
+    uint16_t address = mem_read(vm, op->imm);
+    if (unlikely(vm->exit == VMTOY_EXIT_BLOCKED)) { goto stop; }
+    STORE(address, regs[op->dr]);
+    goto check;
+}
+do_STR:
+    STORE(regs[op->sr1] + op->imm, regs[op->dr]);
+    NEXT();
+do_TRAP: {
+    // The handler may do anything at all, including things that make us forget this
+    // page, so everything we need from the op comes out first.
+    uint16_t instr = op->instr;
+    uint16_t pc = PC_OF(op);
+    n = DONE;
+    regs[R_PC] = (uint16_t)(pc + 1);
+    regs[R_R7] = (uint16_t)(pc + 1);
+    int reason = do_trap(vm, instr, icount + n - 1);
+    if (reason) {
+        vm->exit = reason;
+    }
+    if (unlikely(vm->exit == VMTOY_EXIT_BLOCKED)) {
+        regs[R_PC] = pc;
+        vm->traps[isa_trapvect8(instr)].count--;
+        --n;
+    }
+    goto enter;
+}
+do_RTI:
+do_RES:
+do_NOP:
+    NEXT();
+next_page:
+    n += (uint64_t)(op - entry);
+    regs[R_PC] = (uint16_t)(cp->base + PAGE_WORDS);
+    goto enter;
+
+check:
+    if (unlikely(__atomic_load_n(&vm->exit, __ATOMIC_RELAXED))) { goto stop; }
+    // Something made us forget a page, maybe this one: look it up again.
+    if (unlikely(code->stale)) {
+        code->stale = 0;
+        JUMP((uint16_t)(PC_OF(op) + 1));
+    }
+    NEXT();
+
+stop:
+    if (vm->exit == VMTOY_EXIT_BLOCKED) {
+        // Not done yet: come back to this instruction next time around.
+        regs[R_PC] = PC_OF(op);
+        n += (uint64_t)(op - entry);
+    } else {
+        regs[R_PC] = (uint16_t)(PC_OF(op) + 1);
+        n = DONE;
+    }
+
+out:
+    if (--code->running == 0) {
+        code->stale = 0;
+        bury(code);
+    }
+    return n;
+#undef DONE
+#undef PC_OF
+#undef NEXT
+#undef JUMP
+#undef LOAD
+#undef STORE
+}
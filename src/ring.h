@@ -0,0 +1,90 @@
+#ifndef VMTOY_RING_H
+#define VMTOY_RING_H
+
+// A bounded single-producer/single-consumer queue of words.
+// No locks: the producer only ever moves `tail`, the consumer only ever moves `head`,
+// and each side keeps a stale copy of the other's index so it only has to look at
+// the other side's cache line when it thinks the ring is full (or empty).
+// Everything is offsets, no pointers, so a ring can live in shared memory too.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_CACHELINE 64
+
+struct ring {
+    // Consumer's side.
+    uint32_t head;
+    uint32_t tail_cache;
+    char pad0[RING_CACHELINE - 2 * sizeof(uint32_t)];
+    // Producer's side.
+    uint32_t tail;
+    uint32_t head_cache;
+    char pad1[RING_CACHELINE - 2 * sizeof(uint32_t)];
+    // Never changes after ring_init().
+    uint32_t mask;
+    char pad2[RING_CACHELINE - sizeof(uint32_t)];
+    uint16_t slot[];
+};
+
+// Rounds the capacity up to a power of two, because masking beats dividing.
+static inline uint32_t ring_capacity(uint32_t capacity)
+{
+    uint32_t c = 1;
+    while (c < capacity && c < (1u << 30)) {
+        c <<= 1;
+    }
+    return c;
+}
+
+static inline size_t ring_size(uint32_t capacity)
+{
+    return sizeof(struct ring) + ring_capacity(capacity) * sizeof(uint16_t);
+}
+
+static inline void ring_init(struct ring* r, uint32_t capacity)
+{
+    r->head = r->tail = 0;
+    r->tail_cache = r->head_cache = 0;
+    r->mask = ring_capacity(capacity) - 1;
+}
+
+static inline int ring_push(struct ring* r, uint16_t w)
+{
+    uint32_t tail = r->tail;
+    if (tail - r->head_cache > r->mask) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail - r->head_cache > r->mask) { return 0; }
+    }
+    r->slot[tail & r->mask] = w;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline int ring_pop(struct ring* r, uint16_t* w)
+{
+    uint32_t head = r->head;
+    if (head == r->tail_cache) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == r->tail_cache) { return 0; }
+    }
+    *w = r->slot[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// These two are for either side (or a bystander) to peek with. The answer
+// can be out of date by the time you act on it, but only in the safe direction
+// for the side that asked: a consumer never sees more than is there, a producer
+// never sees more room than there is.
+static inline uint32_t ring_count(const struct ring* r)
+{
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t ring_space(const struct ring* r)
+{
+    return r->mask + 1 - ring_count(r);
+}
+
+#endif
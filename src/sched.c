@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "internal.h"
+
+// The scheduler
+// Runs a bunch of VMs on the calling thread, a quantum at a time, round robin.
+// A VM that comes back blocked is parked: we don't run it again until whatever it
+// is waiting for (mailbox, keyboard...) is ready, so a consumer waiting on an empty
+// mailbox costs nothing while its producer gets on with filling it.
+
+#define SCHED_DEFAULT_QUANTUM (1 << 14)
+
+enum { VM_RUNNABLE, VM_PARKED, VM_DONE };
+
+struct sched_entry {
+    vmtoy* vm;
+    int state;
+    int exit;
+    uint64_t parked_at; // When it last went to VM_PARKED, in ns.
+};
+
+struct vmtoy_sched {
+    struct sched_entry* vms;
+    unsigned count;
+    unsigned cap;
+    uint64_t quantum;
+    int stop;
+    vmtoy_dedup* dedup;  // If set, one VM gets scanned after every round.
+    unsigned dedup_next;
+    uint64_t hibernate_after; // ns a VM waits for a key before we pack it away, 0 = never.
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+vmtoy_sched* vmtoy_sched_create(void)
+{
+    vmtoy_sched* s = calloc(1, sizeof(*s));
+    if (!s) { return NULL; }
+    s->quantum = SCHED_DEFAULT_QUANTUM;
+    return s;
+}
+
+void vmtoy_sched_destroy(vmtoy_sched* s)
+{
+    if (!s) { return; }
+    free(s->vms);
+    free(s);
+}
+
+int vmtoy_sched_add(vmtoy_sched* s, vmtoy* vm)
+{
+    if (s->count == s->cap) {
+        unsigned cap = s->cap ? s->cap * 2 : 8;
+        struct sched_entry* vms = realloc(s->vms, cap * sizeof(*vms));
+        if (!vms) { return 0; }
+        s->vms = vms;
+        s->cap = cap;
+    }
+    s->vms[s->count].vm = vm;
+    s->vms[s->count].state = VM_RUNNABLE;
+    s->vms[s->count].exit = VMTOY_EXIT_BUDGET;
+    s->count++;
+    return 1;
+}
+
+void vmtoy_sched_set_quantum(vmtoy_sched* s, uint64_t instructions)
+{
+    s->quantum = instructions ? instructions : SCHED_DEFAULT_QUANTUM;
+}
+
+void vmtoy_sched_set_dedup(vmtoy_sched* s, vmtoy_dedup* d)
+{
+    s->dedup = d;
+    s->dedup_next = 0;
+}
+
+void vmtoy_sched_set_hibernate(vmtoy_sched* s, unsigned idle_ms)
+{
+    s->hibernate_after = (uint64_t)idle_ms * 1000000u;
+}
+
+int vmtoy_sched_exit(const vmtoy_sched* s, unsigned index)
+{
+    return index < s->count ? s->vms[index].exit : VMTOY_EXIT_STOPPED;
+}
+
+void vmtoy_sched_stop(vmtoy_sched* s)
+{
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < s->count; ++i) {
+        vmtoy_stop(s->vms[i].vm);
+    }
+}
+
+int vmtoy_sched_run(vmtoy_sched* s)
+{
+    for (;;) {
+        unsigned live = 0, ran = 0, outside = 0;
+        uint64_t now = s->hibernate_after ? now_ns() : 0;
+
+        for (unsigned i = 0; i < s->count; ++i) {
+            struct sched_entry* e = &s->vms[i];
+            if (e->state == VM_DONE) { continue; }
+            live++;
+
+            if (e->state == VM_PARKED) {
+                if (!vm_ready(e->vm)) {
+                    // Waiting on the outside world, not on another VM here.
+                    if (e->vm->wait == WAIT_INPUT || e->vm->wait == WAIT_OUTPUT) { outside++; }
+                    // Been waiting for a key long enough? Pack it away until one comes
+                    // (vmtoy_run_for() unpacks it).
+                    if (e->vm->wait == WAIT_INPUT && s->hibernate_after && !e->vm->hib
+                        && now - e->parked_at >= s->hibernate_after) {
+                        vmtoy_hibernate(e->vm);
+                    }
+                    continue;
+                }
+                e->state = VM_RUNNABLE;
+            }
+
+            int reason = vmtoy_run_for(e->vm, s->quantum);
+            ran++;
+            if (reason == VMTOY_EXIT_BUDGET) { continue; }
+            if (reason == VMTOY_EXIT_BLOCKED) {
+                e->state = VM_PARKED;
+                e->parked_at = now;
+                continue;
+            }
+            e->state = VM_DONE;
+            e->exit = reason;
+        }
+
+        // Nobody's running right now, so it's safe to look at somebody's pages.
+        if (s->dedup && s->count) {
+            if (s->dedup_next >= s->count) { s->dedup_next = 0; }
+            unsigned i = s->dedup_next++;
+            dedup_scan_vm(s->dedup, s->vms[i].vm, s->dedup_next == s->count);
+        }
+
+        if (__atomic_load_n(&s->stop, __ATOMIC_RELAXED)) {
+            s->stop = 0;
+            return VMTOY_EXIT_STOPPED;
+        }
+        if (live == 0) {
+            return VMTOY_EXIT_HALT;
+        }
+        if (ran == 0) {
+            // Everybody is parked. If some of them are waiting on the outside world
+            // we nap and look again; if they're only waiting on each other, nobody
+            // is ever going to move.
+            if (!outside) {
+                return VMTOY_EXIT_BLOCKED;
+            }
+            struct timespec nap = { 0, 1000000 };
+            nanosleep(&nap, NULL);
+        }
+    }
+}
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "ring.h"
+
+// Shared-memory I/O
+// Bots that play a game through a pty pay for a write(), the terminal layer and a
+// read() on every key, and the same again for every byte that comes back. Here the
+// keyboard and the console are two rings (ring.h) in a named POSIX shared memory
+// segment instead: the driver pushes keys into one and pops output from the other,
+// the VM does the opposite through its ordinary I/O callbacks. KBSR, KBDR, GETC and OUT
+// all end up as a ring_pop()/ring_push(), so there isn't a system call anywhere on the
+// path, and a round trip is as fast as the two sides notice each other.
+//
+// The segment:
+//   struct shm_io_header, then the input ring, then the output ring, each on its own
+//   cache lines.
+// Either side can close its direction: the reader sees end of input (or of output)
+// once it has taken everything that was sent before that.
+//
+// It's created mode 0600, and anything that can open it can type into the VM and
+// scribble on the rings, so only hand the name to processes you trust that much.
+
+#define SHM_MAGIC "VMTOYSHM"
+#define SHM_VERSION 1
+
+struct shm_io_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;      // Of each ring, in bytes.
+    uint32_t input_closed;  // The driver won't send any more keys.
+    uint32_t output_closed; // The VM has finished with the console.
+    char pad[RING_CACHELINE - 8 - 4 * sizeof(uint32_t)];
+};
+
+struct vmtoy_shm_io {
+    struct shm_io_header* hdr;
+    struct ring* in;        // Keys, driver to VM.
+    struct ring* out;       // Console, VM to driver.
+    size_t size;
+    char* name;             // Set on the side that created it, which unlinks it.
+};
+
+static size_t ring_bytes(uint32_t capacity)
+{
+    size_t n = ring_size(capacity);
+    return (n + RING_CACHELINE - 1) & ~(size_t)(RING_CACHELINE - 1);
+}
+
+static size_t shm_bytes(uint32_t capacity)
+{
+    return sizeof(struct shm_io_header) + 2 * ring_bytes(capacity);
+}
+
+static vmtoy_shm_io* shm_map(int fd, size_t size)
+{
+    vmtoy_shm_io* s = calloc(1, sizeof(*s));
+    if (!s) { return NULL; }
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        free(s);
+        return NULL;
+    }
+    s->hdr = p;
+    s->size = size;
+    return s;
+}
+
+static void shm_rings(vmtoy_shm_io* s)
+{
+    char* base = (char*)s->hdr + sizeof(struct shm_io_header);
+    s->in = (struct ring*)base;
+    s->out = (struct ring*)(base + ring_bytes(s->hdr->capacity));
+}
+
+vmtoy_shm_io* vmtoy_shm_io_create(const char* name, uint32_t capacity)
+{
+    if (capacity == 0) { capacity = 4096; }
+    capacity = ring_capacity(capacity);
+    size_t size = shm_bytes(capacity);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) { return NULL; }
+    vmtoy_shm_io* s = NULL;
+    if (ftruncate(fd, (off_t)size) == 0) { s = shm_map(fd, size); }
+    close(fd);
+    if (!s || !(s->name = strdup(name))) {
+        if (s) {
+            munmap(s->hdr, size);
+            free(s);
+        }
+        shm_unlink(name);
+        return NULL;
+    }
+
+    s->hdr->version = SHM_VERSION;
+    s->hdr->capacity = capacity;
+    shm_rings(s);
+    ring_init(s->in, capacity);
+    ring_init(s->out, capacity);
+    // The magic goes in last, so a driver that opens it too early sees it isn't ready.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(s->hdr->magic, SHM_MAGIC, sizeof(s->hdr->magic));
+    return s;
+}
+
+vmtoy_shm_io* vmtoy_shm_io_open(const char* name)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) { return NULL; }
+    struct shm_io_header h;
+    vmtoy_shm_io* s = NULL;
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h)
+        && memcmp(h.magic, SHM_MAGIC, sizeof(h.magic)) == 0 && h.version == SHM_VERSION
+        && h.capacity && ring_capacity(h.capacity) == h.capacity) {
+        s = shm_map(fd, shm_bytes(h.capacity));
+    }
+    close(fd);
+    if (!s) { return NULL; }
+    // Whatever it says now is what we mapped for.
+    if (s->hdr->capacity != h.capacity) {
+        vmtoy_shm_io_close(s);
+        return NULL;
+    }
+    shm_rings(s);
+    return s;
+}
+
+void vmtoy_shm_io_close(vmtoy_shm_io* s)
+{
+    if (!s) { return; }
+    if (s->name) {
+        // The VM's side: the driver hears it's over, and the name goes away.
+        __atomic_store_n(&s->hdr->output_closed, 1, __ATOMIC_RELEASE);
+        shm_unlink(s->name);
+        free(s->name);
+    } else {
+        __atomic_store_n(&s->hdr->input_closed, 1, __ATOMIC_RELEASE);
+    }
+    munmap(s->hdr, s->size);
+    free(s);
+}
+
+// The VM's callbacks.
+static int shm_read(void* ctx)
+{
+    vmtoy_shm_io* s = ctx;
+    uint16_t w;
+    if (ring_pop(s->in, &w)) { return w & 0xFF; }
+    // Closed only counts once it's empty; look once more in case the last keys went
+    // in just before it closed.
+    if (__atomic_load_n(&s->hdr->input_closed, __ATOMIC_ACQUIRE)) {
+        return ring_pop(s->in, &w) ? (w & 0xFF) : VMTOY_IO_EOF;
+    }
+    return VMTOY_IO_AGAIN;
+}
+
+static int shm_poll(void* ctx)
+{
+    vmtoy_shm_io* s = ctx;
+    return ring_count(s->in) != 0 || __atomic_load_n(&s->hdr->input_closed, __ATOMIC_ACQUIRE);
+}
+
+static int shm_write(void* ctx, int ch)
+{
+    vmtoy_shm_io* s = ctx;
+    return ring_push(s->out, (uint16_t)ch) ? 0 : VMTOY_IO_AGAIN;
+}
+
+void vmtoy_shm_io_attach(vmtoy_shm_io* s, vmtoy* vm)
+{
+    vmtoy_io io = { shm_read, shm_poll, shm_write, NULL, s };
+    vmtoy_set_io(vm, &io);
+}
+
+// The driver's side.
+size_t vmtoy_shm_io_send(vmtoy_shm_io* s, const void* buf, size_t size)
+{
+    const uint8_t* p = buf;
+    size_t n = 0;
+    while (n < size && ring_push(s->in, p[n])) { n++; }
+    return n;
+}
+
+size_t vmtoy_shm_io_recv(vmtoy_shm_io* s, void* buf, size_t size)
+{
+    uint8_t* p = buf;
+    size_t n = 0;
+    uint16_t w;
+    while (n < size && ring_pop(s->out, &w)) { p[n++] = (uint8_t)w; }
+    return n;
+}
+
+int vmtoy_shm_io_finished(vmtoy_shm_io* s)
+{
+    return __atomic_load_n(&s->hdr->output_closed, __ATOMIC_ACQUIRE) && ring_count(s->out) == 0;
+}
@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "internal.h"
+
+// Multiprocessor mode
+// One memory, N sets of registers, N host threads. All the sharing happens
+// through memory and the atomic device registers (see mmio_write()), so the
+// harts themselves are just ordinary VMs pointed at the same array.
+
+// How many instructions a hart runs between checks for being told to stop.
+#define HART_QUANTUM (1 << 16)
+
+struct vmtoy_smp {
+    unsigned nharts;
+    uint16_t* memory;
+    vmtoy** harts;
+    int* exits;
+};
+
+vmtoy_smp* vmtoy_smp_create(unsigned nharts, unsigned flags)
+{
+    if (nharts == 0 || nharts > 0xFFFF) { return NULL; }
+
+    vmtoy_smp* smp = calloc(1, sizeof(*smp));
+    if (!smp) { return NULL; }
+    smp->nharts = nharts;
+    smp->memory = calloc(VMTOY_MEMORY_WORDS, sizeof(uint16_t));
+    smp->harts = calloc(nharts, sizeof(vmtoy*));
+    smp->exits = calloc(nharts, sizeof(int));
+    if (!smp->memory || !smp->harts || !smp->exits) {
+        vmtoy_smp_destroy(smp);
+        return NULL;
+    }
+
+    // A hart can't see the others' stores, so it couldn't tell when to decode its code
+    // again. One on its own can.
+    if (nharts > 1) { flags &= ~(unsigned)VMTOY_F_PREDECODE; }
+    for (unsigned i = 0; i < nharts; ++i) {
+        vmtoy* hart = vm_new(flags, smp->memory, MEM_BORROWED);
+        if (!hart) {
+            vmtoy_smp_destroy(smp);
+            return NULL;
+        }
+        hart->hart_id = (uint16_t)i;
+        hart->nharts = (uint16_t)nharts;
+        smp->harts[i] = hart;
+    }
+    return smp;
+}
+
+void vmtoy_smp_destroy(vmtoy_smp* smp)
+{
+    if (!smp) { return; }
+    if (smp->harts) {
+        for (unsigned i = 0; i < smp->nharts; ++i) {
+            vmtoy_destroy(smp->harts[i]);
+        }
+    }
+    free(smp->harts);
+    free(smp->exits);
+    free(smp->memory);
+    free(smp);
+}
+
+unsigned vmtoy_smp_nharts(const vmtoy_smp* smp)
+{
+    return smp->nharts;
+}
+
+vmtoy* vmtoy_smp_hart(vmtoy_smp* smp, unsigned hart)
+{
+    return hart < smp->nharts ? smp->harts[hart] : NULL;
+}
+
+int vmtoy_smp_exit(const vmtoy_smp* smp, unsigned hart)
+{
+    return hart < smp->nharts ? smp->exits[hart] : VMTOY_EXIT_STOPPED;
+}
+
+void vmtoy_smp_stop(vmtoy_smp* smp)
+{
+    for (unsigned i = 0; i < smp->nharts; ++i) {
+        vmtoy_stop(smp->harts[i]);
+    }
+}
+
+struct hart_job {
+    vmtoy* hart;
+    int* exit;
+};
+
+static void* hart_thread(void* arg)
+{
+    struct hart_job* job = arg;
+    int reason;
+    for (;;) {
+        reason = vmtoy_run_for(job->hart, HART_QUANTUM);
+        if (reason == VMTOY_EXIT_BUDGET) { continue; }
+        // Waiting on I/O: let the other threads get on with it and try again.
+        if (reason == VMTOY_EXIT_BLOCKED) {
+            sched_yield();
+            continue;
+        }
+        break;
+    }
+    *job->exit = reason;
+    return NULL;
+}
+
+int vmtoy_smp_run(vmtoy_smp* smp)
+{
+    pthread_t* threads = calloc(smp->nharts, sizeof(pthread_t));
+    struct hart_job* jobs = calloc(smp->nharts, sizeof(struct hart_job));
+    if (!threads || !jobs) {
+        free(threads);
+        free(jobs);
+        return 0;
+    }
+
+    unsigned started = 0;
+    for (; started < smp->nharts; ++started) {
+        jobs[started].hart = smp->harts[started];
+        jobs[started].exit = &smp->exits[started];
+        if (pthread_create(&threads[started], NULL, hart_thread, &jobs[started]) != 0) {
+            break;
+        }
+    }
+    // Couldn't get them all going: stop the ones that did start.
+    int ok = started == smp->nharts;
+    if (!ok) {
+        vmtoy_smp_stop(smp);
+    }
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(jobs);
+    return ok;
+}
@@ -0,0 +1,203 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "snapshot.h"
+
+// Snapshots
+// A whole VM in a file: one page of header (registers, devices, flags), then the
+// memory exactly as the VM sees it, starting on a page boundary so it can be paged
+// straight in. Everything is in host byte order; the header says which that was.
+//
+// Restoring reads the header and then either copies the memory in (eager) or maps it
+// empty and lets uffd.c fill pages in as the VM touches them (lazy), so a VM that
+// only looks at 6 KB of its memory only ever reads 6 KB of its snapshot.
+
+int write_all(int fd, const void* buf, size_t size, off_t offset)
+{
+    const uint8_t* p = buf;
+    while (size) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 1;
+}
+
+int read_all(int fd, void* buf, size_t size, off_t offset)
+{
+    uint8_t* p = buf;
+    while (size) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n <= 0) { return 0; }
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 1;
+}
+
+int vmtoy_snapshot_write(const vmtoy* vm, int fd)
+{
+    uint8_t* page = calloc(1, SNAP_HEADER_BYTES);
+    uint16_t* memory = malloc(MEMORY_BYTES);
+    if (!page || !memory) {
+        free(page);
+        free(memory);
+        return 0;
+    }
+
+    struct snap_header h;
+    snap_header_fill(&h, vm);
+    memcpy(page, &h, sizeof(h));
+    mem_copy_out(vm, memory);
+
+    int ok = write_all(fd, page, SNAP_HEADER_BYTES, 0)
+          && write_all(fd, memory, MEMORY_BYTES, SNAP_HEADER_BYTES);
+    free(page);
+    free(memory);
+    return ok;
+}
+
+// The snapshot goes in under a temporary name and is renamed over `path`, so the old
+// one is never half overwritten. That matters beyond crashes: a VM lazily restored
+// from `path` is still paging from it, and truncating it would hand it zeros.
+int vmtoy_snapshot_save(const vmtoy* vm, const char* path)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) { return 0; }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { return 0; }
+    int ok = vmtoy_snapshot_write(vm, fd);
+    if (close(fd) != 0) { ok = 0; }
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) { unlink(tmp); }
+    return ok;
+}
+
+void snap_header_fill(struct snap_header* h, const vmtoy* vm)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+    h->version = SNAP_VERSION;
+    h->endian = SNAP_ENDIAN;
+    h->header_bytes = SNAP_HEADER_BYTES;
+    h->memory_bytes = (uint32_t)MEMORY_BYTES;
+    h->flags = vm->flags;
+    memcpy(h->regs, vm->regs, sizeof(h->regs));
+    h->kbsr = vm->kbsr;
+    h->kbdr = vm->kbdr;
+    h->out_pos = vm->out_pos;
+    h->icount = vm->icount;
+    h->memory_hash = vm->state_hash;
+}
+
+void snap_state_save(struct snap_state* st, const vmtoy* vm)
+{
+    memcpy(st->regs, vm->regs, sizeof(st->regs));
+    st->kbsr = vm->kbsr;
+    st->kbdr = vm->kbdr;
+    st->out_pos = vm->out_pos;
+    st->reserved = 0;
+    st->icount = vm->icount;
+}
+
+void snap_state_apply(vmtoy* vm, const struct snap_state* st)
+{
+    memcpy(vm->regs, st->regs, sizeof(vm->regs));
+    vm->kbsr = st->kbsr;
+    vm->kbdr = st->kbdr;
+    vm->out_pos = st->out_pos;
+    vm->icount = st->icount;
+}
+
+// The hash comes from the header too: working it out would read every page, which is
+// exactly what a lazy restore is trying not to do.
+static void snap_header_apply(vmtoy* vm, const struct snap_header* h)
+{
+    memcpy(vm->regs, h->regs, sizeof(vm->regs));
+    vm->kbsr = h->kbsr;
+    vm->kbdr = h->kbdr;
+    vm->out_pos = h->out_pos;
+    vm->icount = h->icount;
+    if (h->version >= 2) {
+        vm->state_hash = h->memory_hash;
+    } else {
+        mem_rehash(vm);
+    }
+}
+
+// Reads and checks the header.
+int snap_header_read(int fd, struct snap_header* h)
+{
+    if (!read_all(fd, h, sizeof(*h), 0)) { return 0; }
+    return memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) == 0
+        && h->version >= 1 && h->version <= SNAP_VERSION
+        && h->endian == SNAP_ENDIAN
+        && h->header_bytes >= sizeof(*h)
+        && h->header_bytes % 4096 == 0
+        && h->memory_bytes == MEMORY_BYTES;
+}
+
+// The whole memory in at once, then page by page into the VM (so a sparse VM only
+// keeps what's non-zero).
+static vmtoy* restore_eager(int fd, const struct snap_header* h)
+{
+    vmtoy* vm = vm_new(h->flags, NULL, MEM_HEAP);
+    uint16_t* memory = malloc(MEMORY_BYTES);
+    int ok = vm && memory && read_all(fd, memory, MEMORY_BYTES, h->header_bytes);
+    for (unsigned p = 0; ok && p < PAGE_COUNT; ++p) {
+        const uint16_t* src = memory + (p << PAGE_SHIFT);
+        if (vm->mem_kind == MEM_SPARSE && mem_page_is_zero(src)) { continue; }
+        uint16_t* dst = mem_page_for_write(vm, p);
+        if (!dst) {
+            ok = 0;
+            break;
+        }
+        memcpy(dst, src, PAGE_WORDS * sizeof(uint16_t));
+    }
+    free(memory);
+    if (!ok) {
+        vmtoy_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+vmtoy* vmtoy_snapshot_restore(const char* path, unsigned how)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return NULL; }
+
+    struct snap_header h;
+    if (!snap_header_read(fd, &h)) {
+        close(fd);
+        return NULL;
+    }
+
+    if (how == VMTOY_RESTORE_LAZY) {
+        // Lazy VMs are flat: the mapping is the memory. The file stays open for the pager.
+        struct uffd_range* r = uffd_map(fd, h.header_bytes);
+        if (r) {
+            vmtoy* vm = vm_new(h.flags & ~(unsigned)VMTOY_F_SPARSE_MEMORY, uffd_memory(r), MEM_LAZY);
+            if (!vm) {
+                uffd_unmap(r);
+                return NULL;
+            }
+            vm->lazy = r;
+            snap_header_apply(vm, &h);
+            return vm;
+        }
+        // No userfaultfd here: do it the slow way.
+    }
+
+    vmtoy* vm = restore_eager(fd, &h);
+    close(fd);
+    if (vm) { snap_header_apply(vm, &h); }
+    return vm;
+}
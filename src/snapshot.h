@@ -0,0 +1,48 @@
+#ifndef VMTOY_SNAPSHOT_H
+#define VMTOY_SNAPSHOT_H
+
+// The on-disk formats shared by snapshot.c and checkpoint.c.
+
+#include "internal.h"
+
+#define SNAP_MAGIC "VMTOYSNP"
+// Version 2 added memory_hash. Version 1 snapshots still restore; their hash gets
+// worked out the long way.
+#define SNAP_VERSION 2
+#define SNAP_ENDIAN 0x0102
+#define SNAP_HEADER_BYTES 4096
+
+struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint16_t endian;
+    uint16_t reserved;
+    uint32_t header_bytes; // Where memory starts in the file.
+    uint32_t memory_bytes;
+    uint32_t flags;        // The VM's VMTOY_F_* flags.
+    uint16_t regs[R_COUNT];
+    uint16_t kbsr;
+    uint16_t kbdr;
+    uint16_t out_pos;
+    uint16_t reserved2;
+    uint64_t icount;
+    uint64_t memory_hash;  // The VM's state_hash, for VMTOY_F_STATE_HASH VMs.
+};
+
+// Everything about a VM but its memory, for records that come after a snapshot.
+struct snap_state {
+    uint16_t regs[R_COUNT];
+    uint16_t kbsr;
+    uint16_t kbdr;
+    uint16_t out_pos;
+    uint16_t reserved;
+    uint64_t icount;
+};
+
+int write_all(int fd, const void* buf, size_t size, off_t offset);
+void snap_header_fill(struct snap_header* h, const vmtoy* vm);
+int snap_header_read(int fd, struct snap_header* h);
+void snap_state_save(struct snap_state* st, const vmtoy* vm);
+void snap_state_apply(vmtoy* vm, const struct snap_state* st);
+
+#endif
@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+// Image templates
+// Loading (and maybe booting) the same program for the hundredth session is a waste:
+// do it once, freeze the memory in a sealed memfd, and map it privately into every new
+// VM. The kernel shares the pages until a guest writes one, so each session only pays
+// for what it changes, and making one costs a single mmap().
+
+struct vmtoy_template {
+    int fd;
+    unsigned flags;
+    uint16_t regs[R_COUNT];
+    uint16_t kbsr;
+    uint16_t kbdr;
+    uint64_t state_hash;  // Handed down as is: VMs start with the template's memory.
+};
+
+vmtoy_template* vmtoy_template_create(const vmtoy* vm)
+{
+    vmtoy_template* t = calloc(1, sizeof(*t));
+    if (!t) { return NULL; }
+
+    t->fd = memfd_create("vmtoy-template", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (t->fd < 0) {
+        free(t);
+        return NULL;
+    }
+
+    // Copy the memory in through a shared mapping, then drop it so the memfd can be
+    // sealed: nobody gets to change a template once VMs are running off it.
+    void* p = MAP_FAILED;
+    if (ftruncate(t->fd, MEMORY_BYTES) == 0) {
+        p = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+    }
+    if (p == MAP_FAILED) {
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+    mem_copy_out(vm, p);
+    munmap(p, MEMORY_BYTES);
+    // A template that didn't get sealed could change under the VMs using it, so
+    // there isn't one.
+    if (fcntl(t->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(t->fd);
+        free(t);
+        return NULL;
+    }
+
+    // Template VMs are always flat: their memory is the mapping.
+    t->flags = vm->flags & ~VMTOY_F_SPARSE_MEMORY;
+    memcpy(t->regs, vm->regs, sizeof(t->regs));
+    t->kbsr = vm->kbsr;
+    t->kbdr = vm->kbdr;
+    t->state_hash = vm->state_hash;
+    return t;
+}
+
+void vmtoy_template_destroy(vmtoy_template* t)
+{
+    if (!t) { return; }
+    // VMs made from it hold their own reference through their mapping.
+    close(t->fd);
+    free(t);
+}
+
+vmtoy* vmtoy_create_from_template(const vmtoy_template* t)
+{
+    void* memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE, t->fd, 0);
+    if (memory == MAP_FAILED) { return NULL; }
+
+    vmtoy* vm = vm_new(t->flags, memory, MEM_MAPPED);
+    if (!vm) {
+        munmap(memory, MEMORY_BYTES);
+        return NULL;
+    }
+    memcpy(vm->regs, t->regs, sizeof(vm->regs));
+    vm->kbsr = t->kbsr;
+    vm->kbdr = t->kbdr;
+    vm->state_hash = t->state_hash;
+    return vm;
+}
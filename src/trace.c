@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+// Trap tracing
+// strace for the guest: a record of every TRAP, put together in two halves. While the
+// program runs, trace_trap() copies what it needs into a fixed-size event in the VM's
+// ring (registers, the clock, the first few characters of a string) and nothing else;
+// turning that into text is vmtoy_trace_format()'s job, whenever the host gets round
+// to it. The ring keeps the newest events: when it fills up the oldest are dropped
+// and counted, so a chatty program can't make the VM wait on whoever is reading.
+//
+// A VM that isn't traced pays one well-predicted branch per TRAP, in do_trap().
+
+struct vm_trace {
+    uint64_t head;        // Events ever written.
+    uint64_t tail;        // Events ever read or dropped.
+    uint64_t dropped;
+    uint64_t start_ns;
+    uint32_t mask;
+    vmtoy_trap_event events[];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+int vmtoy_trace_traps(vmtoy* vm, unsigned capacity)
+{
+    free(vm->trace);
+    vm->trace = NULL;
+    if (capacity == 0) { return 1; }
+
+    uint32_t n = 1;
+    while (n < capacity && n < (1u << 24)) {
+        n <<= 1;
+    }
+    struct vm_trace* t = calloc(1, sizeof(*t) + n * sizeof(t->events[0]));
+    if (!t) { return 0; }
+    t->mask = n - 1;
+    t->start_ns = now_ns();
+    vm->trace = t;
+    return 1;
+}
+
+// The string PUTS or PUTSP is about to print, as far as the event has room for.
+static void copy_text(vmtoy* vm, vmtoy_trap_event* e, int packed)
+{
+    uint16_t addr = vm->regs[R_R0];
+    unsigned len = 0;
+    for (;;) {
+        uint16_t w = mem_peek(vm, addr++);
+        if (!w) { break; }
+        char c[2] = { (char)(w & 0xFF), (char)(w >> 8) };
+        for (unsigned i = 0; i < (packed && c[1] ? 2u : 1u); ++i) {
+            if (len == sizeof(e->text)) {
+                e->flags |= VMTOY_TRACE_TRUNCATED;
+                e->text_len = (uint8_t)len;
+                return;
+            }
+            e->text[len++] = c[i];
+        }
+    }
+    e->text_len = (uint8_t)len;
+}
+
+// do_trap() for a traced VM: the handler, with an event on either side of it.
+int trace_trap(vmtoy* vm, struct trap_slot* slot, uint16_t instr, uint64_t icount)
+{
+    struct vm_trace* t = vm->trace;
+    uint8_t vector = (uint8_t)isa_trapvect8(instr);
+    vmtoy_trap_event e;
+    e.icount = icount;
+    e.time_ns = now_ns() - t->start_ns;
+    e.pc = (uint16_t)(vm->regs[R_PC] - 1);
+    e.vector = vector;
+    e.r0 = vm->regs[R_R0];
+    e.flags = 0;
+    e.text_len = 0;
+    if (vector == TRAP_PUTS || vector == TRAP_PUTSP) {
+        copy_text(vm, &e, vector == TRAP_PUTSP);
+    }
+
+    int reason = slot->fn(vm, vector, slot->ctx);
+    // A TRAP that has to wait runs again from the top, and gets its event then.
+    if (reason == VMTOY_EXIT_BLOCKED) { return reason; }
+    e.r0_out = vm->regs[R_R0];
+    e.result = reason;
+
+    if (t->head - t->tail > t->mask) {
+        t->tail++;
+        t->dropped++;
+    }
+    t->events[t->head++ & t->mask] = e;
+    return reason;
+}
+
+size_t vmtoy_trace_read(vmtoy* vm, vmtoy_trap_event* events, size_t max)
+{
+    struct vm_trace* t = vm->trace;
+    size_t n = 0;
+    if (!t) { return 0; }
+    for (; n < max && t->tail != t->head; ++n) {
+        events[n] = t->events[t->tail++ & t->mask];
+    }
+    return n;
+}
+
+uint64_t vmtoy_trace_dropped(const vmtoy* vm)
+{
+    return vm->trace ? vm->trace->dropped : 0;
+}
+
+// The text, quoted the way strace does it.
+static int format_text(const vmtoy_trap_event* e, char* out, size_t size)
+{
+    size_t len = 0;
+    out[len++] = '"';
+    for (unsigned i = 0; i < e->text_len && len + 5 < size; ++i) {
+        unsigned char c = (unsigned char)e->text[i];
+        const char* esc = c == '\n' ? "\\n" : c == '\r' ? "\\r" : c == '\t' ? "\\t"
+                        : c == '"' ? "\\\"" : c == '\\' ? "\\\\" : NULL;
+        if (esc) {
+            len += (size_t)snprintf(out + len, size - len, "%s", esc);
+        } else if (c < 0x20 || c >= 0x7F) {
+            len += (size_t)snprintf(out + len, size - len, "\\x%02x", c);
+        } else {
+            out[len++] = (char)c;
+        }
+    }
+    len += (size_t)snprintf(out + len, size - len, "\"%s", e->flags & VMTOY_TRACE_TRUNCATED ? "..." : "");
+    return (int)len;
+}
+
+int vmtoy_trace_format(const vmtoy* vm, const vmtoy_trap_event* e, char* buf, size_t size)
+{
+    char name[16];
+    const char* registered = vmtoy_trap_name(vm, e->vector);
+    if (registered) {
+        snprintf(name, sizeof(name), "%s", registered);
+    } else {
+        snprintf(name, sizeof(name), "TRAP x%02X", e->vector);
+    }
+
+    char arg[4 * sizeof(e->text) + 16];
+    int len = snprintf(arg, sizeof(arg), "x%04X", e->r0);
+    if (e->vector == TRAP_PUTS || e->vector == TRAP_PUTSP) {
+        arg[len++] = ' ';
+        format_text(e, arg + len, sizeof(arg) - (size_t)len);
+    } else if (e->vector == TRAP_OUT && e->r0 >= 0x20 && e->r0 < 0x7F) {
+        snprintf(arg + len, sizeof(arg) - (size_t)len, " '%c'", (char)e->r0);
+    }
+
+    char result[48];
+    if (e->result) {
+        snprintf(result, sizeof(result), "x%04X (%s)", e->r0_out, vmtoy_exit_string(e->result));
+    } else if (e->r0_out >= 0x20 && e->r0_out < 0x7F && e->r0_out != e->r0) {
+        snprintf(result, sizeof(result), "x%04X '%c'", e->r0_out, (char)e->r0_out);
+    } else {
+        snprintf(result, sizeof(result), "x%04X", e->r0_out);
+    }
+
+    return snprintf(buf, size, "%llu.%06llu #%llu x%04X %s(%s) = %s",
+                    (unsigned long long)(e->time_ns / 1000000000u),
+                    (unsigned long long)(e->time_ns % 1000000000u / 1000),
+                    (unsigned long long)e->icount, e->pc, name, arg, result);
+}
@@ -0,0 +1,147 @@
+#include "internal.h"
+
+// Trap handlers
+// Every TRAP vector (all 256 of them) gets a slot in the VM's trap table.
+// Want a new host service (math, storage, whatever)? Write a vmtoy_trap_fn and call
+// vmtoy_trap_register() before the VM starts. No need to touch the dispatch loop.
+
+static int trap_unknown(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    // Quietly carry on like nothing happened, unless asked to be strict.
+    return (vm->flags & VMTOY_F_STRICT_TRAPS) ? VMTOY_EXIT_BAD_TRAP : 0;
+}
+
+static int input_blocked(vmtoy* vm)
+{
+    vm->wait = WAIT_INPUT;
+    return VMTOY_EXIT_BLOCKED;
+}
+
+static int output_blocked(vmtoy* vm)
+{
+    vm->wait = WAIT_OUTPUT;
+    return VMTOY_EXIT_BLOCKED;
+}
+
+// Printing a guest string one character at a time. If the output side fills up
+// halfway, remember how far we got so the retried TRAP picks up from there.
+static int put_string(vmtoy* vm, int packed)
+{
+    uint16_t addr = vm->regs[R_R0] + vm->out_pos;
+    for (;;) {
+        uint16_t w = mem_peek(vm, addr);
+        if (!w) { break; }
+
+        int lo = w & 0xFF;
+        int hi = packed ? w >> 8 : 0;
+        // A packed word whose first half already went out only owes us the second half.
+        if (!(vm->out_pos & 0x8000)) {
+            if (vm->io.write(vm->io.ctx, lo) == VMTOY_IO_AGAIN) { return output_blocked(vm); }
+        }
+        if (hi) {
+            if (vm->io.write(vm->io.ctx, hi) == VMTOY_IO_AGAIN) {
+                vm->out_pos |= 0x8000;
+                return output_blocked(vm);
+            }
+        }
+        vm->out_pos = (vm->out_pos & 0x7FFF) + 1;
+        addr++;
+    }
+    vm->out_pos = 0;
+    if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+    return 0;
+}
+
+static int trap_getc(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    int ch = vm->io.read(vm->io.ctx);
+    if (ch == VMTOY_IO_AGAIN) { return input_blocked(vm); }
+    if (ch == VMTOY_IO_EOF) { return VMTOY_EXIT_INPUT_EOF; }
+    vm->regs[R_R0] = (uint16_t)ch;
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+static int trap_out(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    if (vm->io.write(vm->io.ctx, vm->regs[R_R0] & 0xFF) == VMTOY_IO_AGAIN) {
+        return output_blocked(vm);
+    }
+    if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+    return 0;
+}
+
+static int trap_puts(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    return put_string(vm, 0);
+}
+
+static int trap_in(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    // The prompt only goes out once, even if we end up waiting for the key.
+    static const char prompt[] = "Enter a character: ";
+    for (; vm->out_pos < sizeof(prompt) - 1; vm->out_pos++) {
+        if (vm->io.write(vm->io.ctx, prompt[vm->out_pos]) == VMTOY_IO_AGAIN) { return output_blocked(vm); }
+    }
+    if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+
+    int ch = vm->io.read(vm->io.ctx);
+    if (ch == VMTOY_IO_AGAIN) { return input_blocked(vm); }
+    vm->out_pos = 0;
+    if (ch == VMTOY_IO_EOF) { return VMTOY_EXIT_INPUT_EOF; }
+
+    vm->io.write(vm->io.ctx, ch);
+    if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+    vm->regs[R_R0] = (uint16_t)ch;
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+static int trap_putsp(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    return put_string(vm, 1);
+}
+
+static int trap_halt(vmtoy* vm, uint8_t vector, void* ctx)
+{
+    static const char msg[] = "HALT\n";
+    for (; vm->out_pos < sizeof(msg) - 1; vm->out_pos++) {
+        if (vm->io.write(vm->io.ctx, msg[vm->out_pos]) == VMTOY_IO_AGAIN) { return output_blocked(vm); }
+    }
+    vm->out_pos = 0;
+    if (vm->io.flush) { vm->io.flush(vm->io.ctx); }
+    return VMTOY_EXIT_HALT;
+}
+
+void vmtoy_trap_register(vmtoy* vm, uint8_t vector, const char* name, vmtoy_trap_fn fn, void* ctx)
+{
+    struct trap_slot* t = &vm->traps[vector];
+    t->fn = fn ? fn : trap_unknown;
+    t->ctx = fn ? ctx : NULL;
+    t->name = fn ? name : NULL;
+}
+
+const char* vmtoy_trap_name(const vmtoy* vm, uint8_t vector)
+{
+    return vm->traps[vector].name;
+}
+
+uint64_t vmtoy_trap_count(const vmtoy* vm, uint8_t vector)
+{
+    return vm->traps[vector].count;
+}
+
+// Start with every vector pointing at trap_unknown, then plug in the standard ones.
+void trap_init(vmtoy* vm)
+{
+    for (int v = 0; v < 256; ++v) {
+        vmtoy_trap_register(vm, (uint8_t)v, NULL, NULL, NULL);
+        vm->traps[v].count = 0;
+    }
+    vmtoy_trap_register(vm, TRAP_GETC, "GETC", trap_getc, NULL);
+    vmtoy_trap_register(vm, TRAP_OUT, "OUT", trap_out, NULL);
+    vmtoy_trap_register(vm, TRAP_PUTS, "PUTS", trap_puts, NULL);
+    vmtoy_trap_register(vm, TRAP_IN, "IN", trap_in, NULL);
+    vmtoy_trap_register(vm, TRAP_PUTSP, "PUTSP", trap_putsp, NULL);
+    vmtoy_trap_register(vm, TRAP_HALT, "HALT", trap_halt, NULL);
+}
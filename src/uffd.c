@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+// Demand paging for lazy snapshot restores
+// A lazily restored VM gets an empty anonymous mapping registered with userfaultfd.
+// The first touch of each host page stops the toucher, and the pager thread below
+// reads that page out of the snapshot file and drops it in with UFFDIO_COPY. Pages the
+// VM never looks at are never read.
+//
+// One userfaultfd and one pager thread serve every lazy VM in the process; they're
+// started the first time somebody asks and stay for good, like the arena.
+// If any of it isn't available (old kernel, no permission) uffd_map() says so and the
+// snapshot code falls back to reading everything up front.
+
+struct uffd_range {
+    char* base;
+    int fd;
+    off_t offset;      // Where the memory starts in the file.
+    uint32_t loaded;   // Host pages filled in so far.
+    struct uffd_range* next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int state;         // 0 = not tried yet, 1 = running, -1 = not available.
+    int fd;
+    long page_size;
+    struct uffd_range* ranges;
+} pager = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static void pager_fault(uint64_t address, char* buf)
+{
+    char* page = (char*)(uintptr_t)(address & ~(uint64_t)(pager.page_size - 1));
+
+    pthread_mutex_lock(&pager.lock);
+    struct uffd_range* r = pager.ranges;
+    while (r && !(page >= r->base && page < r->base + MEMORY_BYTES)) { r = r->next; }
+
+    // A page we can't read comes in as zeros rather than leaving the VM stuck.
+    size_t size = (size_t)pager.page_size;
+    if (!r || !read_all(r->fd, buf, size, r->offset + (page - r->base))) {
+        memset(buf, 0, size);
+    }
+    struct uffdio_copy copy = {
+        .dst = (uint64_t)(uintptr_t)page,
+        .src = (uint64_t)(uintptr_t)buf,
+        .len = size,
+        .mode = 0,
+    };
+    // Counted before the copy, which wakes the toucher up, so it never sees a stale count.
+    // EEXIST means somebody beat us to it.
+    if (r) { __atomic_add_fetch(&r->loaded, 1, __ATOMIC_RELAXED); }
+    if (ioctl(pager.fd, UFFDIO_COPY, &copy) != 0 && r) {
+        __atomic_sub_fetch(&r->loaded, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pager.lock);
+}
+
+static void* pager_thread(void* arg)
+{
+    char* buf = arg;
+    struct pollfd pfd = { .fd = pager.fd, .events = POLLIN };
+    for (;;) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+        struct uffd_msg msg[16];
+        ssize_t n = read(pager.fd, msg, sizeof(msg));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) { continue; }
+            break;
+        }
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(msg[0]); ++i) {
+            if (msg[i].event == UFFD_EVENT_PAGEFAULT) {
+                pager_fault(msg[i].arg.pagefault.address, buf);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Called with the lock held.
+static int pager_start(void)
+{
+    if (pager.state) { return pager.state > 0; }
+    pager.state = -1;
+
+#ifdef UFFD_USER_MODE_ONLY
+    // Only our own accesses fault, which is all we need and doesn't need privileges.
+    pager.fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (pager.fd < 0)
+#endif
+    pager.fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (pager.fd < 0) { return 0; }
+
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    pager.page_size = sysconf(_SC_PAGESIZE);
+    char* buf = malloc((size_t)pager.page_size);
+    pthread_t thread;
+    if (ioctl(pager.fd, UFFDIO_API, &api) != 0 || !buf
+        || MEMORY_BYTES % (size_t)pager.page_size != 0
+        || pthread_create(&thread, NULL, pager_thread, buf) != 0) {
+        free(buf);
+        close(pager.fd);
+        pager.fd = -1;
+        return 0;
+    }
+    pthread_detach(thread);
+    pager.state = 1;
+    return 1;
+}
+
+// An empty guest memory that fills itself in from `fd` at `offset`. Takes over the fd
+// if it works; NULL (fd untouched) if it doesn't.
+struct uffd_range* uffd_map(int fd, off_t offset)
+{
+    struct uffd_range* r = calloc(1, sizeof(*r));
+    if (!r) { return NULL; }
+
+    pthread_mutex_lock(&pager.lock);
+    if (!pager_start()) {
+        pthread_mutex_unlock(&pager.lock);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_unlock(&pager.lock);
+
+    r->base = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->base == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    // Fault (and load) in small pages, not 2 MB at a time.
+#ifdef MADV_NOHUGEPAGE
+    madvise(r->base, MEMORY_BYTES, MADV_NOHUGEPAGE);
+#endif
+    struct uffdio_register reg = {
+        .range = { .start = (uint64_t)(uintptr_t)r->base, .len = MEMORY_BYTES },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(pager.fd, UFFDIO_REGISTER, &reg) != 0) {
+        munmap(r->base, MEMORY_BYTES);
+        free(r);
+        return NULL;
+    }
+    r->fd = fd;
+    r->offset = offset;
+
+    pthread_mutex_lock(&pager.lock);
+    r->next = pager.ranges;
+    pager.ranges = r;
+    pthread_mutex_unlock(&pager.lock);
+    return r;
+}
+
+uint16_t* uffd_memory(struct uffd_range* r)
+{
+    return (uint16_t*)r->base;
+}
+
+// munmap() unregisters the range for us.
+void uffd_unmap(struct uffd_range* r)
+{
+    pthread_mutex_lock(&pager.lock);
+    struct uffd_range** link = &pager.ranges;
+    while (*link != r) { link = &(*link)->next; }
+    *link = r->next;
+    pthread_mutex_unlock(&pager.lock);
+
+    munmap(r->base, MEMORY_BYTES);
+    close(r->fd);
+    free(r);
+}
+
+size_t uffd_loaded_bytes(const struct uffd_range* r)
+{
+    return (size_t)__atomic_load_n(&r->loaded, __ATOMIC_RELAXED) * (size_t)pager.page_size;
+}
@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+void io_stdio_init(vmtoy_io* io);
+
+// Everything vmtoy_create() does, except that the memory can come from somewhere else.
+// Pass NULL to get fresh zeroed memory (flat or sparse, going by the flags), or some
+// flat memory and where it came from.
+vmtoy* vm_new(unsigned flags, uint16_t* memory, int mem_kind)
+{
+    // The arena can give us the context and a flat memory in one go.
+    int cls = ARENA_NONE;
+    if (flags & VMTOY_F_ARENA) {
+        cls = memory || (flags & VMTOY_F_SPARSE_MEMORY) ? ARENA_VM : ARENA_VM_FLAT;
+    }
+    vmtoy* vm = cls != ARENA_NONE ? arena_alloc(cls) : calloc(1, sizeof(*vm));
+    if (!vm) { return NULL; }
+    vm->arena_cls = cls;
+    vm->flags = flags;
+
+    // This is the VM's RAM. It's just a big array where we store data and code.
+    // Or, if asked to be frugal, a bunch of pages that show up as they get written.
+    if (memory) {
+        mem_init_flat(vm, memory, mem_kind);
+    } else if (flags & VMTOY_F_SPARSE_MEMORY) {
+        mem_init_sparse(vm);
+    } else if (cls == ARENA_VM_FLAT) {
+        mem_init_flat(vm, arena_vm_memory(vm), MEM_ARENA);
+    } else {
+        memory = calloc(VMTOY_MEMORY_WORDS, sizeof(uint16_t));
+        if (!memory) {
+            free(vm);
+            return NULL;
+        }
+        mem_init_flat(vm, memory, MEM_HEAP);
+    }
+
+    if (flags & VMTOY_F_PREDECODE) {
+        vm->code = code_new();
+        if (!vm->code) {
+            vmtoy_destroy(vm);
+            return NULL;
+        }
+    }
+
+    vm->nharts = 1;
+    io_stdio_init(&vm->io);
+    trap_init(vm);
+
+    // Resetting the mood ring (condition flag) and pointing the PC at the usual start.
+    vm->regs[R_COND] = FL_ZRO;
+    vm->regs[R_PC] = VMTOY_PC_START;
+    return vm;
+}
+
+vmtoy* vmtoy_create(unsigned flags)
+{
+    return vm_new(flags, NULL, MEM_HEAP);
+}
+
+void vmtoy_destroy(vmtoy* vm)
+{
+    if (!vm) { return; }
+    mem_release(vm);
+    free(vm->trace);
+    if (vm->code) { code_free(vm); }
+    if (vm->arena_cls != ARENA_NONE) {
+        arena_free(vm->arena_cls, vm);
+    } else {
+        free(vm);
+    }
+}
+
+// Loading the program (ROM image) into memory.
+// First word is where it goes, the rest is the program itself.
+int vmtoy_load_image(vmtoy* vm, const void* image, size_t size)
+{
+    const uint8_t* bytes = image;
+    if (size < 2) { return 0; }
+
+    uint16_t origin = (uint16_t)(bytes[0] << 8 | bytes[1]);
+    size_t words = (size - 2) / 2;
+    size_t max_read = VMTOY_MEMORY_WORDS - origin;
+    if (words > max_read) { words = max_read; }
+
+    const uint8_t* p = bytes + 2;
+    for (size_t i = 0; i < words; ++i, p += 2) {
+        if (!mem_poke(vm, (uint16_t)(origin + i), (uint16_t)(p[0] << 8 | p[1]))) { return 0; }
+    }
+    if (vm->code) { code_loaded(vm, origin); }
+    return 1;
+}
+
+int vmtoy_load_image_file(vmtoy* vm, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) { return 0; }
+
+    // Origin word plus at most a full memory's worth of program.
+    size_t cap = 2 + 2 * (size_t)VMTOY_MEMORY_WORDS;
+    uint8_t* buf = malloc(cap);
+    if (!buf) {
+        fclose(file);
+        return 0;
+    }
+    size_t size = fread(buf, 1, cap, file);
+    fclose(file);
+
+    int ok = vmtoy_load_image(vm, buf, size);
+    free(buf);
+    return ok;
+}
+
+uint16_t vmtoy_reg(const vmtoy* vm, int reg)
+{
+    return (reg >= 0 && reg < R_COUNT) ? vm->regs[reg] : 0;
+}
+
+void vmtoy_set_reg(vmtoy* vm, int reg, uint16_t value)
+{
+    if (reg >= 0 && reg < R_COUNT) {
+        vm->regs[reg] = value;
+    }
+}
+
+uint16_t vmtoy_read_mem(const vmtoy* vm, uint16_t addr)
+{
+    if (unlikely(vm->hib)) { return hib_peek(vm, addr); }
+    return mem_peek(vm, addr);
+}
+
+void vmtoy_write_mem(vmtoy* vm, uint16_t addr, uint16_t value)
+{
+    mem_poke(vm, addr, value);
+}
+
+void vmtoy_stop(vmtoy* vm)
+{
+    __atomic_store_n(&vm->exit, VMTOY_EXIT_STOPPED, __ATOMIC_RELAXED);
+}
+
+uint64_t vmtoy_icount(const vmtoy* vm)
+{
+    return vm->icount;
+}
+
+const char* vmtoy_exit_string(int reason)
+{
+    switch (reason) {
+        case VMTOY_EXIT_BUDGET: return "budget";
+        case VMTOY_EXIT_HALT: return "halt";
+        case VMTOY_EXIT_BAD_TRAP: return "unknown trap";
+        case VMTOY_EXIT_INPUT_EOF: return "end of input";
+        case VMTOY_EXIT_BLOCKED: return "blocked";
+        case VMTOY_EXIT_STOPPED: return "stopped";
+        case VMTOY_EXIT_RETURN: return "returned";
+        case VMTOY_EXIT_TOO_DEEP: return "calls nested too deep";
+        case VMTOY_EXIT_NO_MEMORY: return "out of memory";
+    }
+    return "?";
+}
+
+// The device page.
+// Reading KBSR asks the input side whether a key is waiting and, if so, grabs it
+// into KBDR. The hart and atomic registers are what lets several harts share one
+// memory without stepping on each other's toes. Anything else up here that we
+// don't know about is plain memory.
+uint16_t mmio_read(vmtoy* vm, uint16_t address)
+{
+    switch (address) {
+        case MR_KBSR:
+            if (vm->io.poll(vm->io.ctx)) {
+                int ch = vm->io.read(vm->io.ctx);
+                if (ch >= 0) {
+                    vm->kbsr = 1 << 15;
+                    vm->kbdr = (uint16_t)ch;
+                    return vm->kbsr;
+                }
+                // A program that only ever polls would otherwise wait for more input forever.
+                if (ch == VMTOY_IO_EOF) { vm->exit = VMTOY_EXIT_INPUT_EOF; }
+            }
+            vm->kbsr = 0;
+            return vm->kbsr;
+        case MR_KBDR:
+            return vm->kbdr;
+        case MR_HARTID:
+            return vm->hart_id;
+        case MR_NHARTS:
+            return vm->nharts;
+        case MR_AADDR:
+            return vm->amo_addr;
+        case MR_ARES:
+            return vm->amo_result;
+        case MR_MBSR:
+            return mbox_status(vm);
+        case MR_MBRX:
+            return mbox_receive(vm);
+    }
+    return mem_peek(vm, address);
+}
+
+void mmio_write(vmtoy* vm, uint16_t address, uint16_t val)
+{
+    switch (address) {
+        case MR_KBSR:
+            vm->kbsr = val;
+            return;
+        case MR_KBDR:
+            vm->kbdr = val;
+            return;
+        case MR_HARTID:
+        case MR_NHARTS:
+        case MR_ARES:
+            return;
+        case MR_AADDR:
+            vm->amo_addr = val;
+            return;
+        // Atomics are sequentially consistent: every hart agrees on one order
+        // for all of them, and plain loads/stores don't move across them.
+        case MR_ASWAP:
+        case MR_AADD: {
+            // A read-only window: the old value comes back, and nothing changes.
+            if (vm->page_kind[vm->amo_addr >> PAGE_SHIFT] == PAGE_WINDOW_RO) {
+                vm->amo_result = mem_peek(vm, vm->amo_addr);
+                return;
+            }
+            uint16_t* page = mem_page_for_write(vm, vm->amo_addr >> PAGE_SHIFT);
+            if (!page) {
+                vm->exit = VMTOY_EXIT_NO_MEMORY;
+                return;
+            }
+            uint16_t* word = &page[vm->amo_addr & PAGE_MASK];
+            vm->amo_result = address == MR_ASWAP
+                ? __atomic_exchange_n(word, val, __ATOMIC_SEQ_CST)
+                : __atomic_fetch_add(word, val, __ATOMIC_SEQ_CST);
+            if (vm->flags & VMTOY_F_STATE_HASH) {
+                uint16_t now = address == MR_ASWAP ? val : (uint16_t)(vm->amo_result + val);
+                mem_hash_write(vm, vm->amo_addr, vm->amo_result, now);
+            }
+            return;
+        }
+        case MR_FENCE:
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            return;
+        case MR_MBSR:
+        case MR_MBRX:
+            return;
+        case MR_MBTX:
+            mbox_send(vm, val);
+            return;
+    }
+    mem_poke(vm, address, val);
+}
+
+// The switch interpreter: fetch, decode, execute, one instruction at a time. Inlined
+// into vmtoy_run_for() whatever the compiler thinks, so the plain engine doesn't pay a
+// call for there being another one.
+static inline __attribute__((always_inline)) uint64_t run_switch(vmtoy* vm, uint64_t instructions, uint64_t icount)
+{
+    uint16_t* regs = vm->regs;
+    uint64_t n = 0;
+
+    // Loads from the device page can ask us to wait (an empty mailbox, say). The
+    // destination register has to survive that so the retry sees the same operands.
+#define LOAD(r, address) do { \
+        uint16_t a_ = (address); \
+        uint16_t v_ = mem_read(vm, a_); \
+        if (unlikely(a_ >= MMIO_BASE) && vm->exit == VMTOY_EXIT_BLOCKED) { goto done; } \
+        regs[r] = v_; \
+    } while (0)
+
+    while (n < instructions) {
+        // Fetch the instruction and increment the PC.
+        // "What do I do next?"
+        uint16_t pc = regs[R_PC];
+        uint16_t instr = mem_read(vm, pc);
+        regs[R_PC] = pc + 1;
+        ++n;
+
+        uint16_t op = isa_opcode(instr);
+        uint16_t r0, r1, r2, pcoffset, cond_flag;
+        int reason;
+
+        // This is where the magic happens. We look at the opcode (the first 4 bits)
+        // and decide which operation to execute. It's the heartbeat of the CPU.
+        // The documentation of different op codes can be found online
+        //
+        // The cases come from isa.def, one per opcode, each jumping to its handler
+        // below: give isa.def an opcode and this won't build until it has one.
+        switch (op) {
+#define ISA_OPCODE(name, value, what) case OP_##name: goto op_##name;
+#include "isa.def"
+            op_ADD:
+                r0 = isa_dr(instr);
+                r1 = isa_sr1(instr);
+                if (isa_imm_flag(instr)) {
+                    regs[r0] = regs[r1] + isa_imm5(instr);
+                } else {
+                    r2 = isa_sr2(instr);
+                    regs[r0] = regs[r1] + regs[r2];
+                }
+                update_flags(vm, r0);
+                break;
+            op_AND:
+                r0 = isa_dr(instr);
+                r1 = isa_sr1(instr);
+                if (isa_imm_flag(instr)) {
+                    regs[r0] = regs[r1] & isa_imm5(instr);
+                } else {
+                    r2 = isa_sr2(instr);
+                    regs[r0] = regs[r1] & regs[r2];
+                }
+                update_flags(vm, r0);
+                break;
+            op_NOT:
+                r0 = isa_dr(instr);
+                r1 = isa_sr1(instr);
+                regs[r0] = ~regs[r1];
+                update_flags(vm, r0);
+                break;
+            op_BR:
+                cond_flag = isa_nzp(instr);
+                if (cond_flag & regs[R_COND]) {
+                    regs[R_PC] += isa_pcoffset9(instr);
+                }
+                break;
+            op_JMP:
+                r1 = isa_sr1(instr);
+                regs[R_PC] = regs[r1];
+                // RET back to vmtoy_call()? That's the end of the call.
+                if (unlikely(regs[R_PC] == VMTOY_CALL_RETURN) && vm->call_depth) {
+                    vm->exit = VMTOY_EXIT_RETURN;
+                }
+                break;
+            op_JSR:
+                r1 = isa_sr1(instr);
+                // Read the target first: JSRR R7 jumps to the *old* R7.
+                pcoffset = isa_long_flag(instr)
+                    ? regs[R_PC] + isa_pcoffset11(instr)
+                    : regs[r1];
+                regs[R_R7] = regs[R_PC];
+                regs[R_PC] = pcoffset;
+                break;
+            op_LD:
+                r0 = isa_dr(instr);
+                LOAD(r0, regs[R_PC] + isa_pcoffset9(instr));
+                update_flags(vm, r0);
+                break;
+            op_LDI:
+                r0 = isa_dr(instr);
+                pcoffset = mem_read(vm, regs[R_PC] + isa_pcoffset9(instr));
+                // The pointer can come from the device page too. If that says wait,
+                // the load mustn't happen either: the retry reads the pointer again.
+                if (unlikely(vm->exit == VMTOY_EXIT_BLOCKED)) { goto done; }
+                LOAD(r0, pcoffset);
+                update_flags(vm, r0);
+                break;
+            op_LDR:
+                r0 = isa_dr(instr);
+                r1 = isa_sr1(instr);
+                LOAD(r0, regs[r1] + isa_offset6(instr));
+                update_flags(vm, r0);
+                break;
+            op_LEA:
+                r0 = isa_dr(instr);
+                regs[r0] = regs[R_PC] + isa_pcoffset9(instr);
+                update_flags(vm, r0);
+                break;
+            op_ST:
+                r0 = isa_dr(instr);
+                mem_write(vm, regs[R_PC] + isa_pcoffset9(instr), regs[r0]);
+                break;
+            op_STI:
+                r0 = isa_dr(instr);
+                pcoffset = mem_read(vm, regs[R_PC] + isa_pcoffset9(instr));
+                // As for LDI, and a store that happens twice is worse.
+                if (unlikely(vm->exit == VMTOY_EXIT_BLOCKED)) { goto done; }
+                mem_write(vm, pcoffset, regs[r0]);
+                break;
+            op_STR:
+                r0 = isa_dr(instr);
+                r1 = isa_sr1(instr);
+                mem_write(vm, regs[r1] + isa_offset6(instr), regs[r0]);
+                break;
+            op_TRAP:
+                regs[R_R7] = regs[R_PC];
+                reason = do_trap(vm, instr, icount + n - 1);
+                if (reason) {
+                    vm->exit = reason;
+                }
+                break;
+            op_RES:
+            op_RTI:
+                // Bad OP_CODE todo
+                break;
+        }
+
+    done:
+        if (unlikely(__atomic_load_n(&vm->exit, __ATOMIC_RELAXED))) {
+            if (vm->exit == VMTOY_EXIT_BLOCKED) {
+                // Not done yet: come back to this instruction next time around.
+                regs[R_PC] = pc;
+                if (op == OP_TRAP) {
+                    vm->traps[isa_trapvect8(instr)].count--;
+                }
+                --n;
+            }
+            break;
+        }
+    }
+#undef LOAD
+    return n;
+}
+
+// The same loop, for the predecoding engine to hand over to when it can't use what it
+// has decoded (see predecode.c).
+uint64_t interp_run(vmtoy* vm, uint64_t instructions, uint64_t icount)
+{
+    return run_switch(vm, instructions, icount);
+}
+
+int vmtoy_run_for(vmtoy* vm, uint64_t instructions)
+{
+    // Hibernating? Not any more.
+    if (unlikely(vm->hib) && !vmtoy_wake(vm)) {
+        return VMTOY_EXIT_NO_MEMORY;
+    }
+
+    // A stop that came in while we weren't running still counts, once.
+    if (__atomic_exchange_n(&vm->exit, VMTOY_EXIT_BUDGET, __ATOMIC_RELAXED) == VMTOY_EXIT_STOPPED) {
+        return VMTOY_EXIT_STOPPED;
+    }
+
+    vm->wait = WAIT_NONE;
+
+    uint64_t n = vm->code
+        ? code_run(vm, instructions, vm->icount)
+        : run_switch(vm, instructions, vm->icount);
+    vm->icount += n;
+    // Monitors get the registers between runs, never in the middle of one.
+    if (unlikely(vm->mon != NULL)) { monitor_update(vm); }
+    return vm->exit;
+}
@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+
+static void make_file(const char* dir, const char* name, time_t age)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    if (fd < 0) { return; }
+    CHECK(write(fd, "torn", 4) == 4);
+    struct timespec times[2] = { { time(NULL) - age, 0 }, { time(NULL) - age, 0 } };
+    CHECK(futimens(fd, times) == 0);
+    close(fd);
+}
+
+static int file_exists(const char* dir, const char* name)
+{
+    char path[4096];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0;
+}
+
+// What a store that died halfway leaves behind goes once it's old, and not before:
+// another process might still be writing a young one.
+static void stale_temporaries(const char* dir)
+{
+    make_file(dir, "0123.res.99.1.tmp", 3600);
+    make_file(dir, "0123.res.99.2.tmp", 0);
+    vmtoy_cache* c = vmtoy_cache_open(dir, 1 << 20);
+    CHECK(c != NULL);
+    CHECK(!file_exists(dir, "0123.res.99.1.tmp"));
+    CHECK(file_exists(dir, "0123.res.99.2.tmp"));
+    vmtoy_cache_close(c);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/0123.res.99.2.tmp", dir);
+    unlink(path);
+}
+
+// A job without input can leave `input` NULL, and it still caches.
+static void job_without_input(const char* dir)
+{
+    vmtoy_cache* c = vmtoy_cache_open(dir, 1 << 20);
+    CHECK(c != NULL);
+    if (!c) { return; }
+    const void* images[] = { store_seven };
+    size_t sizes[] = { sizeof(store_seven) };
+    vmtoy_job job = { images, sizes, 1, NULL, 0, 0, 1000 };
+
+    for (int run = 0; run < 2; ++run) {
+        vmtoy_job_result r;
+        CHECK(vmtoy_job_run(&job, c, &r));
+        CHECK(r.exit == VMTOY_EXIT_HALT);
+        CHECK(r.cached == run);
+        vmtoy_job_result_free(&r);
+    }
+    vmtoy_cache_close(c);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/vmtoy-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    stale_temporaries(dir);
+    job_without_input(dir);
+
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd) != 0) { fprintf(stderr, "couldn't remove %s\n", dir); }
+    return check_result();
+}
@@ -0,0 +1,36 @@
+#ifndef VMTOY_TESTS_CHECK_H
+#define VMTOY_TESTS_CHECK_H
+
+#include <stdio.h>
+
+#include "vmtoy.h"
+
+// Just enough scaffolding for the tests: CHECK() says what didn't hold and where, and
+// the test carries on so one run shows everything that's wrong. main() returns
+// check_result() at the end.
+static int check_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++check_failures; \
+        } \
+    } while (0)
+
+static inline int check_result(void)
+{
+    return check_failures ? 1 : 0;
+}
+
+// x3000: LD R0, VAL / STI R0, ADDR / HALT / ADDR .FILL x5000 / VAL .FILL 7
+static const uint8_t store_seven[] = {
+    0x30, 0x00,
+    0x20, 0x03, 0xB0, 0x01, 0xF0, 0x25, 0x50, 0x00, 0x00, 0x07,
+};
+
+// HALT says so on the console; the tests don't need to hear it.
+static inline int quiet_read(void* ctx) { return VMTOY_IO_EOF; }
+static inline int quiet_write(void* ctx, int ch) { return 0; }
+static const vmtoy_io quiet_io = { quiet_read, quiet_read, quiet_write, NULL, NULL };
+
+#endif
@@ -0,0 +1,124 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+#include "hash.h"
+#include "internal.h"
+
+static long file_size(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// A record that only half makes it into the log (the disk filled up, say) mustn't
+// cost the ones that make it in after it. A file size limit does the tearing.
+static void torn_record(const char* base, const char* log)
+{
+    vmtoy* vm = vmtoy_create(0);
+    vmtoy_checkpoint* c = vmtoy_checkpoint_start(vm, base, log, 0);
+    CHECK(c != NULL);
+    if (!c) { return; }
+
+    vmtoy_write_mem(vm, 0x4000, 3);
+    CHECK(vmtoy_checkpoint_write(c));
+    long good = file_size(log);
+
+    struct rlimit old, limit;
+    CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+    limit = old;
+    limit.rlim_cur = (rlim_t)good + 100;
+    signal(SIGXFSZ, SIG_IGN);
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    vmtoy_write_mem(vm, 0x5000, 4);
+    CHECK(!vmtoy_checkpoint_write(c));
+    CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+    CHECK(file_size(log) == good);
+
+    // Still dirty, so it goes again with the next one.
+    vmtoy_write_mem(vm, 0x6000, 5);
+    CHECK(vmtoy_checkpoint_write(c));
+    vmtoy_checkpoint_close(c);
+    vmtoy_destroy(vm);
+
+    vm = vmtoy_checkpoint_restore(base, log, VMTOY_RESTORE_EAGER);
+    CHECK(vm != NULL);
+    if (!vm) { return; }
+    CHECK(vmtoy_read_mem(vm, 0x4000) == 3);
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 4);
+    CHECK(vmtoy_read_mem(vm, 0x6000) == 5);
+    vmtoy_destroy(vm);
+}
+
+// A log can't be trusted to name pages that exist, hash or no hash (it's only there to
+// catch accidents). Give the last record the first page past the end, hashed properly
+// so it looks whole, and it has to be turned away rather than written through.
+static void page_out_of_range(const char* base, const char* log)
+{
+    vmtoy* vm = vmtoy_create(0);
+    vmtoy_checkpoint* c = vmtoy_checkpoint_start(vm, base, log, 0);
+    CHECK(c != NULL);
+    if (!c) { return; }
+    vmtoy_write_mem(vm, 0x4000, 3);
+    CHECK(vmtoy_checkpoint_write(c));
+    vmtoy_write_mem(vm, 0x4001, 4);
+    CHECK(vmtoy_checkpoint_write(c));
+    vmtoy_checkpoint_close(c);
+    vmtoy_destroy(vm);
+
+    // The last record has one page, so it ends { page, pad, words }, hash.
+    long size = file_size(log);
+    uint8_t* bytes = malloc((size_t)size);
+    int fd = open(log, O_RDWR);
+    CHECK(bytes && fd >= 0 && pread(fd, bytes, (size_t)size, 0) == size);
+    size_t page_words = 2 + PAGE_WORDS;
+    size_t hash_at = (size_t)size - sizeof(uint64_t);
+    size_t page_at = hash_at - page_words * sizeof(uint16_t);
+    size_t record_at = (size_t)size / 2;  // Both records are the same size.
+    uint16_t page = PAGE_COUNT;
+    memcpy(bytes + page_at, &page, sizeof(page));
+    uint64_t hash = hash_words((const uint16_t*)(bytes + record_at), (hash_at - record_at) / 2,
+                               0x434B5054);
+    memcpy(bytes + hash_at, &hash, sizeof(hash));
+    CHECK(pwrite(fd, bytes, (size_t)size, 0) == size);
+    close(fd);
+    free(bytes);
+
+    vm = vmtoy_checkpoint_restore(base, log, VMTOY_RESTORE_EAGER);
+    CHECK(vm != NULL);
+    if (vm) {
+        CHECK(vmtoy_read_mem(vm, 0x4000) == 3);
+        CHECK(vmtoy_read_mem(vm, 0x4001) == 0);
+        // One past the end of rd[] is wr[0], so that page would land on page 0.
+        CHECK(vmtoy_read_mem(vm, 0x0000) == 0);
+        vmtoy_destroy(vm);
+    }
+    CHECK(vmtoy_checkpoint_compact(base, log));
+}
+
+int main(void)
+{
+    char base[] = "/tmp/vmtoy-test-XXXXXX";
+    char log[] = "/tmp/vmtoy-test-XXXXXX";
+    int fd1 = mkstemp(base);
+    int fd2 = mkstemp(log);
+    if (fd1 < 0 || fd2 < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd1);
+    close(fd2);
+
+    torn_record(base, log);
+    page_out_of_range(base, log);
+
+    unlink(base);
+    unlink(log);
+    return check_result();
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Checks on the lc3-vm command itself. `./build.sh test` runs it from the top of the
+# tree, with the command to check as its argument.
+set -e
+vm=${1:-./lc3-vm}
+
+# How much guest memory a run of Rogue ends up with. With no input it gets as far as
+# its first GETC and stops there.
+footprint() {
+    "$vm" --footprint "$@" apps/rogue_vm.obj < /dev/null 2>&1 > /dev/null \
+        | sed -n 's/^memory \([0-9]*\) bytes$/\1/p'
+}
+
+flat=$(footprint)
+sparse=$(footprint --sparse)
+arena=$(footprint --arena)
+echo "footprint: flat $flat, sparse $sparse, arena $arena"
+[ "$flat" = 131072 ] || { echo "a flat VM should have all 128 KB"; exit 1; }
+[ "$sparse" -gt 0 ] && [ "$sparse" -lt "$flat" ] || { echo "--sparse didn't shrink memory"; exit 1; }
+[ "$arena" = "$flat" ] || { echo "--arena should have flat memory"; exit 1; }
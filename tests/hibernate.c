@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+#include "internal.h"
+
+static long file_size(const char* path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Checkpointing a VM that naps in between. Whatever it writes after waking has to
+// make it into the next record, and so does what it wrote before the nap.
+static void checkpoint_across_hibernation(const char* base, const char* log, int wake_first)
+{
+    vmtoy* vm = vmtoy_create(0);
+    vmtoy_set_io(vm, &quiet_io);
+    CHECK(vmtoy_load_image(vm, store_seven, sizeof(store_seven)));
+    vmtoy_checkpoint* c = vmtoy_checkpoint_start(vm, base, log, 0);
+    CHECK(c != NULL);
+    if (!c) { return; }
+
+    vmtoy_write_mem(vm, 0x6000, 5);
+    CHECK(vmtoy_hibernate(vm));
+    // Running wakes it up by itself; this is the explicit way.
+    if (wake_first) { CHECK(vmtoy_wake(vm)); }
+    CHECK(vmtoy_run_for(vm, 100) == VMTOY_EXIT_HALT);
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 7);
+    CHECK(vmtoy_checkpoint_write(c));
+
+    // Waking mustn't make everything else dirty too: that record has the two pages
+    // the program wrote and not the one its code is on. The records don't say how
+    // many pages they hold from the outside, so weigh it against one with one page.
+    long first = file_size(log);
+    vmtoy_write_mem(vm, 0x7000, 9);
+    CHECK(vmtoy_checkpoint_write(c));
+    long second = file_size(log) - first;
+    CHECK(first - second == (long)(sizeof(uint32_t) + PAGE_WORDS * sizeof(uint16_t)));
+    vmtoy_checkpoint_close(c);
+    vmtoy_destroy(vm);
+
+    vm = vmtoy_checkpoint_restore(base, log, VMTOY_RESTORE_EAGER);
+    CHECK(vm != NULL);
+    if (!vm) { return; }
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 7);
+    CHECK(vmtoy_read_mem(vm, 0x6000) == 5);
+    CHECK(vmtoy_read_mem(vm, 0x7000) == 9);
+    vmtoy_destroy(vm);
+}
+
+int main(void)
+{
+    char base[] = "/tmp/vmtoy-test-XXXXXX";
+    char log[] = "/tmp/vmtoy-test-XXXXXX";
+    int fd1 = mkstemp(base);
+    int fd2 = mkstemp(log);
+    if (fd1 < 0 || fd2 < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd1);
+    close(fd2);
+
+    checkpoint_across_hibernation(base, log, 1);
+    checkpoint_across_hibernation(base, log, 0);
+
+    unlink(base);
+    unlink(log);
+    return check_result();
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "check.h"
+
+// Every engine and both directions of the assembler lean on isa.def, so it had better
+// hold together: the test vectors come out right, every one of the 65536 words
+// disassembles to something that assembles back to it, and the two engines do the
+// same thing with each of them.
+
+static void test_vectors(void)
+{
+    char text[32];
+    uint16_t word;
+    for (unsigned f = 0; f < ISA_FORM_COUNT; ++f) {
+        const struct isa_form_info* form = &isa_forms[f];
+        if (isa_form_of(form->example) != f || !vmtoy_assemble(form->text, &word)
+            || word != form->example) {
+            fprintf(stderr, "isa.def: %s's example doesn't match \"%s\"\n", form->name, form->text);
+            ++check_failures;
+        }
+        vmtoy_disassemble(form->example, text, sizeof(text));
+        if (strcmp(text, form->text) != 0) {
+            fprintf(stderr, "isa.def: %s's example disassembles to \"%s\"\n", form->name, text);
+            ++check_failures;
+        }
+    }
+}
+
+static void round_trip(void)
+{
+    char text[32];
+    uint16_t word;
+    for (unsigned w = 0; w <= 0xFFFF; ++w) {
+        vmtoy_disassemble((uint16_t)w, text, sizeof(text));
+        if (!vmtoy_assemble(text, &word) || word != w) {
+            fprintf(stderr, "isa.def: x%04X disassembles to \"%s\", which doesn't assemble back\n",
+                    w, text);
+            ++check_failures;
+        }
+    }
+}
+
+// Each word runs at x3000 with the same registers on a switch VM and a predecoding
+// one, followed by a HALT. The budget is big enough for the predecoder to use its
+// decoded page rather than hand a short run back to the switch. Both keep a state
+// hash, so comparing memory after every word costs nothing.
+static void engines_agree(void)
+{
+    static const uint16_t start[R_COUNT] = {
+        0x0001, 0x3004, 0x8000, 0x7FFF, 0x4000, 0x3100, 0xFFFF, 0x3002, 0x3000, FL_ZRO,
+    };
+    vmtoy* vm[2] = {
+        vmtoy_create(VMTOY_F_STATE_HASH),
+        vmtoy_create(VMTOY_F_STATE_HASH | VMTOY_F_PREDECODE),
+    };
+    for (unsigned i = 0; i < 2; ++i) {
+        vmtoy_set_io(vm[i], &quiet_io);
+        vmtoy_write_mem(vm[i], 0x3001, 0xF025);
+    }
+    unsigned mismatches = 0;
+    for (unsigned w = 0; w <= 0xFFFF && mismatches < 10; ++w) {
+        int exit[2];
+        for (unsigned i = 0; i < 2; ++i) {
+            for (unsigned r = 0; r < R_COUNT; ++r) { vmtoy_set_reg(vm[i], (int)r, start[r]); }
+            vmtoy_write_mem(vm[i], 0x3000, (uint16_t)w);
+            exit[i] = vmtoy_run_for(vm[i], 4 * PAGE_WORDS);
+        }
+        int same = exit[0] == exit[1] && vmtoy_icount(vm[0]) == vmtoy_icount(vm[1])
+                && vmtoy_state_hash(vm[0]) == vmtoy_state_hash(vm[1]);
+        if (!same) {
+            char text[32];
+            vmtoy_disassemble((uint16_t)w, text, sizeof(text));
+            fprintf(stderr, "x%04X (%s) runs differently on the two engines\n", w, text);
+            ++check_failures;
+            ++mismatches;
+        }
+    }
+    vmtoy_destroy(vm[0]);
+    vmtoy_destroy(vm[1]);
+}
+
+int main(void)
+{
+    test_vectors();
+    round_trip();
+    engines_agree();
+    return check_result();
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+
+#include "vmtoy.h"
+#include "check.h"
+
+// xFDF0: LDI R0, xFE22 / STI R1, xFE22 / HALT
+// Right under the device page, so the pointers LDI and STI go through are the
+// mailbox's receive register itself.
+static const uint8_t indirect_mbox[] = {
+    0xFD, 0xF0,
+    0xA0, 0x31, 0xB2, 0x30, 0xF0, 0x25,
+};
+
+// An empty mailbox makes the guest wait, and the instruction runs again from the
+// start once there's a word. Everything it did the first time has to have not
+// happened: LDI's destination keeps its value, and STI doesn't store anywhere.
+static void indirect_through_empty_mailbox(unsigned flags)
+{
+    vmtoy* vm = vmtoy_create(flags);
+    vmtoy_mbox* mb = vmtoy_mbox_create(4);
+    CHECK(vm && mb);
+    if (!vm || !mb) { return; }
+    vmtoy_set_io(vm, &quiet_io);
+    vmtoy_mbox_connect(vm, mb, NULL);
+    CHECK(vmtoy_load_image(vm, indirect_mbox, sizeof(indirect_mbox)));
+    vmtoy_write_mem(vm, 0x4000, 3);
+    vmtoy_set_reg(vm, VMTOY_PC, 0xFDF0);
+    vmtoy_set_reg(vm, VMTOY_R0, 0x1111);
+    vmtoy_set_reg(vm, VMTOY_R1, 0x2222);
+
+    CHECK(vmtoy_run_for(vm, 1024) == VMTOY_EXIT_BLOCKED);
+    CHECK(vmtoy_reg(vm, VMTOY_PC) == 0xFDF0);
+    CHECK(vmtoy_reg(vm, VMTOY_R0) == 0x1111);
+
+    CHECK(vmtoy_mbox_send(mb, 0x4000));
+    CHECK(vmtoy_run_for(vm, 1024) == VMTOY_EXIT_BLOCKED);
+    CHECK(vmtoy_reg(vm, VMTOY_PC) == 0xFDF1);
+    CHECK(vmtoy_reg(vm, VMTOY_R0) == 3);
+    CHECK(vmtoy_read_mem(vm, 0x0000) == 0);
+
+    CHECK(vmtoy_mbox_send(mb, 0x5000));
+    CHECK(vmtoy_run_for(vm, 1024) == VMTOY_EXIT_HALT);
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 0x2222);
+    CHECK(vmtoy_read_mem(vm, 0x0000) == 0);
+
+    vmtoy_destroy(vm);
+    vmtoy_mbox_destroy(mb);
+}
+
+int main(void)
+{
+    indirect_through_empty_mailbox(0);
+    indirect_through_empty_mailbox(VMTOY_F_PREDECODE);
+    return check_result();
+}
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+
+// Migrating a VM that hibernates halfway through. The pre-copy passes go by the dirty
+// bits, so waking up must not lose them, and stores made after waking must go again.
+static void migrate_across_hibernation(int fd, int wake_first)
+{
+    vmtoy* vm = vmtoy_create(0);
+    vmtoy_set_io(vm, &quiet_io);
+    CHECK(vmtoy_load_image(vm, store_seven, sizeof(store_seven)));
+    vmtoy_write_mem(vm, 0x4000, 3);
+
+    // A file stands in for the socket, so nobody has to read while we write.
+    CHECK(ftruncate(fd, 0) == 0);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    vmtoy_migration* m = vmtoy_migrate_start(vm, fd);
+    CHECK(m != NULL);
+    if (!m) { return; }
+    CHECK(vmtoy_migrate_step(m, 0));
+    CHECK(vmtoy_migrate_pending(m) == 0);
+
+    // Dirty before the nap, written after it.
+    vmtoy_write_mem(vm, 0x6000, 5);
+    CHECK(vmtoy_hibernate(vm));
+    if (wake_first) { CHECK(vmtoy_wake(vm)); }
+    CHECK(vmtoy_run_for(vm, 100) == VMTOY_EXIT_HALT);
+    CHECK(vmtoy_migrate_step(m, 0));
+    CHECK(vmtoy_migrate_finish(m));
+    vmtoy_destroy(vm);
+
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    vm = vmtoy_migrate_receive(fd);
+    CHECK(vm != NULL);
+    if (!vm) { return; }
+    CHECK(vmtoy_read_mem(vm, 0x4000) == 3);
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 7);
+    CHECK(vmtoy_read_mem(vm, 0x6000) == 5);
+    vmtoy_destroy(vm);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/vmtoy-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+
+    migrate_across_hibernation(fd, 1);
+    migrate_across_hibernation(fd, 0);
+
+    close(fd);
+    return check_result();
+}
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+
+// Saving a lazily restored VM over the snapshot it came from. The VM is still paging
+// from that file, so the save must not disturb it until the new one is complete.
+static void save_over_own_snapshot(const char* path)
+{
+    vmtoy* vm = vmtoy_create(0);
+    // Far apart, so each one is on a page of its own.
+    vmtoy_write_mem(vm, 0x0100, 1);
+    vmtoy_write_mem(vm, 0x5000, 7);
+    vmtoy_write_mem(vm, 0xC000, 9);
+    vmtoy_set_reg(vm, VMTOY_R3, 42);
+    CHECK(vmtoy_snapshot_save(vm, path));
+    vmtoy_destroy(vm);
+
+    // Nothing touched before saving: every page still has to come from the file.
+    vm = vmtoy_snapshot_restore(path, VMTOY_RESTORE_LAZY);
+    CHECK(vm != NULL);
+    if (!vm) { return; }
+    CHECK(vmtoy_snapshot_save(vm, path));
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 7);
+    vmtoy_destroy(vm);
+
+    vm = vmtoy_snapshot_restore(path, VMTOY_RESTORE_EAGER);
+    CHECK(vm != NULL);
+    if (!vm) { return; }
+    CHECK(vmtoy_read_mem(vm, 0x0100) == 1);
+    CHECK(vmtoy_read_mem(vm, 0x5000) == 7);
+    CHECK(vmtoy_read_mem(vm, 0xC000) == 9);
+    CHECK(vmtoy_reg(vm, VMTOY_R3) == 42);
+    vmtoy_destroy(vm);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/vmtoy-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    save_over_own_snapshot(path);
+
+    unlink(path);
+    return check_result();
+}
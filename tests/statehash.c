@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmtoy.h"
+#include "check.h"
+
+// A VM with VMTOY_F_STATE_HASH keeps its hash up to date as it goes; every way of
+// making one out of another has to hand the hash over too, and without reading all
+// of memory to do it where that's the point (lazy restores).
+
+static vmtoy* hashed_vm(void)
+{
+    vmtoy* vm = vmtoy_create(VMTOY_F_STATE_HASH);
+    vmtoy_set_io(vm, &quiet_io);
+    CHECK(vmtoy_load_image(vm, store_seven, sizeof(store_seven)));
+    vmtoy_write_mem(vm, 0x0100, 1);
+    vmtoy_write_mem(vm, 0xC000, 9);
+    return vm;
+}
+
+// What the hash should be: a VM without the flag works it out from scratch.
+static uint64_t full_hash(const vmtoy* vm)
+{
+    vmtoy* copy = vmtoy_create(0);
+    for (uint32_t a = 0; a < 0xFE00; ++a) {
+        uint16_t v = vmtoy_read_mem(vm, (uint16_t)a);
+        if (v) { vmtoy_write_mem(copy, (uint16_t)a, v); }
+    }
+    for (int r = VMTOY_R0; r <= VMTOY_COND; ++r) {
+        vmtoy_set_reg(copy, r, vmtoy_reg(vm, r));
+    }
+    uint64_t h = vmtoy_state_hash(copy);
+    vmtoy_destroy(copy);
+    return h;
+}
+
+static void from_template(void)
+{
+    vmtoy* vm = hashed_vm();
+    vmtoy_template* t = vmtoy_template_create(vm);
+    CHECK(t != NULL);
+    if (!t) { return; }
+    vmtoy* child = vmtoy_create_from_template(t);
+    CHECK(child != NULL);
+    if (child) {
+        CHECK(vmtoy_state_hash(child) == vmtoy_state_hash(vm));
+        vmtoy_set_io(child, &quiet_io);
+        CHECK(vmtoy_run_for(child, 100) == VMTOY_EXIT_HALT);
+        CHECK(vmtoy_state_hash(child) == full_hash(child));
+        vmtoy_destroy(child);
+    }
+    vmtoy_template_destroy(t);
+    vmtoy_destroy(vm);
+}
+
+static void lazy_snapshot(const char* path)
+{
+    vmtoy* vm = hashed_vm();
+    CHECK(vmtoy_snapshot_save(vm, path));
+    vmtoy* r = vmtoy_snapshot_restore(path, VMTOY_RESTORE_LAZY);
+    CHECK(r != NULL);
+    if (r) {
+        // Nothing's been touched, so nothing's been read.
+        CHECK(vmtoy_memory_footprint(r) == 0);
+        CHECK(vmtoy_state_hash(r) == vmtoy_state_hash(vm));
+        vmtoy_destroy(r);
+    }
+    vmtoy_destroy(vm);
+}
+
+static void checkpoints(const char* base, const char* log)
+{
+    vmtoy* vm = hashed_vm();
+    vmtoy_checkpoint* c = vmtoy_checkpoint_start(vm, base, log, 0);
+    CHECK(c != NULL);
+    if (!c) { return; }
+    CHECK(vmtoy_run_for(vm, 100) == VMTOY_EXIT_HALT);
+    vmtoy_write_mem(vm, 0x0100, 2);
+    CHECK(vmtoy_checkpoint_write(c));
+    vmtoy_checkpoint_close(c);
+
+    vmtoy* r = vmtoy_checkpoint_restore(base, log, VMTOY_RESTORE_LAZY);
+    CHECK(r != NULL);
+    if (r) {
+        // Just the two pages in the log.
+        CHECK(vmtoy_memory_footprint(r) < 131072);
+        CHECK(vmtoy_state_hash(r) == vmtoy_state_hash(vm));
+        vmtoy_destroy(r);
+    }
+
+    CHECK(vmtoy_checkpoint_compact(base, log));
+    r = vmtoy_checkpoint_restore(base, log, VMTOY_RESTORE_LAZY);
+    CHECK(r != NULL);
+    if (r) {
+        CHECK(vmtoy_state_hash(r) == vmtoy_state_hash(vm));
+        CHECK(vmtoy_state_hash(r) == full_hash(r));
+        vmtoy_destroy(r);
+    }
+    vmtoy_destroy(vm);
+}
+
+int main(void)
+{
+    char base[] = "/tmp/vmtoy-test-XXXXXX";
+    char log[] = "/tmp/vmtoy-test-XXXXXX";
+    int fd1 = mkstemp(base);
+    int fd2 = mkstemp(log);
+    if (fd1 < 0 || fd2 < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd1);
+    close(fd2);
+
+    from_template();
+    lazy_snapshot(base);
+    checkpoints(base, log);
+
+    unlink(base);
+    unlink(log);
+    return check_result();
+}